@@ -4,6 +4,16 @@
 
 
 #include "ImgProcUtility.h"
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#include <pthread.h>
+#endif      // #ifdef _WIN32
 
 #define IPL_SAME_FORMAT(a, b)		\
 			( a != NULL && b != NULL && a->width == b->width && a->height == b->height && \
@@ -161,6 +171,87 @@ void CImageUtility::safeReleaseImage(IplImage **iplImage1, IplImage **iplImage2,
 	return;
 }
 
+// -------------------------------------------------
+// pool of released images
+// Images released by releaseImage() are kept and given back by
+// createImage() for the same width, height, depth and channels,
+// so that the intermediate images of a frame are not re-allocated
+// for the next frame. The pool is capped in images and in bytes: the
+// least recently released images are freed to make room for a new
+// one, so that images of a former size do not stay pinned. The pool
+// is shared by all the threads and protected by a lock.
+// -------------------------------------------------
+#define IMAGE_POOL_SIZE		64			// max. number of images kept in the pool
+#ifndef IMAGE_POOL_BYTES
+#define IMAGE_POOL_BYTES	((size_t)512 << 20)	// max. size of the image buffers kept in the pool
+#endif      // #ifndef IMAGE_POOL_BYTES
+#define IMAGE_ROW_ALIGN		64			// alignment of the image buffers and rows, in bytes
+
+#ifdef _WIN32
+static SRWLOCK g_imagePoolLock = SRWLOCK_INIT;
+#define IMAGE_POOL_LOCK()	AcquireSRWLockExclusive(&g_imagePoolLock)
+#define IMAGE_POOL_UNLOCK()	ReleaseSRWLockExclusive(&g_imagePoolLock)
+#else
+static pthread_mutex_t g_imagePoolLock = PTHREAD_MUTEX_INITIALIZER;
+#define IMAGE_POOL_LOCK()	pthread_mutex_lock(&g_imagePoolLock)
+#define IMAGE_POOL_UNLOCK()	pthread_mutex_unlock(&g_imagePoolLock)
+#endif      // #ifdef _WIN32
+
+static IplImage *g_imagePool[IMAGE_POOL_SIZE];				// released images, NULL for an empty slot
+static unsigned long long g_imagePoolTime[IMAGE_POOL_SIZE];	// release order of the pooled images
+static unsigned long long g_imagePoolClock = 0;				// releases into the pool
+static size_t g_imagePoolBytes = 0;							// size of the image buffers in the pool
+static unsigned long long g_imagePoolHits = 0;				// images taken from the pool
+static unsigned long long g_imagePoolMisses = 0;			// images allocated
+
+static char *allocImageData(size_t size)
+// aligned buffer of an image, freed by freeImageData()
+{
+#ifdef _WIN32
+	return (char *)_aligned_malloc(size, IMAGE_ROW_ALIGN);
+#else
+	void *data = NULL;
+	return posix_memalign(&data, IMAGE_ROW_ALIGN, size) == 0 ? (char *)data : NULL;
+#endif      // #ifdef _WIN32
+}
+
+static void freeImageData(char *data)
+{
+#ifdef _WIN32
+	_aligned_free(data);
+#else
+	free(data);
+#endif      // #ifdef _WIN32
+}
+
+static void freePooledImage(IplImage *iplImage)
+{
+	if (iplImage->imageData != NULL) freeImageData(iplImage->imageData);
+	delete [] (char *)iplImage;
+}
+
+void CImageUtility::resetImagePool()
+{
+	IMAGE_POOL_LOCK();
+	for (int i = 0; i < IMAGE_POOL_SIZE; i++) {
+		if (g_imagePool[i] != NULL) {
+			freePooledImage(g_imagePool[i]);
+			g_imagePool[i] = NULL;
+		}
+	}
+	g_imagePoolBytes = 0;
+	IMAGE_POOL_UNLOCK();
+}
+
+void CImageUtility::getImagePoolStats(unsigned long long &hits, unsigned long long &misses, size_t &pooled_bytes)
+{
+	IMAGE_POOL_LOCK();
+	hits = g_imagePoolHits;
+	misses = g_imagePoolMisses;
+	pooled_bytes = g_imagePoolBytes;
+	IMAGE_POOL_UNLOCK();
+}
+
 IplImage *CImageUtility::createImage( CvSize size, int depth, int channels )
 {
 	// -------------------------------------------------
@@ -217,6 +308,26 @@ IplImage *CImageUtility::createImage( int width, int height, int depth, int chan
 	const unsigned int depth_sign = 0x80000000;
 	const int ipl_orgin_tl = 0;
 
+	// take a released image of the same format from the pool
+	const int nb_channels = channels < 1 ? 1 : channels;
+	IplImage *iplPooled = NULL;
+	IMAGE_POOL_LOCK();
+	for (int i = 0; i < IMAGE_POOL_SIZE && iplPooled == NULL; i++) {
+		if (g_imagePool[i] != NULL && g_imagePool[i]->width == width && g_imagePool[i]->height == height &&
+			g_imagePool[i]->depth == depth && g_imagePool[i]->nChannels == nb_channels) {
+			iplPooled = g_imagePool[i];
+			g_imagePool[i] = NULL;
+			g_imagePoolBytes -= iplPooled->imageSize;
+		}
+	}
+	if (iplPooled != NULL)
+		g_imagePoolHits++;
+	else
+		g_imagePoolMisses++;
+	IMAGE_POOL_UNLOCK();
+	if (iplPooled != NULL)
+		return iplPooled;
+
 	// cvCreateImageHeader ()
 	iplImage = (IplImage *)new char[sizeof(*iplImage)];
 
@@ -279,28 +390,18 @@ IplImage *CImageUtility::createImage( int width, int height, int depth, int chan
     iplImage->nChannels = channels < 1 ? 1 : channels;
     iplImage->depth = depth;
 
-#ifdef __SR_USE_SIMD        // use aligned image data buffer for SIMD implementation
-    const int simd_image_row_align = 64;
-    iplImage->align = simd_image_row_align;
-    iplImage->widthStep = (((iplImage->width * iplImage->nChannels *
-						                  (iplImage->depth & ~depth_sign) + 7)/8)+ simd_image_row_align - 1) & (~(simd_image_row_align - 1));
-    iplImage->origin = ipl_orgin_tl;
-    iplImage->imageSize = iplImage->widthStep * iplImage->height;
-    iplImage->imageData = (char *)_aligned_malloc(iplImage->imageSize, 64);
-#else
-    iplImage->align = 4;//default_image_row_align;
-    //iplImage->widthStep = (((iplImage->width * iplImage->nChannels *
-	//					   (iplImage->depth & ~depth_sign) + 7)/8)+ default_image_row_align - 1) & (~(default_image_row_align - 1));
+    // use 64-byte aligned rows and image buffer for the SIMD implementations
+    // and the image pool, whatever __SR_USE_SIMD
+    iplImage->align = IMAGE_ROW_ALIGN;
     iplImage->widthStep = (((iplImage->width * iplImage->nChannels *
-						   (iplImage->depth & ~depth_sign) + 7)/8)+ 4 - 1) & (~(4 - 1));
+						   (iplImage->depth & ~depth_sign) + 7)/8)+ IMAGE_ROW_ALIGN - 1) & (~(IMAGE_ROW_ALIGN - 1));
     iplImage->origin = ipl_orgin_tl;
     iplImage->imageSize = iplImage->widthStep * iplImage->height;
 	// end of cvInitImageHeader()
 	// end of cvCreateImageHeader ()
 
 	// cvCreateData()
-    iplImage->imageData = new char[iplImage->imageSize];
-#endif
+    iplImage->imageData = allocImageData(iplImage->imageSize);
 
 	if (iplImage->imageData == NULL) {
 		showErrMsg("Fail to allocate image buffer in CImageUtility::createImage()!\n");
@@ -334,13 +435,44 @@ void CImageUtility::releaseImage(IplImage **pImg)
 	if ((*pImg)->maskROI != NULL) delete (*pImg)->maskROI;
 	if ((*pImg)->imageId != NULL) delete (*pImg)->imageId;
 	if ((*pImg)->tileInfo != NULL) delete (*pImg)->tileInfo;
-#ifdef __SR_USE_SIMD
-    if ((*pImg)->imageData != NULL) _aligned_free((*pImg)->imageData);
-#else
-	if ((*pImg)->imageData != NULL) delete [] (*pImg)->imageData;
-#endif      // #ifndef __SR_USE_SIMD
-
-    delete [] (*pImg);
+	(*pImg)->roi = NULL;
+	(*pImg)->maskROI = NULL;
+	(*pImg)->imageId = NULL;
+	(*pImg)->tileInfo = NULL;
+
+	// keep the image in the pool, evicting the least recently released
+	// images while there is no free slot or the pool would exceed
+	// IMAGE_POOL_BYTES. An image larger than the pool is freed
+	IplImage *iplEvicted[IMAGE_POOL_SIZE];
+	int nb_evicted = 0;
+	bool pooled = false;
+	const size_t size = (size_t)(*pImg)->imageSize;
+	IMAGE_POOL_LOCK();
+	if ((*pImg)->imageData != NULL && size <= IMAGE_POOL_BYTES) {
+		int i = -1;
+		for (;;) {
+			int oldest = -1;
+			i = -1;
+			for (int k = 0; k < IMAGE_POOL_SIZE; k++) {
+				if (g_imagePool[k] == NULL) {
+					if (i < 0) i = k;
+				}
+				else if (oldest < 0 || g_imagePoolTime[k] < g_imagePoolTime[oldest])
+					oldest = k;
+			}
+			if (i >= 0 && g_imagePoolBytes + size <= IMAGE_POOL_BYTES) break;
+			iplEvicted[nb_evicted++] = g_imagePool[oldest];
+			g_imagePoolBytes -= g_imagePool[oldest]->imageSize;
+			g_imagePool[oldest] = NULL;
+		}
+		g_imagePool[i] = (*pImg);
+		g_imagePoolTime[i] = ++g_imagePoolClock;
+		g_imagePoolBytes += size;
+		pooled = true;
+	}
+	IMAGE_POOL_UNLOCK();
+	for (int k = 0; k < nb_evicted; k++) freePooledImage(iplEvicted[k]);
+	if (!pooled) freePooledImage(*pImg);
 
 	(*pImg) = NULL;
 
@@ -746,6 +746,13 @@ public:
     static IplImage *createImage(IplImage *iplImage);
 	static void releaseImage(IplImage **pImg);
 
+	// pool of released images reused by createImage() (in-house functions only)
+	// The rows of the images are 64-byte aligned. An image is taken back from the pool
+	// only if its width, height, depth and channels are the same. The pool keeps at most
+	// 64 images and IMAGE_POOL_BYTES bytes, the oldest ones are freed first. Thread-safe.
+	static void resetImagePool();			// free all the pooled images
+	static void getImagePoolStats(unsigned long long &hits, unsigned long long &misses, size_t &pooled_bytes);
+
 	// load and save image
 	static bool saveImage8U(char stFilename[], IplImage *iplImage, int quality = 100);
 	static IplImage *loadImage(char stFilename[], int &bit_depth);
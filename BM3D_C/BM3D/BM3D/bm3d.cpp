@@ -21,10 +21,15 @@
 #include <iostream>
 #include <algorithm>
 #include <math.h>
+#include <string.h>
+#ifdef __SR_USE_SIMD
+#include <emmintrin.h>
+#endif      // #ifdef __SR_USE_SIMD
 
 #include "bm3d.h"
 #include "utilities.h"
 #include "lib_transforms.h"
+#include "simd_kernels.h"
 
 #define SQRT2     1.414213562373095
 #define SQRT2_INV 0.7071067811865475
@@ -38,6 +43,36 @@
 
 using namespace std;
 
+// Kaiser windows (beta = 2) used for the aggregation, for the patch
+// sizes 8 and 12. Other sizes use a flat window.
+static const float kaiser_window_8[8 * 8] =
+{
+	0.1924f, 0.2989f, 0.3846f, 0.4325f, 0.4325f, 0.3846f, 0.2989f, 0.1924f,
+	0.2989f, 0.4642f, 0.5974f, 0.6717f, 0.6717f, 0.5974f, 0.4642f, 0.2989f,
+	0.3846f, 0.5974f, 0.7688f, 0.8644f, 0.8644f, 0.7688f, 0.5974f, 0.3846f,
+	0.4325f, 0.6717f, 0.8644f, 0.9718f, 0.9718f, 0.8644f, 0.6717f, 0.4325f,
+	0.4325f, 0.6717f, 0.8644f, 0.9718f, 0.9718f, 0.8644f, 0.6717f, 0.4325f,
+	0.3846f, 0.5974f, 0.7688f, 0.8644f, 0.8644f, 0.7688f, 0.5974f, 0.3846f,
+	0.2989f, 0.4642f, 0.5974f, 0.6717f, 0.6717f, 0.5974f, 0.4642f, 0.2989f,
+	0.1924f, 0.2989f, 0.3846f, 0.4325f, 0.4325f, 0.3846f, 0.2989f, 0.1924f
+};
+
+static const float kaiser_window_12[12 * 12] =
+{
+	0.1924f, 0.2615f, 0.3251f, 0.3782f, 0.4163f, 0.4362f, 0.4362f, 0.4163f, 0.3782f, 0.3251f, 0.2615f, 0.1924f,
+	0.2615f, 0.3554f, 0.4419f, 0.5139f, 0.5657f, 0.5927f, 0.5927f, 0.5657f, 0.5139f, 0.4419f, 0.3554f, 0.2615f,
+	0.3251f, 0.4419f, 0.5494f, 0.6390f, 0.7033f, 0.7369f, 0.7369f, 0.7033f, 0.6390f, 0.5494f, 0.4419f, 0.3251f,
+	0.3782f, 0.5139f, 0.6390f, 0.7433f, 0.8181f, 0.8572f, 0.8572f, 0.8181f, 0.7433f, 0.6390f, 0.5139f, 0.3782f,
+	0.4163f, 0.5657f, 0.7033f, 0.8181f, 0.9005f, 0.9435f, 0.9435f, 0.9005f, 0.8181f, 0.7033f, 0.5657f, 0.4163f,
+	0.4362f, 0.5927f, 0.7369f, 0.8572f, 0.9435f, 0.9885f, 0.9885f, 0.9435f, 0.8572f, 0.7369f, 0.5927f, 0.4362f,
+	0.4362f, 0.5927f, 0.7369f, 0.8572f, 0.9435f, 0.9885f, 0.9885f, 0.9435f, 0.8572f, 0.7369f, 0.5927f, 0.4362f,
+	0.4163f, 0.5657f, 0.7033f, 0.8181f, 0.9005f, 0.9435f, 0.9435f, 0.9005f, 0.8181f, 0.7033f, 0.5657f, 0.4163f,
+	0.3782f, 0.5139f, 0.6390f, 0.7433f, 0.8181f, 0.8572f, 0.8572f, 0.8181f, 0.7433f, 0.6390f, 0.5139f, 0.3782f,
+	0.3251f, 0.4419f, 0.5494f, 0.6390f, 0.7033f, 0.7369f, 0.7369f, 0.7033f, 0.6390f, 0.5494f, 0.4419f, 0.3251f,
+	0.2615f, 0.3554f, 0.4419f, 0.5139f, 0.5657f, 0.5927f, 0.5927f, 0.5657f, 0.5139f, 0.4419f, 0.3554f, 0.2615f,
+	0.1924f, 0.2615f, 0.3251f, 0.3782f, 0.4163f, 0.4362f, 0.4362f, 0.4163f, 0.3782f, 0.3251f, 0.2615f, 0.1924f
+};
+
 
 void Swap(TD * td, int x, int y)
 {
@@ -68,44 +103,53 @@ void SelectSort(TD * &td, unsigned size)
 
 
 //
-// @brief run BM3D process. Depending on if OpenMP is used or not,
-//        and on the number of available threads, it divides the noisy
-//        image in sub_images, to process them in parallel.
+// @brief Report the part of the planes of a run which was backed by
+//        huge pages, when they are enabled (see huge_pages_mode()).
 //
-// @param sigma: value of assumed noise of the noisy image;
-// @param img_noisy: noisy image;
-// @param img_basic: will be the basic estimation after the 1st step
-// @param img_denoised: will be the denoised final image;
-// @param width, height, chnls: size of the image;
-// @param useSD_h (resp. useSD_w): if true, use weight based
-//        on the standard variation of the 3D group for the
-//        first (resp. second) step, otherwise use the number
-//        of non-zero coefficients after Hard Thresholding
-//        (resp. the norm of Wiener coefficients);
-// @param tau_2D_hard (resp. tau_2D_wien): 2D transform to apply
-//        on every 3D group for the first (resp. second) part.
-//        Allowed values are DCT and BIOR;
-// @param color_space: Transformation from RGB to YUV. Allowed
-//        values are RGB (do nothing), YUV, YCBCR and OPP.
+// @param plane_bytes_0, huge_bytes_0: huge_pages_stats() at the start of
+//        the run, whose planes must all be freed.
 //
-// @return EXIT_FAILURE if color_space has not expected
-//         type, otherwise return EXIT_SUCCESS.
+static void huge_pages_report(const unsigned long long plane_bytes_0, const unsigned long long huge_bytes_0)
+{
+	if (huge_pages_mode() == HUGE_PAGES_OFF)
+		return;
+	unsigned long long plane_bytes, huge_bytes;
+	huge_pages_stats(plane_bytes, huge_bytes);
+	cout << "huge pages (" << (huge_pages_mode() == HUGE_PAGES_THP ? "thp" : "hugetlb") << "): "
+		<< (huge_bytes - huge_bytes_0) / 1048576.0 << " MB of the " << (plane_bytes - plane_bytes_0) / 1048576.0
+		<< " MB of planes backed by 2 MB pages" << endl;
+}
+
+BM3DDenoiser::BM3DDenoiser() : width(0), height(0), chnls(0), depth(0), sigma(0.0f), images(NULL), tiles(NULL),
+	output(NULL), verbose(false)
+{
+}
+
+//
+// @brief Allocate all the memory of the denoiser: the images, the tiles
+//        fitting the memory budget (see bm3d_plan_tiles()), the
+//        workspace of the steps prepared for both of them on the largest
+//        tile, and the denoised IplImage if owned.
+//
+// @param width, height, chnls: size of the frames;
+// @param depth: depth of the frames, SR_DEPTH_8U, SR_DEPTH_16U or
+//        SR_DEPTH_32F;
+// @param sigma: value of assumed noise of the frames;
+// @param memory_budget: maximum size in bytes of the buffers of the
+//        denoiser, 0 to read it from BM3D_MEMORY_BUDGET_ENV (no budget
+//        if unset). The tiles, the halo and the predicted peak are
+//        reported if verbose;
+// @param own_output: if false, output is not allocated and each frame
+//        is denoised in an image given to denoise().
+//
+// @return EXIT_FAILURE if the budget is too small or an allocation
+//         failed, otherwise EXIT_SUCCESS.
 //
-IplImage * run_bm3d(IplImage * iplImage, const float sigma)
+int BM3DDenoiser::init(const unsigned int width, const unsigned int height, const unsigned int chnls, const int depth,
+	const float sigma, const size_t memory_budget, const bool own_output)
 {
-	const unsigned int width = iplImage->width;
-	const unsigned int height = iplImage->height;
-	const unsigned int chnls = iplImage->nChannels;
-	const bool useSD_h = false;
-	const bool useSD_w = true;
 	const unsigned int tau_2D_hard = 5;
 	const unsigned int tau_2D_wien = 4;
-	const unsigned int color_space = 2;
-
-	float * img = transfer_iplImage2buffer(iplImage);
-
-	float * img_basic = new float[width * height * chnls];
-	float * img_denoised = new float[width * height * chnls];
 
 	// Parameters
 	const unsigned int nHard = 7; // Half size of the search window
@@ -117,637 +161,1684 @@ IplImage * run_bm3d(IplImage * iplImage, const float sigma)
 	const unsigned int pHard = 3;
 	const unsigned int pWien = 3;
 
-	// Transformation to YUV color space
-	if (color_space_transform(img, color_space, width, height, chnls, true))
+	release();
+	if (depth != SR_DEPTH_8U && depth != SR_DEPTH_16U && depth != SR_DEPTH_32F)
 	{
-		return NULL;
+		cout << "Wrong depth of image. Must be 8U, 16U or 32F!!" << endl;
+		return EXIT_FAILURE;
+	}
+	this->width = width;
+	this->height = height;
+	this->chnls = chnls;
+	this->depth = depth;
+	this->sigma = sigma;
+
+	// Tiles fitting the memory budget
+	const size_t budget = (memory_budget ? memory_budget : memory_budget_env());
+	if (!bm3d_plan_tiles(plan, width, height, chnls, (depth & 0xFF) / 8, budget,
+		nHard, kHard, NHard, pHard, nWien, kWien, NWien, pWien))
+	{
+		if (verbose)
+			cout << "memory: budget of " << budget / 1048576.0 << " MB below the " << plan.peak_bytes / 1048576.0
+				<< " MB needed by the smallest tiles" << endl;
+		return EXIT_FAILURE;
+	}
+	if (verbose)
+	{
+		cout << "memory: " << plan.nb_x << " x " << plan.nb_y << " tiles (halo " << plan.halo << "), predicted peak "
+			<< plan.peak_bytes / 1048576.0 << " MB";
+		if (budget)
+			cout << " for a budget of " << budget / 1048576.0 << " MB";
+		cout << endl;
 	}
 
-    IplImage * iplImage_ = color_space_transform(iplImage, true);
-
-	unsigned nb_threads = 1;
-	fftwf_plan* plan_2d_for_1 = new fftwf_plan[nb_threads];
-	fftwf_plan* plan_2d_for_2 = new fftwf_plan[nb_threads];
-	fftwf_plan* plan_2d_inv = new fftwf_plan[nb_threads];
-
-
-	// In the simple case
-	// Add boundaries and symetrize them
-	const unsigned h_b = height + 2 * nHard;
-	const unsigned w_b = width + 2 * nHard;
-
-	// padding
-    IplImage * iplImage_sym = symetrize(iplImage_, nHard);
-    float * img_sym_noisy = transfer_iplImage2buffer(iplImage_sym);
-
-	// Allocating Plan for FFTW process
-	if (tau_2D_hard == DCT)
+	// Noisy, basic and denoised images, and tiles when the image is split.
+	// The boundaries needed by the block matching and the 2D transforms
+	// are mirrored on the fly by both steps
+	unsigned int tile_w, tile_h;
+	bm3d_tile_size(plan, tile_w, tile_h);
+	const size_t size = (size_t)width * height * chnls;
+	images = plane_alloc<float>(3 * size, false, MEM_STAGE_IMAGES);
+	if (plan.nb_x * plan.nb_y > 1)
+		tiles = plane_alloc<float>(3 * (size_t)tile_w * tile_h * chnls, false, MEM_STAGE_IMAGES);
+	if (own_output)
+		output = CImageUtility::createImage(width, height, depth, chnls);
+	if (!images || (plan.nb_x * plan.nb_y > 1 && !tiles) || (own_output && !output)
+		|| !workspace.prepare(1, tile_w, tile_h, chnls, tau_2D_hard, nHard, kHard, NHard, pHard)
+		|| !workspace.prepare(2, tile_w, tile_h, chnls, tau_2D_wien, nWien, kWien, NWien, pWien))
 	{
-		const unsigned nb_cols = ind_size(w_b - kHard + 1, nHard, pHard);
-		allocate_plan_2d(&plan_2d_for_1[0], kHard, FFTW_REDFT10,
-			w_b * (2 * nHard + 1) * chnls);
-		allocate_plan_2d(&plan_2d_for_2[0], kHard, FFTW_REDFT10,
-			w_b * pHard * chnls);
-		allocate_plan_2d(&plan_2d_inv[0], kHard, FFTW_REDFT01,
-			NHard * nb_cols * chnls);
+		CImageUtility::showErrMsg("Fail to allocate buffer in BM3DDenoiser::init!\n");
+		release();
+		return EXIT_FAILURE;
 	}
 
-	// Denoising, 1st Step
-	cout << "step 1...";
-    IplImage * iplImage_sym_basic = bm3d_1st_step(iplImage_sym, sigma, plan_2d_for_1,
-                                                  plan_2d_for_2, plan_2d_inv);
-	cout << "done." << endl;
+#ifdef _BM3D_USE_FFTW
+	// Plans for FFTW process, taken from the plan cache. The 2D DCT are
+	// processed by batches of FFTW_PLAN_BATCH patches, so the plans do
+	// not depend on the size of the image
+	if (tau_2D_hard == DCT)
+		plan_hard[0] = plan_cache_get_2d(kHard, FFTW_REDFT10, FFTW_PLAN_BATCH, 0);
+	if (tau_2D_wien == DCT)
+		plan_wien[0] = plan_cache_get_2d(kWien, FFTW_REDFT10, FFTW_PLAN_BATCH, 0);
+#endif      // #ifdef _BM3D_USE_FFTW
 
-    float * img_sym_basic = transfer_iplImage2buffer(iplImage_sym_basic);
+	// Instruction set of the kernels, selected from cpuid
+	if (verbose)
+		cout << "kernels: " << simd_isa_name(simd_isa()) << endl;
 
-	// To avoid boundaries problem
-	for (unsigned c = 0; c < chnls; c++)
+	return EXIT_SUCCESS;
+}
+
+//
+// @brief Denoise a frame with the memory of the denoiser. Nothing is
+//        allocated: the frame is ingested in the noisy image, both
+//        steps run tile by tile in the workspace, and the denoised image
+//        is written in iplImage_denoised, or in output.
+//
+// @param iplImage: frame of the size and depth given to init();
+// @param iplImage_denoised: will contain the denoised frame, same size
+//        and depth as iplImage, NULL to use output. It may be iplImage
+//        itself, which is fully read before being written.
+//
+// @return the denoised frame (output is overwritten by the next frame),
+//         NULL if a frame has not the expected size or the denoising
+//         failed.
+//
+IplImage * BM3DDenoiser::denoise(IplImage * iplImage, IplImage * iplImage_denoised)
+{
+	const unsigned int color_space = 2;
+	if (!iplImage_denoised)
+		iplImage_denoised = output;
+	if (!images || !iplImage_denoised
+		|| (unsigned int)iplImage->width != width || (unsigned int)iplImage->height != height
+		|| (unsigned int)iplImage->nChannels != chnls || iplImage->depth != depth
+		|| iplImage_denoised->width != iplImage->width || iplImage_denoised->height != iplImage->height
+		|| iplImage_denoised->nChannels != iplImage->nChannels || iplImage_denoised->depth != depth)
 	{
-		const unsigned dc_b = c * w_b * h_b + nHard * w_b + nHard;
-		unsigned dc = c * width * height;
-		for (unsigned i = 0; i < height; i++)
-			for (unsigned j = 0; j < width; j++, dc++)
-			{
-				img_basic[dc] = img_sym_basic[dc_b + i * w_b + j];
-			}
+		cout << "Wrong size of the frame. Must be the one given to the denoiser!!" << endl;
+		return NULL;
 	}
-	symetrize(img_basic, img_sym_basic, width, height, chnls, nHard);
 
+	const size_t size = (size_t)width * height * chnls;
+	const PlanarImage noisy(images, width, height, chnls);
+	const PlanarImage basic(images + size, width, height, chnls);
+	const PlanarImage denoised(images + 2 * size, width, height, chnls);
 
-	// Allocating Plan for FFTW process
-	if (tau_2D_wien == DCT)
+	// Conversion to planar float and transformation to YUV color space
+	int status = transfer_iplImage2buffer(iplImage, noisy, color_space);
+
+	// Denoising, 1st Step
+	if (status == EXIT_SUCCESS)
 	{
-		const unsigned nb_cols = ind_size(w_b - kWien + 1, nWien, pWien);
-		allocate_plan_2d(&plan_2d_for_1[0], kWien, FFTW_REDFT10,
-			w_b * (2 * nWien + 1) * chnls);
-		allocate_plan_2d(&plan_2d_for_2[0], kWien, FFTW_REDFT10,
-			w_b * pWien * chnls);
-		allocate_plan_2d(&plan_2d_inv[0], kWien, FFTW_REDFT01,
-			NWien * nb_cols * chnls);
+		if (verbose)
+			cout << "step 1...";
+		status = bm3d_step_tiles(plan, 1, noisy, basic, denoised, sigma, plan_hard, plan_hard, &skip_stats,
+			&workspace, tiles);
+		if (verbose)
+			cout << "done." << endl;
 	}
 
 	// Denoising, 2nd Step
-	cout << "step 2...";
-    IplImage * iplImage_sym_denoised = bm3d_2nd_step(iplImage_sym, iplImage_sym_basic,
-                                                     sigma, plan_2d_for_1, plan_2d_for_2,
-                                                     plan_2d_inv);
-	cout << "done." << endl;
-    float * img_sym_denoised = transfer_iplImage2buffer(iplImage_sym_denoised);
-	// Obtention of img_denoised
-	for (unsigned c = 0; c < chnls; c++)
+	if (status == EXIT_SUCCESS)
 	{
-		const unsigned dc_b = c * w_b * h_b + nWien * w_b + nWien;
-		unsigned dc = c * width * height;
-		for (unsigned i = 0; i < height; i++)
-			for (unsigned j = 0; j < width; j++, dc++)
-				img_denoised[dc] = img_sym_denoised[dc_b + i * w_b + j];
+		if (verbose)
+			cout << "step 2...";
+		status = bm3d_step_tiles(plan, 2, noisy, basic, denoised, sigma, plan_wien, plan_wien, NULL,
+			&workspace, tiles);
+		if (verbose)
+			cout << "done." << endl;
 	}
 
-	// Inverse color space transform to RGB
-	if (color_space_transform(img_denoised, color_space, width, height, chnls, false)
-		!= EXIT_SUCCESS) return NULL;
+	// Inverse color space transform, clipping and conversion to the depth
+	// of the frame, in one pass
+	if (status == EXIT_SUCCESS)
+		status = transfer_buffer2iplImage(denoised, color_space, iplImage_denoised);
 
-	if (color_space_transform(img, color_space, width, height, chnls, false)
-		!= EXIT_SUCCESS) return NULL;
+	return (status == EXIT_SUCCESS ? iplImage_denoised : NULL);
+}
 
-	if (color_space_transform(img_basic, color_space, width, height, chnls, false)
-		!= EXIT_SUCCESS) return NULL;
+//
+// @brief Free all the memory of the denoiser (the plans themselves
+//        belong to the plan cache).
+//
+void BM3DDenoiser::release()
+{
+	workspace.release();
+	plane_free(images);
+	plane_free(tiles);
+	CImageUtility::safeReleaseImage(&output);
 
-	iplImage = transfer_buffer2iplImage(img, width, height, chnls, true);
-    IplImage * iplImage_basic = transfer_buffer2iplImage(img_basic, width, height, chnls, true);
-	IplImage * iplImage_denoised = transfer_buffer2iplImage(img_denoised, width, height, chnls, true);
+	images = NULL;
+	tiles = NULL;
+}
 
-	// Free Memory
-	if (tau_2D_hard == DCT || tau_2D_wien == DCT)
-		for (unsigned n = 0; n < nb_threads; n++)
-		{
-			fftwf_destroy_plan(plan_2d_for_1[n]);
-			fftwf_destroy_plan(plan_2d_for_2[n]);
-			fftwf_destroy_plan(plan_2d_inv[n]);
-		}
-	fftwf_cleanup();
+//
+// @brief run BM3D process on a single image, with a BM3DDenoiser
+//        whose denoised image is given to the caller. Depending on the
+//        memory budget, it divides the noisy image in tiles, processed
+//        one after the other with a halo around them, see
+//        bm3d_plan_tiles().
+//
+// @param sigma: value of assumed noise of the noisy image;
+// @param memory_budget: maximum size in bytes of the buffers of the
+//        process, 0 to read it from BM3D_MEMORY_BUDGET_ENV (no budget
+//        if unset). The tiles, the halo and the predicted peak are
+//        reported, then the peak really used by the process, and the
+//        peak of each stage if BM3D_MEMORY_REPORT_ENV is set;
+// @param img_noisy: noisy image;
+// @param img_basic: will be the basic estimation after the 1st step
+// @param img_denoised: will be the denoised final image;
+// @param width, height, chnls: size of the image;
+// @param useSD_h (resp. useSD_w): if true, use weight based
+//        on the standard variation of the 3D group for the
+//        first (resp. second) step, otherwise use the number
+//        of non-zero coefficients after Hard Thresholding
+//        (resp. the norm of Wiener coefficients);
+// @param tau_2D_hard (resp. tau_2D_wien): 2D transform to apply
+//        on every 3D group for the first (resp. second) part.
+//        Allowed values are DCT and BIOR;
+// @param color_space: Transformation from RGB to YUV. Allowed
+//        values are RGB (do nothing), YUV, YCBCR and OPP.
+//
+// @return the denoised image, NULL if the image can't be denoised.
+//
+IplImage * run_bm3d(IplImage * iplImage, const float sigma, const size_t memory_budget)
+{
+	unsigned long long plane_bytes_0, huge_bytes_0;
+	huge_pages_stats(plane_bytes_0, huge_bytes_0);
+	mem_stats_reset_peaks();
+
+	BM3DDenoiser denoiser;
+	denoiser.verbose = true;
+	IplImage * iplImage_denoised = NULL;
+	if (denoiser.init(iplImage->width, iplImage->height, iplImage->nChannels, iplImage->depth, sigma,
+		memory_budget) == EXIT_SUCCESS)
+		iplImage_denoised = denoiser.denoise(iplImage);
+
+	// Work skipped on the zero columns of the thresholded groups
+	const SkipStats & skip_stats = denoiser.skip_stats;
+	if (skip_stats.columns > 0)
+	{
+		cout << "skipped: " << 100.0 * (skip_stats.columns_zero + skip_stats.columns_dc) / skip_stats.columns
+			<< "% of the inverse Hadamard columns (" << 100.0 * skip_stats.columns_zero / skip_stats.columns
+			<< "% zero)";
+		if (skip_stats.patches > 0)
+			cout << ", " << 100.0 * (skip_stats.patches_zero + skip_stats.patches_copy) / skip_stats.patches
+				<< "% of the 2D inverse patches";
+		cout << endl;
+	}
 
-	delete[] img_denoised;
-	delete[] img_basic;
+	// The denoised image is kept by the caller, the rest is freed
+	if (iplImage_denoised)
+		denoiser.output = NULL;
+	denoiser.release();
 
-	img_denoised = NULL;
-	img_basic = NULL;
+	// Peak really used, by the whole process
+	cout << "memory: process peak " << peak_memory_bytes() / 1048576.0 << " MB" << endl;
+	huge_pages_report(plane_bytes_0, huge_bytes_0);
+	if (mem_stats_on)
+		mem_stats_report();
 
     return iplImage_denoised;
 }
 
-float * transfer_iplImage2buffer(IplImage * iplImage) 
+//
+// @brief Ingest of a row of pixels in the planes of a color space,
+//        generic code of the ingest_row_* kernels.
+//
+// @param src: row of width pixels of chnls channels, interleaved;
+// @param dst: first pixel of the row in the first plane;
+// @param plane_size: size of a plane;
+// @param mat: matrix of the color space, applied on (red, green, blue)
+//        when chnls == 3, see color_space_matrix().
+//
+template <class T>
+void ingest_row(const T * src, float * dst, const unsigned plane_size, const unsigned width,
+	const unsigned chnls, const float * mat)
 {
-	const unsigned int width = iplImage->width;
-	const unsigned int height = iplImage->height;
-	const unsigned int chnls = iplImage->nChannels;
-
-	float * vec = new float[width * height * chnls];
-	if (!vec)
+	if (chnls == 3)
 	{
-		delete[] vec;
-		vec = NULL;
-	}
-    if (SR_DEPTH_8U == iplImage->depth)
-    {
-        for (int y = 0; y < iplImage->height; y++)
-        {
-            unsigned char *pSrc = (unsigned char *)((char *)iplImage->imageData + y * iplImage->widthStep);
-            for (int x = 0; x < iplImage->width; x++)
-            {
-                for (unsigned int c = 0; c < chnls; c++)
-                {
-                    vec[chnls * x + c + y * width * chnls] = pSrc[chnls * x + c];
-                }
-            }
-        }
-    }
-    else if (SR_DEPTH_32F == iplImage->depth)
-    {
-        for (int y = 0; y < iplImage->height; y++)
-        {
-            float *pSrc = (float *)((char *)iplImage->imageData + y * iplImage->widthStep);
-            for (int x = 0; x < iplImage->width; x++)
-            {
-                for (unsigned int c = 0; c < chnls; c++)
-                {
-                    vec[chnls * x + c + y * width * chnls] = pSrc[chnls * x + c];
-                }
-            }
-        }
-    }
-	return vec;
-}
-
-IplImage * transfer_buffer2iplImage(float * vec, const unsigned width, const unsigned height, const unsigned chnls, const bool clip)
-{
-    IplImage * iplImage = CImageUtility::createImage(width, height, SR_DEPTH_32F, chnls);
-    if (clip)
-    {
-        for (int y = 0; y < iplImage->height; y++)
-        {
-            float *pDst = (float *)((char *)iplImage->imageData + y * iplImage->widthStep);
-            for (int x = 0; x < iplImage->width; x++)
-            {
-                for (unsigned int c = 0; c < chnls; c++)
-                {
-                    int xx = chnls * x + c + y * width * chnls;
-                    //vec[xx] = (vec[xx] > 255.0f ? 255.0f : (vec[xx] < 0.0f ? 0.0f : vec[xx]));
-                    //vec[xx] /= 255.0;
-                    //if (vec[xx] < 0)
-                    //    vec[x] = 1 + vec[xx];
-                    pDst[chnls * x + c] = vec[xx];
-                }
-            }
-        }
-    }
-    else
-    {
-        for (int y = 0; y < iplImage->height; ++y)
-        {
-            float * pDst = (float *)((char *)iplImage->imageData + y * iplImage->widthStep);
-            for (int x = 0; x < iplImage->width; ++x)
-            {
-                for (unsigned int c = 0; c < chnls; ++c)
-                {
-                    int xx = chnls * x + c + y * width * chnls;
-                    pDst[chnls * x + c] = vec[xx];
-                }
-            }
-        }
-    }
-
-	return iplImage;
+		float * plane_0 = dst;
+		float * plane_1 = dst + plane_size;
+		float * plane_2 = dst + 2 * plane_size;
+		for (unsigned k = 0; k < width; k++)
+		{
+			const float red = (float)src[3 * k + 2];
+			const float green = (float)src[3 * k + 1];
+			const float blue = (float)src[3 * k];
+			plane_0[k] = mat[0] * red + mat[1] * green + mat[2] * blue;
+			plane_1[k] = mat[3] * red + mat[4] * green + mat[5] * blue;
+			plane_2[k] = mat[6] * red + mat[7] * green + mat[8] * blue;
+		}
+	}
+	else
+		for (unsigned c = 0; c < chnls; c++)
+			for (unsigned k = 0; k < width; k++)
+				dst[c * plane_size + k] = (float)src[chnls * k + c];
 }
 
 //
-// @brief Run the basic process of BM3D (1st step). The result
-//        is contained in img_basic. The image has boundary, which
-//        are here only for block-matching and doesn't need to be
-//        denoised.
+// @brief Ingest of an IplImage in a planar float image: the pixels
+//        are de-interleaved, converted to float and transformed to
+//        the color space in one pass over the image. The rows are
+//        independent and processed in parallel with OpenMP.
 //
-// @param sigma: value of assumed noise of the image to denoise;
-// @param img_noisy: noisy image;
-// @param img_basic: will contain the denoised image after the 1st step;
-// @param width, height, chnls : size of img_noisy;
-// @param nHard: size of the boundary around img_noisy;
-// @param useSD: if true, use weight based on the standard variation
-//        of the 3D group for the first step, otherwise use the number
-//        of non-zero coefficients after Hard-thresholding;
-// @param tau_2D: DCT or BIOR;
-// @param plan_2d_for_1, plan_2d_for_2, plan_2d_inv : for convenience. Used
-//        by fftw.
+// @param iplImage: image of depth SR_DEPTH_8U, SR_DEPTH_16U or
+//        SR_DEPTH_32F;
+// @param img: will contain the image, same size as iplImage;
+// @param color_space: Transformation from RGB to YUV, used when the
+//        image has 3 channels, see color_space_matrix().
 //
-// @return none.
+// @return EXIT_FAILURE if the depth or color_space has not expected
+//         type, otherwise return EXIT_SUCCESS.
 //
-IplImage * bm3d_1st_step(IplImage * iplImage, const float sigma, fftwf_plan *  plan_2d_for_1, fftwf_plan *  plan_2d_for_2, fftwf_plan *  plan_2d_inv)
+int transfer_iplImage2buffer(IplImage * iplImage, const PlanarImage & img, const unsigned color_space)
 {
-    // iplImage with padding, width = width + boundary, height = height + boundary
-    const unsigned int width = iplImage->width;
-    const unsigned int height = iplImage->height;
-    const unsigned int chnls = iplImage->nChannels;
-    const unsigned int tau_2D = 5;
-    const unsigned int nHard = 7;
-    const unsigned int kHard = (tau_2D == BIOR || sigma < 40.f ? 8 : 12);
-    const unsigned int NHard = 16;
-    const unsigned int pHard = 3;
-    const bool useSD = false;
-    const unsigned int color_space = 2;
-
-    float * img_noisy = transfer_iplImage2buffer(iplImage);
-    float * img_basic = new float[width * height * chnls];
-	// Estimatation of sigma on each channel
-	float * sigma_table = new float[chnls];
-	if (!sigma_table)
-	{
-		CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_1st_step!\n");
-		delete[] sigma_table;
-		sigma_table = NULL;
-	}
-	if (estimate_sigma(sigma, sigma_table, chnls, color_space))
+	const unsigned width = img.width;
+	const unsigned height = img.height;
+	const unsigned chnls = img.chnls;
+	const int depth = iplImage->depth;
+	if (depth != SR_DEPTH_8U && depth != SR_DEPTH_16U && depth != SR_DEPTH_32F)
 	{
-		return NULL;
+		cout << "Wrong depth of image. Must be 8U, 16U or 32F!!" << endl;
+		return EXIT_FAILURE;
 	}
 
-	// Parameters initialization
-	// Threshold for Hard Thresholding
-	const float    lambdaHard3D = 2.7f;
-
-	// threshold used to determinate similarity between patches
-	const float    tauMatch = (chnls == 1 ? 3.f : 1.f) * (sigma_table[0] < 35.0f ? 2500 : 5000);
-
-	// Initialization for convenience
-	unsigned int * row_ind;
-	unsigned int row_ind_size;
-	ind_initialize(row_ind, height - kHard + 1, nHard, pHard, row_ind_size);
-	unsigned int * column_ind;
-	unsigned int column_ind_size;
-	ind_initialize(column_ind, width - kHard + 1, nHard, pHard, column_ind_size);
+	float mat[9];
+	if (chnls == 3 && color_space_matrix(color_space, true, mat) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
 
-	const unsigned int kHard_2 = kHard * kHard;
-
-	float * group_3D_table;
-	float * wx_r_table;
+	const simd_kernels & kernels = simd_kernels_get();
+	const unsigned plane_size = width * height;
 
-	float * hadamard_tmp = new float[NHard];
-	float * kaiser_window = new float[kHard_2];
-	float * coef_norm = new float[kHard_2];
-	float * coef_norm_inv = new float[kHard_2];
-	if (!hadamard_tmp || !kaiser_window || !coef_norm || !coef_norm_inv)
+#pragma omp parallel for
+	for (int i = 0; i < (int)height; i++)
 	{
-		if (!hadamard_tmp)
-		{
-			delete[] hadamard_tmp;
-			hadamard_tmp = NULL;
-		}
-		if (!kaiser_window)
+		const char * src = (const char *)iplImage->imageData + i * iplImage->widthStep;
+		float * dst = img.data + i * width;
+		if (depth == SR_DEPTH_8U)
 		{
-			delete[] kaiser_window;
-			kaiser_window = NULL;
+			if (chnls == 3 && kernels.ingest_row_8u)
+				kernels.ingest_row_8u((const unsigned char *)src, dst, dst + plane_size, dst + 2 * plane_size, mat, width);
+			else
+				ingest_row((const unsigned char *)src, dst, plane_size, width, chnls, mat);
 		}
-		if (!coef_norm)
+		else if (depth == SR_DEPTH_16U)
 		{
-			delete[] kaiser_window;
-			kaiser_window = NULL;
+			if (chnls == 3 && kernels.ingest_row_16u)
+				kernels.ingest_row_16u((const unsigned short *)src, dst, dst + plane_size, dst + 2 * plane_size, mat, width);
+			else
+				ingest_row((const unsigned short *)src, dst, plane_size, width, chnls, mat);
 		}
-		if (!coef_norm_inv)
+		else
 		{
-			delete[] coef_norm_inv;
-			coef_norm_inv = NULL;
+			if (chnls == 3 && kernels.ingest_row_32f)
+				kernels.ingest_row_32f((const float *)src, dst, dst + plane_size, dst + 2 * plane_size, mat, width);
+			else
+				ingest_row((const float *)src, dst, plane_size, width, chnls, mat);
 		}
-		CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_1st_step!\n");
-		return NULL;
 	}
 
-	// Check allocation memory
-	preProcess(kaiser_window, coef_norm, coef_norm_inv, kHard);
+	return EXIT_SUCCESS;
+}
 
-	// Preprocessing of Bior table
-	float * lpd = new float[10];
-	float * hpd = new float[10];
-	float * lpr = new float[10];
-	float * hpr = new float[10];
-	if (!lpd || !hpd || !lpr || !hpr)
+//
+// @brief Egress of a row of pixels from the planes of a color space,
+//        generic code of the egress_row_* kernels.
+//
+// @param src: first pixel of the row in the first plane;
+// @param dst: will contain the row of width pixels of chnls channels,
+//        interleaved;
+// @param plane_size: size of a plane;
+// @param mat: inverse matrix of the color space, giving (red, green,
+//        blue) when chnls == 3, see color_space_matrix();
+// @param max_value: pixels are clipped to [0, max_value];
+// @param round: if true, pixels are rounded to the nearest integer.
+//
+template <class T>
+void egress_row(const float * src, T * dst, const unsigned plane_size, const unsigned width,
+	const unsigned chnls, const float * mat, const float max_value, const bool round)
+{
+	const float offset = (round ? 0.5f : 0.0f);
+	if (chnls == 3)
 	{
-		if (!lpd)
+		const float * plane_0 = src;
+		const float * plane_1 = src + plane_size;
+		const float * plane_2 = src + 2 * plane_size;
+		for (unsigned k = 0; k < width; k++)
 		{
-			delete[] lpd;
-			lpd = NULL;
+			const float value[3] = { plane_0[k], plane_1[k], plane_2[k] };
+			for (unsigned c = 0; c < 3; c++)
+			{
+				float pix = mat[3 * c] * value[0] + mat[3 * c + 1] * value[1] + mat[3 * c + 2] * value[2];
+				pix = (pix > max_value ? max_value : (pix < 0.0f ? 0.0f : pix));
+				dst[3 * k + 2 - c] = (T)(pix + offset);
+			}
 		}
-		if (!hpd)
+	}
+	else
+		for (unsigned c = 0; c < chnls; c++)
+			for (unsigned k = 0; k < width; k++)
+			{
+				const float pix = src[c * plane_size + k];
+				dst[chnls * k + c] = (T)((pix > max_value ? max_value : (pix < 0.0f ? 0.0f : pix)) + offset);
+			}
+}
+
+//
+// @brief Egress of a planar float image to an IplImage of its size: the
+//        inverse color space transform, the clipping, the rounding and
+//        the interleaving of the pixels are done in one pass over the
+//        image. The rows are independent and processed in parallel
+//        with OpenMP.
+//
+// @param img: image to convert;
+// @param color_space: Transformation from RGB to YUV, used when the
+//        image has 3 channels, see color_space_matrix();
+// @param iplImage: will contain the image. Its depth is SR_DEPTH_8U
+//        (pixels clipped to [0, 255] and rounded), SR_DEPTH_16U
+//        (clipped to [0, 65535] and rounded) or SR_DEPTH_32F (clipped
+//        to [0, 255]).
+//
+// @return EXIT_FAILURE if the depth or color_space has not expected
+//         type, otherwise return EXIT_SUCCESS.
+//
+int transfer_buffer2iplImage(const PlanarImage & img, const unsigned color_space, IplImage * iplImage)
+{
+	const unsigned width = img.width;
+	const unsigned height = img.height;
+	const unsigned chnls = img.chnls;
+	const int depth = iplImage->depth;
+	if (depth != SR_DEPTH_8U && depth != SR_DEPTH_16U && depth != SR_DEPTH_32F)
+	{
+		cout << "Wrong depth of image. Must be 8U, 16U or 32F!!" << endl;
+		return EXIT_FAILURE;
+	}
+
+	float mat[9];
+	if (chnls == 3 && color_space_matrix(color_space, false, mat) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	const simd_kernels & kernels = simd_kernels_get();
+	const unsigned plane_size = width * height;
+
+#pragma omp parallel for
+	for (int i = 0; i < (int)height; i++)
+	{
+		char * dst = (char *)iplImage->imageData + i * iplImage->widthStep;
+		const float * src = img.data + i * width;
+		if (depth == SR_DEPTH_8U)
 		{
-			delete[] hpd;
-			hpd = NULL;
+			if (chnls == 3 && kernels.egress_row_8u)
+				kernels.egress_row_8u(src, src + plane_size, src + 2 * plane_size, (unsigned char *)dst, mat, width);
+			else
+				egress_row(src, (unsigned char *)dst, plane_size, width, chnls, mat, 255.0f, true);
 		}
-		if (!lpr)
+		else if (depth == SR_DEPTH_16U)
 		{
-			delete[] lpr;
-			lpr = NULL;
+			if (chnls == 3 && kernels.egress_row_16u)
+				kernels.egress_row_16u(src, src + plane_size, src + 2 * plane_size, (unsigned short *)dst, mat, width);
+			else
+				egress_row(src, (unsigned short *)dst, plane_size, width, chnls, mat, 65535.0f, true);
 		}
-		if (!hpr)
+		else
 		{
-			delete[] hpr;
-			hpr = NULL;
+			if (chnls == 3 && kernels.egress_row_32f)
+				kernels.egress_row_32f(src, src + plane_size, src + 2 * plane_size, (float *)dst, mat, width);
+			else
+				egress_row(src, (float *)dst, plane_size, width, chnls, mat, 255.0f, false);
 		}
-		CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_1st_step!\n");
-		return NULL;
 	}
-	bior15_coef(lpd, hpd, lpr, hpr);
 
-	// For aggregation part
-	float * denominator = new float[width * height * chnls]();
-	float * numerator = new float[width * height * chnls]();
-	if (!denominator || !numerator)
+	return EXIT_SUCCESS;
+}
+
+//
+// @brief Egress of a planar float image to a new IplImage, see
+//        transfer_buffer2iplImage() above.
+//
+// @param img: image to convert;
+// @param color_space: Transformation from RGB to YUV, used when the
+//        image has 3 channels, see color_space_matrix();
+// @param depth: depth of the IplImage, SR_DEPTH_8U, SR_DEPTH_16U or
+//        SR_DEPTH_32F.
+//
+// @return the new IplImage, NULL if the depth or color_space has not
+//         expected type.
+//
+IplImage * transfer_buffer2iplImage(const PlanarImage & img, const unsigned color_space, const int depth)
+{
+	if (depth != SR_DEPTH_8U && depth != SR_DEPTH_16U && depth != SR_DEPTH_32F)
 	{
-		if (!denominator)
-		{
-			delete[] denominator;
-			denominator = NULL;
-		}
-		if (!numerator)
-		{
-			delete[] numerator;
-			numerator = NULL;
-		}
-		CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_1st_step!\n");
+		cout << "Wrong depth of image. Must be 8U, 16U or 32F!!" << endl;
 		return NULL;
 	}
 
-	// Precompute Bloc-Matching
-	unsigned int ** patch_table;
-	unsigned int * patch_table_size;
-	precompute_BM(patch_table, patch_table_size, img_noisy, width, height, kHard, NHard, nHard, pHard, tauMatch);
-	// nHard -- window size, NHard -- max number of similar patches
-
-
-	float * table_2D = new float[(2 * nHard + 1) * width * chnls * kHard_2]();
-	if (!table_2D)
+	IplImage * iplImage = CImageUtility::createImage(img.width, img.height, depth, img.chnls);
+	if (!iplImage)
 	{
-		CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_1st_step!\n");
-		delete[] table_2D;
-		table_2D = NULL;
+		CImageUtility::showErrMsg("Fail to allocate image in transfer_buffer2iplImage!\n");
+		return NULL;
 	}
 
-	// Loop on i_r
-	for (unsigned int ind_i = 0; ind_i < row_ind_size; ind_i++)
-	{
-		const unsigned int i_r = row_ind[ind_i];
+	if (transfer_buffer2iplImage(img, color_space, iplImage) != EXIT_SUCCESS)
+		CImageUtility::safeReleaseImage(&iplImage);
+	return iplImage;
+}
 
-		// Update of table_2D
-		if (tau_2D == DCT)
-			dct_2d_process(table_2D, img_noisy, plan_2d_for_1, plan_2d_for_2, nHard,
-			width, height, chnls, kHard, i_r, pHard, coef_norm,
-			row_ind[0], row_ind[row_ind_size - 1]);
-		else if (tau_2D == BIOR)
-			bior_2d_process(table_2D, img_noisy, nHard, width, height, chnls,
-			kHard, i_r, pHard, row_ind[0], row_ind[row_ind_size - 1], lpd, hpd);
-
-		wx_r_table = new float[chnls * column_ind_size];
-		if (!wx_r_table)
+//
+// @brief Ingest of a row of a raw planar raster in the planes of a
+//        color space.
+//
+// @param src: row of width samples of each channel, the channels one
+//        after the other (red, green, blue when chnls == 3);
+// @param dst: first pixel of the row in the first plane;
+// @param plane_size: size of a plane;
+// @param mat: matrix of the color space, applied on (red, green, blue)
+//        when chnls == 3, see color_space_matrix().
+//
+template <class T>
+void ingest_planar_row(const T * src, float * dst, const unsigned plane_size, const unsigned width,
+	const unsigned chnls, const float * mat)
+{
+	if (chnls == 3)
+	{
+		float * plane_0 = dst;
+		float * plane_1 = dst + plane_size;
+		float * plane_2 = dst + 2 * plane_size;
+		for (unsigned k = 0; k < width; k++)
 		{
-			CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_1st_step!\n");
-			delete[] wx_r_table;
-			wx_r_table = NULL;
+			const float red = (float)src[k];
+			const float green = (float)src[width + k];
+			const float blue = (float)src[2 * width + k];
+			plane_0[k] = mat[0] * red + mat[1] * green + mat[2] * blue;
+			plane_1[k] = mat[3] * red + mat[4] * green + mat[5] * blue;
+			plane_2[k] = mat[6] * red + mat[7] * green + mat[8] * blue;
 		}
+	}
+	else
+		for (unsigned c = 0; c < chnls; c++)
+			for (unsigned k = 0; k < width; k++)
+				dst[c * plane_size + k] = (float)src[c * width + k];
+}
 
-		unsigned int sum_nSx_r = 0;
-		for (unsigned int ind_j = 0; ind_j < column_ind_size; ind_j++)
-		{
-			const unsigned int j_r = column_ind[ind_j];
-			const unsigned int k_r = i_r * width + j_r;
-			sum_nSx_r += patch_table_size[k_r];
-		}
-		unsigned int group_3D_table_size = chnls * sum_nSx_r * kHard_2;
-		group_3D_table = new float[group_3D_table_size];
-		if (!group_3D_table)
+//
+// @brief Egress of a row of pixels from the planes of a color space to
+//        a row of a raw planar raster.
+//
+// @param src: first pixel of the row in the first plane;
+// @param dst: will contain the row of width samples of each channel,
+//        the channels one after the other;
+// @param plane_size: size of a plane;
+// @param mat: inverse matrix of the color space, giving (red, green,
+//        blue) when chnls == 3, see color_space_matrix();
+// @param max_value: pixels are clipped to [0, max_value];
+// @param round: if true, pixels are rounded to the nearest integer.
+//
+template <class T>
+void egress_planar_row(const float * src, T * dst, const unsigned plane_size, const unsigned width,
+	const unsigned chnls, const float * mat, const float max_value, const bool round)
+{
+	const float offset = (round ? 0.5f : 0.0f);
+	if (chnls == 3)
+	{
+		const float * plane_0 = src;
+		const float * plane_1 = src + plane_size;
+		const float * plane_2 = src + 2 * plane_size;
+		for (unsigned k = 0; k < width; k++)
 		{
-			CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_1st_step!\n");
-			delete[] group_3D_table;
-			group_3D_table = NULL;
+			const float value[3] = { plane_0[k], plane_1[k], plane_2[k] };
+			for (unsigned c = 0; c < 3; c++)
+			{
+				float pix = mat[3 * c] * value[0] + mat[3 * c + 1] * value[1] + mat[3 * c + 2] * value[2];
+				pix = (pix > max_value ? max_value : (pix < 0.0f ? 0.0f : pix));
+				dst[c * width + k] = (T)(pix + offset);
+			}
 		}
-		unsigned int sum = 0;
-
-		// Loop on j_r
-		for (unsigned int ind_j = 0; ind_j < column_ind_size; ind_j++)
-		{
-			// Initialization
-			const unsigned int j_r = column_ind[ind_j];
-			const unsigned int k_r = i_r * width + j_r;
-
-			// Number of similar patches
-			const unsigned int nSx_r = patch_table_size[k_r];
-
-			// Build of the 3D group
-			float * group_3D = new float[chnls * nSx_r * kHard_2]();
-			float * group_3D_table_ = new float[chnls * nSx_r * kHard_2];
-			if (!group_3D || !group_3D_table_)
+	}
+	else
+		for (unsigned c = 0; c < chnls; c++)
+			for (unsigned k = 0; k < width; k++)
 			{
-				if (!group_3D)
-				{
-					delete[] group_3D;
-					group_3D = NULL;
-				}
-				if (!group_3D_table_)
-				{
-					delete[] group_3D_table_;
-					group_3D_table_ = NULL;
-				}
-				CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_1st_step!\n");
-				return NULL;
+				const float pix = src[c * plane_size + k];
+				dst[c * width + k] = (T)((pix > max_value ? max_value : (pix < 0.0f ? 0.0f : pix)) + offset);
 			}
-			for (unsigned int c = 0; c < chnls; c++)
-				for (unsigned int n = 0; n < nSx_r; n++)
-				{
-					const unsigned int ind = patch_table[k_r][n] + (nHard - i_r) * width;
-					for (unsigned int k = 0; k < kHard_2; k++)
-						group_3D[n + k * nSx_r + c * kHard_2 * nSx_r] =
-						table_2D[k + ind * kHard_2 + c * kHard_2 * (2 * nHard + 1) * width];
-				}
+}
 
-			// HT filtering of the 3D group
-			float * weight_table = new float[chnls];
-			if (!weight_table)
+//
+// @brief Read a rectangle of a raster in a planar float image, in its
+//        color space.
+//
+// @param raster: raster to read, from its pixel (x, y);
+// @param img: will contain the w x h pixels;
+// @param mat: matrix of the color space, see color_space_matrix();
+// @param samples: buffer of w samples of every channel.
+//
+// @return EXIT_FAILURE if the reading failed, otherwise EXIT_SUCCESS.
+//
+static int read_raster_rect(const RasterFile & raster, const unsigned x, const unsigned y, const PlanarImage & img,
+	const float * mat, char * samples)
+{
+	const unsigned w = img.width;
+	const unsigned sample_bytes = raster.sample_bytes();
+	for (unsigned i = 0; i < img.height; i++)
+	{
+		for (unsigned c = 0; c < img.chnls; c++)
+			if (!raster_read(raster, c, y + i, x, w, samples + c * w * sample_bytes))
 			{
-				CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_1st_step!\n");
-				delete[] weight_table;
-				weight_table = NULL;
+				cout << "Unable to read the row " << y + i << " of the raster" << endl;
+				return EXIT_FAILURE;
 			}
-			ht_filtering_hadamard(group_3D, hadamard_tmp, nSx_r, kHard, chnls, sigma_table,
-				lambdaHard3D, weight_table, !useSD);
 
-			// 3D weighting using Standard Deviation
-			if (useSD)
-				sd_weighting(group_3D, nSx_r, kHard, chnls, weight_table);
+		float * dst = img.data + i * w;
+		const unsigned plane_size = w * img.height;
+		if (raster.depth == SR_DEPTH_8U)
+			ingest_planar_row((const unsigned char *)samples, dst, plane_size, w, img.chnls, mat);
+		else if (raster.depth == SR_DEPTH_16U)
+			ingest_planar_row((const unsigned short *)samples, dst, plane_size, w, img.chnls, mat);
+		else
+			ingest_planar_row((const float *)samples, dst, plane_size, w, img.chnls, mat);
+	}
+	return EXIT_SUCCESS;
+}
 
-			// Save the 3D group. The DCT 2D inverse will be done after.
-			for (unsigned int c = 0; c < chnls; c++)
-				for (unsigned int n = 0; n < nSx_r; n++)
-					for (unsigned int k = 0; k < kHard_2; k++)
-					{
-						unsigned int index = k + n * kHard_2 + c * nSx_r * kHard_2;
-						group_3D_table_[index] = group_3D[n + k * nSx_r + c * kHard_2 * nSx_r];
-					}
-			unsigned int sz = chnls * nSx_r * kHard_2;
-			for (unsigned int i = 0; i < sz; i++)
+//
+// @brief Write a rectangle of a planar float image to a raster, with
+//        the inverse color space transform, the clipping and the
+//        rounding of transfer_buffer2iplImage().
+//
+// @param img: image to write, from its pixel (x_src, y_src);
+// @param raster: raster to write, from its pixel (x, y);
+// @param w, h: size of the rectangle;
+// @param mat: inverse matrix of the color space, see color_space_matrix();
+// @param samples: buffer of w samples of every channel.
+//
+// @return EXIT_FAILURE if the writing failed, otherwise EXIT_SUCCESS.
+//
+static int write_raster_rect(const PlanarImage & img, const unsigned x_src, const unsigned y_src,
+	const RasterFile & raster, const unsigned x, const unsigned y, const unsigned w, const unsigned h,
+	const float * mat, char * samples)
+{
+	const unsigned sample_bytes = raster.sample_bytes();
+	const unsigned plane_size = img.width * img.height;
+	for (unsigned i = 0; i < h; i++)
+	{
+		const float * src = img.data + (y_src + i) * img.width + x_src;
+		if (raster.depth == SR_DEPTH_8U)
+			egress_planar_row(src, (unsigned char *)samples, plane_size, w, img.chnls, mat, 255.0f, true);
+		else if (raster.depth == SR_DEPTH_16U)
+			egress_planar_row(src, (unsigned short *)samples, plane_size, w, img.chnls, mat, 65535.0f, true);
+		else
+			egress_planar_row(src, (float *)samples, plane_size, w, img.chnls, mat, 255.0f, false);
+
+		for (unsigned c = 0; c < img.chnls; c++)
+			if (!raster_write(raster, c, y + i, x, w, samples + c * w * sample_bytes))
 			{
-				group_3D_table[i + sum] = group_3D_table_[i];
+				cout << "Unable to write the row " << y + i << " of the raster" << endl;
+				return EXIT_FAILURE;
 			}
-			sum += sz;
+	}
+	return EXIT_SUCCESS;
+}
 
-			// Save weighting
-			for (unsigned int c = 0; c < chnls; c++)
+//
+// @brief Rectangle [x, x + w) x [y, y + h) of a tile whose interior
+//        [x_0, x_1) x [y_0, y_1) is read with a halo of halo pixels,
+//        clipped to the image.
+//
+static void tile_rect(const unsigned x_0, const unsigned x_1, const unsigned y_0, const unsigned y_1,
+	const unsigned halo, const unsigned width, const unsigned height, unsigned & x, unsigned & y,
+	unsigned & w, unsigned & h)
+{
+	x = (x_0 > halo ? x_0 - halo : 0);
+	y = (y_0 > halo ? y_0 - halo : 0);
+	w = min(width, x_1 + halo) - x;
+	h = min(height, y_1 + halo) - y;
+}
+
+//
+// @brief Out-of-core version of run_bm3d: the noisy image is read from
+//        a raster tile by tile, and the denoised interiors of the tiles
+//        are written to another raster in their order, row of tiles by
+//        row of tiles. Only the buffers of one tile are in memory,
+//        whatever the size of the image, see bm3d_plan_file_tiles().
+//        Each tile is read with a double halo: the 1st step denoises
+//        the tile with both halos, so that the 2nd step finds the basic
+//        estimate on the tile with its own halo, as in run_bm3d. The
+//        basic estimate of the halos is thus computed by the
+//        neighbour tiles too, but never stored.
+//
+// @param input: noisy raster, see RasterFile;
+// @param output: will contain the denoised raster, of the same size. Its
+//        depth may differ from the one of input;
+// @param sigma: value of assumed noise of the noisy image;
+// @param memory_budget: maximum size in bytes of the buffers of the
+//        process, 0 to read it from BM3D_MEMORY_BUDGET_ENV. The
+//        interiors of the tiles are at most BM3D_FILE_TILE_SIZE pixels
+//        wide and high, whatever the budget.
+//
+// @return EXIT_FAILURE if the rasters can't be processed, otherwise
+//         EXIT_SUCCESS.
+//
+int run_bm3d_file(const RasterFile & input, const RasterFile & output, const float sigma, const size_t memory_budget)
+{
+	const unsigned int width = input.width;
+	const unsigned int height = input.height;
+	const unsigned int chnls = input.chnls;
+	const unsigned int tau_2D_hard = 5;
+	const unsigned int tau_2D_wien = 4;
+	const unsigned int color_space = 2;
+	if (output.width != width || output.height != height || output.chnls != chnls)
+	{
+		cout << "Wrong size of the output raster. Must be the one of the input raster!!" << endl;
+		return EXIT_FAILURE;
+	}
+
+	// Parameters
+	const unsigned int nHard = 7; // Half size of the search window
+	const unsigned int nWien = 7; // Half size of the search window
+	const unsigned int kHard = (tau_2D_hard == BIOR || sigma < 40.f ? 8 : 12); // Must be a power of 2 if tau_2D_hard == BIOR
+	const unsigned int kWien = (tau_2D_wien == BIOR || sigma < 40.f ? 4 : 12); // Must be a power of 2 if tau_2D_wien == BIOR
+	const unsigned int NHard = 16; // Must be a power of 2
+	const unsigned int NWien = 32; // Must be a power of 2
+	const unsigned int pHard = 3;
+	const unsigned int pWien = 3;
+
+	// Tiles fitting the memory budget
+	const size_t budget = (memory_budget ? memory_budget : memory_budget_env());
+	TilePlan plan;
+	if (!bm3d_plan_file_tiles(plan, width, height, chnls, max(input.sample_bytes(), output.sample_bytes()), budget,
+		nHard, kHard, NHard, pHard, nWien, kWien, NWien, pWien))
+	{
+		cout << "memory: budget of " << budget / 1048576.0 << " MB below the " << plan.peak_bytes / 1048576.0
+			<< " MB needed by the smallest tiles" << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "memory: " << plan.nb_x << " x " << plan.nb_y << " tiles (halo " << plan.halo << " read twice), predicted peak "
+		<< plan.peak_bytes / 1048576.0 << " MB";
+	if (budget)
+		cout << " for a budget of " << budget / 1048576.0 << " MB";
+	cout << endl;
+
+	float mat[9];
+	float mat_inv[9];
+	if (chnls == 3 && (color_space_matrix(color_space, true, mat) != EXIT_SUCCESS
+		|| color_space_matrix(color_space, false, mat_inv) != EXIT_SUCCESS))
+		return EXIT_FAILURE;
+
+	// Buffers of the largest tile, with both halos for the 1st step and
+	// with one halo for the 2nd step
+	unsigned int w_1 = 0, h_1 = 0, w_2 = 0, h_2 = 0;
+	for (unsigned int k = 0; k < plan.nb_x; k++)
+	{
+		unsigned int x, y, w, h;
+		tile_rect(plan.x(k), plan.x(k + 1), 0, 1, 2 * plan.halo, width, 1, x, y, w, h);
+		w_1 = max(w_1, w);
+		tile_rect(plan.x(k), plan.x(k + 1), 0, 1, plan.halo, width, 1, x, y, w, h);
+		w_2 = max(w_2, w);
+	}
+	for (unsigned int k = 0; k < plan.nb_y; k++)
+	{
+		unsigned int x, y, w, h;
+		tile_rect(0, 1, plan.y(k), plan.y(k + 1), 2 * plan.halo, 1, height, x, y, w, h);
+		h_1 = max(h_1, h);
+		tile_rect(0, 1, plan.y(k), plan.y(k + 1), plan.halo, 1, height, x, y, w, h);
+		h_2 = max(h_2, h);
+	}
+	unsigned long long plane_bytes_0, huge_bytes_0;
+	huge_pages_stats(plane_bytes_0, huge_bytes_0);
+	mem_stats_reset_peaks();
+	float * tile_noisy_1 = plane_alloc<float>((size_t)w_1 * h_1 * chnls, false, MEM_STAGE_IMAGES);
+	float * tile_basic_1 = plane_alloc<float>((size_t)w_1 * h_1 * chnls, false, MEM_STAGE_IMAGES);
+	float * tile_noisy_2 = plane_alloc<float>((size_t)w_2 * h_2 * chnls, false, MEM_STAGE_IMAGES);
+	float * tile_basic_2 = plane_alloc<float>((size_t)w_2 * h_2 * chnls, false, MEM_STAGE_IMAGES);
+	float * tile_denoised = plane_alloc<float>((size_t)w_2 * h_2 * chnls, false, MEM_STAGE_IMAGES);
+	char * samples = new char[(size_t)w_1 * chnls * max(input.sample_bytes(), output.sample_bytes())];
+
+	// Workspace of both steps, prepared for their largest tiles and reused
+	// by all the tiles
+	StepWorkspace workspace;
+	if (!tile_noisy_1 || !tile_basic_1 || !tile_noisy_2 || !tile_basic_2 || !tile_denoised || !samples
+		|| !workspace.prepare(1, w_1, h_1, chnls, tau_2D_hard, nHard, kHard, NHard, pHard)
+		|| !workspace.prepare(2, w_2, h_2, chnls, tau_2D_wien, nWien, kWien, NWien, pWien))
+	{
+		CImageUtility::showErrMsg("Fail to allocate buffer in run_bm3d_file!\n");
+		plane_free(tile_noisy_1);
+		plane_free(tile_basic_1);
+		plane_free(tile_noisy_2);
+		plane_free(tile_basic_2);
+		plane_free(tile_denoised);
+		delete[] samples;
+		return EXIT_FAILURE;
+	}
+
+	// Plans for FFTW process, taken from the plan cache, for each step
+	fftwf_plan plan_hard[1];
+	fftwf_plan plan_wien[1];
+#ifdef _BM3D_USE_FFTW
+	if (tau_2D_hard == DCT)
+		plan_hard[0] = plan_cache_get_2d(kHard, FFTW_REDFT10, FFTW_PLAN_BATCH, 0);
+	if (tau_2D_wien == DCT)
+		plan_wien[0] = plan_cache_get_2d(kWien, FFTW_REDFT10, FFTW_PLAN_BATCH, 0);
+#endif      // #ifdef _BM3D_USE_FFTW
+
+	cout << "kernels: " << simd_isa_name(simd_isa()) << endl;
+
+	int status = EXIT_SUCCESS;
+	SkipStats skip_stats;
+	for (unsigned int ty = 0; ty < plan.nb_y && status == EXIT_SUCCESS; ty++)
+	{
+		for (unsigned int tx = 0; tx < plan.nb_x && status == EXIT_SUCCESS; tx++)
+		{
+			// Interior [x_0, x_1) x [y_0, y_1), the tile with both halos
+			// and the tile with one halo
+			const unsigned int x_0 = plan.x(tx);
+			const unsigned int x_1 = plan.x(tx + 1);
+			const unsigned int y_0 = plan.y(ty);
+			const unsigned int y_1 = plan.y(ty + 1);
+			unsigned int x_h1, y_h1, w_h1, h_h1, x_h2, y_h2, w_h2, h_h2;
+			tile_rect(x_0, x_1, y_0, y_1, 2 * plan.halo, width, height, x_h1, y_h1, w_h1, h_h1);
+			tile_rect(x_0, x_1, y_0, y_1, plan.halo, width, height, x_h2, y_h2, w_h2, h_h2);
+			const PlanarImage noisy_1(tile_noisy_1, w_h1, h_h1, chnls);
+			const PlanarImage basic_1(tile_basic_1, w_h1, h_h1, chnls);
+			const PlanarImage noisy_2(tile_noisy_2, w_h2, h_h2, chnls);
+			const PlanarImage basic_2(tile_basic_2, w_h2, h_h2, chnls);
+			const PlanarImage denoised_2(tile_denoised, w_h2, h_h2, chnls);
+
+			status = read_raster_rect(input, x_h1, y_h1, noisy_1, mat, samples);
+
+			// Denoising, 1st Step
+			if (status == EXIT_SUCCESS)
 			{
-				wx_r_table[chnls * ind_j + c] = weight_table[c];
+				SkipStats tile_stats;
+				status = bm3d_1st_step(noisy_1, basic_1, sigma, plan_hard, plan_hard, &tile_stats, &workspace);
+				skip_stats.add(tile_stats);
 			}
 
-			delete[] group_3D_table_;
-			delete[] weight_table;
-			delete[] group_3D;
+			// Denoising, 2nd Step
+			if (status == EXIT_SUCCESS)
+			{
+				copy_rect(noisy_1, x_h2 - x_h1, y_h2 - y_h1, noisy_2, 0, 0, w_h2, h_h2);
+				copy_rect(basic_1, x_h2 - x_h1, y_h2 - y_h1, basic_2, 0, 0, w_h2, h_h2);
+				status = bm3d_2nd_step(noisy_2, basic_2, denoised_2, sigma, plan_wien, plan_wien, &workspace);
+			}
 
-			group_3D_table_ = NULL;
-			weight_table = NULL;
-			group_3D = NULL;
+			if (status == EXIT_SUCCESS)
+				status = write_raster_rect(denoised_2, x_0 - x_h2, y_0 - y_h2, output, x_0, y_0,
+					x_1 - x_0, y_1 - y_0, mat_inv, samples);
+		}
+		cout << "\rrows of tiles: " << ty + 1 << " / " << plan.nb_y << flush;
+	}
+	cout << endl;
+
+	if (skip_stats.columns > 0)
+		cout << "skipped: " << 100.0 * (skip_stats.columns_zero + skip_stats.columns_dc) / skip_stats.columns
+			<< "% of the inverse Hadamard columns" << endl;
+
+	workspace.release();
+	plane_free(tile_noisy_1);
+	plane_free(tile_basic_1);
+	plane_free(tile_noisy_2);
+	plane_free(tile_basic_2);
+	plane_free(tile_denoised);
+	delete[] samples;
+
+	tile_noisy_1 = NULL;
+	tile_basic_1 = NULL;
+	tile_noisy_2 = NULL;
+	tile_basic_2 = NULL;
+	tile_denoised = NULL;
+	samples = NULL;
+
+	// Peak really used, by the whole process
+	cout << "memory: process peak " << peak_memory_bytes() / 1048576.0 << " MB" << endl;
+	huge_pages_report(plane_bytes_0, huge_bytes_0);
+	if (mem_stats_on)
+		mem_stats_report();
+
+	return status;
+}
 
-		} // End of loop on j_r
+//
+// @brief Sizes of the buffers of a step on an image of width x height
+//        pixels, as prepared in a StepWorkspace. The buffers live during
+//        the whole step; the tables of distances of the block matching
+//        and the tables of 2D transforms share the same plane, which
+//        also holds the cache of the 2D transforms of every patch when
+//        BM3D_SPECTRUM_CACHE_ENV enables it. It is an upper bound, up to
+//        the overhead of the allocator.
+//
+// @param bytes: will contain the size in bytes of each buffer, see
+//        STEP_BUFFER_*;
+// @param step: 1 for the 1st step, 2 for the 2nd one;
+// @param width, height, chnls: size of the image, without its boundary;
+// @param tau_2D: 2D transform of the step, DCT or BIOR;
+// @param nHW, kHW, NHW, pHW: parameters of the step.
+//
+void bm3d_step_buffers(size_t bytes[STEP_BUFFER_NB], const unsigned int step, const unsigned int width,
+	const unsigned int height, const unsigned int chnls, const unsigned int tau_2D, const unsigned int nHW,
+	const unsigned int kHW, const unsigned int NHW, const unsigned int pHW)
+{
+	const size_t w = width + 2 * nHW;
+	const size_t h = height + 2 * nHW;
+	const size_t Ns = 2 * nHW + 1;
+	const size_t kHW_2 = kHW * kHW;
+	const size_t nb_tables = (step == 1 ? 1 : 2);
+	const size_t row_ind_size = ind_count((unsigned int)h - kHW + 1, nHW, pHW);
+	const size_t column_ind_size = ind_count((unsigned int)w - kHW + 1, nHW, pHW);
+
+	// Scratch arena: the small tables of the workspace, then the 3D
+	// groups and their buffers
+	size_t arena = ScratchArena::aligned(row_ind_size * sizeof(unsigned int))
+		+ ScratchArena::aligned(column_ind_size * sizeof(unsigned int))
+		+ ScratchArena::aligned(chnls * sizeof(float))
+		+ 3 * ScratchArena::aligned(kHW_2 * sizeof(float))
+		+ ScratchArena::aligned(2 * kHW_2 * sizeof(float))
+		+ 4 * ScratchArena::aligned(10 * sizeof(float))
+		+ ScratchArena::aligned((nHW + 1) * Ns * sizeof(float *))
+		+ ScratchArena::aligned(Ns * Ns * sizeof(TD))
+		+ ScratchArena::aligned((4 * nHW + 2) * sizeof(unsigned int));
+	arena += nb_tables * ScratchArena::aligned(chnls * NHW * kHW_2 * sizeof(float))
+		+ ScratchArena::aligned(NHW * kHW_2 * sizeof(float))
+		+ ScratchArena::aligned(chnls * sizeof(float))
+		+ ScratchArena::aligned(kHW_2 * sizeof(float));
+	if (step == 1)
+		arena += ScratchArena::aligned(chnls * kHW_2) + ScratchArena::aligned(chnls * NHW);
+#ifdef _BM3D_USE_FFTW
+	// Buffers of the fftw transforms, given back after each use
+	if (tau_2D == DCT)
+		arena += 2 * max(fftw_batch_bytes(chnls * (unsigned int)w * Ns, (unsigned int)kHW_2),
+			fftw_batch_bytes(chnls * NHW, (unsigned int)kHW_2));
+#endif      // #ifdef _BM3D_USE_FFTW
+	bytes[STEP_BUFFER_ARENA] = arena;
+
+	// Tables of distances and their image of square differences, then
+	// tables of 2D transforms, or their cache in half precision
+	bytes[STEP_BUFFER_TABLES] = max(((nHW + 1) * Ns + 1) * w * h, nb_tables * Ns * w * chnls * kHW_2) * sizeof(float);
+	if (spectrum_cache_env())
+		bytes[STEP_BUFFER_TABLES] = max(bytes[STEP_BUFFER_TABLES],
+			nb_tables * w * h * chnls * kHW_2 * sizeof(unsigned short));
+
+	// Similar patches of every reference patch
+	bytes[STEP_BUFFER_PATCHES] = w * h * (sizeof(unsigned int *) + sizeof(unsigned int))
+		+ row_ind_size * column_ind_size * max(NHW, 2u) * sizeof(unsigned int);
+
+	// Numerator and denominator of the aggregation, interleaved
+	bytes[STEP_BUFFER_ACCUMULATOR] = 2 * (size_t)width * height * chnls * sizeof(float);
+}
+
+//
+// @brief Size of a StepWorkspace prepared for both steps: each of its
+//        buffers is the largest one of the steps.
+//
+// @param bytes_1, bytes_2: sizes of the buffers of the steps, see
+//        bm3d_step_buffers().
+//
+// @return the size in bytes.
+//
+size_t bm3d_workspace_bytes(const size_t bytes_1[STEP_BUFFER_NB], const size_t bytes_2[STEP_BUFFER_NB])
+{
+	size_t bytes = 0;
+	for (unsigned int k = 0; k < STEP_BUFFER_NB; k++)
+		bytes += max(bytes_1[k], bytes_2[k]);
+	return bytes;
+}
 
-		//  Apply 2D inverse transform
-		if (tau_2D == DCT)
+//
+// @brief Choose the tiles of an image for which run_bm3d fits in a
+//        memory budget: the fewest ones, then the ones of smallest peak.
+//        The image is split along both directions; the interior of a
+//        tile is at least as large as its halo. The halo covers the
+//        search windows of the reference patches whose similar patches
+//        reach the interior, and the tiles start on the grid of the
+//        reference patches: the interior is denoised with the same
+//        references as in the whole image. The results only differ by
+//        the rounding of the running sums of the block matching, which
+//        depends on the position in the image.
+//
+// @param plan: will contain the tiles and their predicted peak. When the
+//        budget is too small, its peak is the one of the smallest tiles;
+// @param width, height, chnls: size of the image;
+// @param pixel_bytes: size of a channel of a pixel of the denoised
+//        IplImage;
+// @param budget: memory budget in bytes, 0 for a single tile;
+// @param nHard, kHard, NHard, pHard: parameters of the 1st step;
+// @param nWien, kWien, NWien, pWien: parameters of the 2nd step.
+//
+// @return false if the budget is too small, otherwise true.
+//
+bool bm3d_plan_tiles(TilePlan & plan, const unsigned int width, const unsigned int height, const unsigned int chnls,
+	const unsigned int pixel_bytes, const size_t budget, const unsigned int nHard, const unsigned int kHard,
+	const unsigned int NHard, const unsigned int pHard, const unsigned int nWien, const unsigned int kWien,
+	const unsigned int NWien, const unsigned int pWien)
+{
+	plan = TilePlan();
+	plan.width = width;
+	plan.height = height;
+	plan.align = pHard;
+	const unsigned int reach = 2 * max(nHard, nWien) + max(kHard, kWien);
+	plan.halo = (reach + plan.align - 1) / plan.align * plan.align;
+
+	// Noisy, basic and denoised images, and the denoised IplImage with
+	// its rows aligned on 64 bytes
+	const size_t image = (size_t)width * height * chnls * sizeof(float);
+	const size_t output = ((size_t)width * chnls * pixel_bytes + 63) / 64 * 64 * height;
+
+	const unsigned int max_x = max(1u, width / plan.halo);
+	const unsigned int max_y = max(1u, height / plan.halo);
+	bool found = false;
+	TilePlan best;
+	for (unsigned int nb_y = 1; nb_y <= max_y; nb_y++)
+		for (unsigned int nb_x = 1; nb_x <= max_x; nb_x++)
+		{
+			if (found && nb_x * nb_y > best.nb_x * best.nb_y)
+				break;
+
+			// Largest tile with its halo, and its own noisy, basic and
+			// denoised images when the image is split
+			const unsigned int nb = nb_x * nb_y;
+			const unsigned int tile_w = min(width, (width + nb_x - 1) / nb_x + plan.align + 2 * plan.halo);
+			const unsigned int tile_h = min(height, (height + nb_y - 1) / nb_y + plan.align + 2 * plan.halo);
+			// Workspace of the steps, whose fftw buffers are counted for both
+			// steps, and the denoised IplImage kept with it
+			const size_t tiles = (nb > 1 ? 3 * (size_t)tile_w * tile_h * chnls * sizeof(float) : 0);
+			size_t bytes_1[STEP_BUFFER_NB];
+			size_t bytes_2[STEP_BUFFER_NB];
+			bm3d_step_buffers(bytes_1, 1, tile_w, tile_h, chnls, DCT, nHard, kHard, NHard, pHard);
+			bm3d_step_buffers(bytes_2, 2, tile_w, tile_h, chnls, DCT, nWien, kWien, NWien, pWien);
+
+			TilePlan tile = plan;
+			tile.nb_x = nb_x;
+			tile.nb_y = nb_y;
+			tile.peak_bytes = 3 * image + tiles + bm3d_workspace_bytes(bytes_1, bytes_2) + output;
+			if (!found || nb < best.nb_x * best.nb_y || (nb == best.nb_x * best.nb_y && tile.peak_bytes < best.peak_bytes))
+			{
+				if (!budget || tile.peak_bytes <= budget)
+				{
+					best = tile;
+					found = true;
+				}
+				else if (!plan.peak_bytes || tile.peak_bytes < plan.peak_bytes)
+					plan.peak_bytes = tile.peak_bytes;
+			}
+			if (!budget)
+				break;
+		}
+
+	if (found)
+		plan = best;
+	return found;
+}
+
+//
+// @brief Choose the tiles of an image for which run_bm3d_file fits in a
+//        memory budget: the largest square ones, so that the double
+//        halo read around each tile costs the least. Only the buffers
+//        of a tile are counted, see run_bm3d_file(): the peak does not
+//        depend on the size of the image. The tiles follow the rules of
+//        bm3d_plan_tiles().
+//
+// @param plan: will contain the tiles and their predicted peak. When the
+//        budget is too small, its peak is the one of the smallest tiles;
+// @param width, height, chnls: size of the image;
+// @param pixel_bytes: size of a sample of the rasters;
+// @param budget: memory budget in bytes, 0 for no budget. The
+//        interiors are at most BM3D_FILE_TILE_SIZE pixels wide and high
+//        in any case, so that the sizes of the planes of a tile and of
+//        its steps fit in 32 bits;
+// @param nHard, kHard, NHard, pHard: parameters of the 1st step;
+// @param nWien, kWien, NWien, pWien: parameters of the 2nd step.
+//
+// @return false if the budget is too small, otherwise true.
+//
+bool bm3d_plan_file_tiles(TilePlan & plan, const unsigned int width, const unsigned int height, const unsigned int chnls,
+	const unsigned int pixel_bytes, const size_t budget, const unsigned int nHard, const unsigned int kHard,
+	const unsigned int NHard, const unsigned int pHard, const unsigned int nWien, const unsigned int kWien,
+	const unsigned int NWien, const unsigned int pWien)
+{
+	plan = TilePlan();
+	plan.width = width;
+	plan.height = height;
+	plan.align = pHard;
+	const unsigned int reach = 2 * max(nHard, nWien) + max(kHard, kWien);
+	plan.halo = (reach + plan.align - 1) / plan.align * plan.align;
+
+	// Sizes of the interiors tried, from the largest one
+	unsigned int size = min(max(width, height), (unsigned int)BM3D_FILE_TILE_SIZE);
+	size = max(plan.halo, (size + plan.align - 1) / plan.align * plan.align);
+
+	for (unsigned int s = size; ; s -= plan.align)
+	{
+		TilePlan tile = plan;
+		tile.nb_x = min((width + s - 1) / s, max(1u, width / plan.halo));
+		tile.nb_y = min((height + s - 1) / s, max(1u, height / plan.halo));
+
+		// Largest tile with both halos and with one halo, the samples of
+		// a row of the rasters
+		const unsigned int in_w = min(width, (width + tile.nb_x - 1) / tile.nb_x + plan.align);
+		const unsigned int in_h = min(height, (height + tile.nb_y - 1) / tile.nb_y + plan.align);
+		const size_t w_1 = min(width, in_w + 4 * plan.halo);
+		const size_t h_1 = min(height, in_h + 4 * plan.halo);
+		const size_t w_2 = min(width, in_w + 2 * plan.halo);
+		const size_t h_2 = min(height, in_h + 2 * plan.halo);
+		const size_t tiles = (2 * w_1 * h_1 + 3 * w_2 * h_2) * chnls * sizeof(float) + w_1 * chnls * pixel_bytes;
+
+		// Workspace of the steps, whose fftw buffers are counted for both steps
+		size_t bytes_1[STEP_BUFFER_NB];
+		size_t bytes_2[STEP_BUFFER_NB];
+		bm3d_step_buffers(bytes_1, 1, (unsigned int)w_1, (unsigned int)h_1, chnls, DCT, nHard, kHard, NHard, pHard);
+		bm3d_step_buffers(bytes_2, 2, (unsigned int)w_2, (unsigned int)h_2, chnls, DCT, nWien, kWien, NWien, pWien);
+		tile.peak_bytes = tiles + bm3d_workspace_bytes(bytes_1, bytes_2);
+
+		if (!budget || tile.peak_bytes <= budget)
 		{
-			dct_2d_inverse(group_3D_table, kHard, NHard * chnls * column_ind_size, group_3D_table_size,
-				coef_norm_inv, plan_2d_inv);
+			plan = tile;
+			return true;
 		}
+		if (!plan.peak_bytes || tile.peak_bytes < plan.peak_bytes)
+			plan.peak_bytes = tile.peak_bytes;
+		if (s < plan.halo + plan.align)
+			break;
+	}
+	return false;
+}
+
+//
+// @brief Size of the largest tile of a plan, with its halo clipped to
+//        the image.
+//
+// @param plan: tiles of the image, see bm3d_plan_tiles();
+// @param tile_w, tile_h: will contain the size of the tile.
+//
+void bm3d_tile_size(const TilePlan & plan, unsigned int & tile_w, unsigned int & tile_h)
+{
+	tile_w = 0;
+	tile_h = 0;
+	for (unsigned int k = 0; k < plan.nb_x; k++)
+		tile_w = max(tile_w, min(plan.width, plan.x(k + 1) + plan.halo) - (plan.x(k) > plan.halo ? plan.x(k) - plan.halo : 0));
+	for (unsigned int k = 0; k < plan.nb_y; k++)
+		tile_h = max(tile_h, min(plan.height, plan.y(k + 1) + plan.halo) - (plan.y(k) > plan.halo ? plan.y(k) - plan.halo : 0));
+}
 
-		else if (tau_2D == BIOR)
+//
+// @brief Run a step tile by tile. Each tile is copied with its halo,
+//        denoised, then its interior is copied to the estimate. A plan
+//        of a single tile runs the step on the whole image.
+//
+// @param plan: tiles of the image, see bm3d_plan_tiles();
+// @param step: 1 for the 1st step, 2 for the 2nd one;
+// @param noisy: noisy image;
+// @param basic: will contain the basic estimate after the 1st step, and
+//        contains it for the 2nd step;
+// @param denoised: will contain the denoised image after the 2nd step;
+// @param skip_stats: if not NULL, will contain the work skipped by the
+//        1st step;
+// @param workspace: if not NULL, working memory of the step, reused by
+//        all the tiles, see StepWorkspace;
+// @param tiles: if not NULL, three planes of the largest tile (see
+//        bm3d_tile_size()), one after the other, for the noisy, basic
+//        and denoised tiles. Otherwise they are allocated by the call.
+//
+// @return EXIT_FAILURE if an allocation failed, otherwise
+//         EXIT_SUCCESS.
+//
+int bm3d_step_tiles(const TilePlan & plan, const unsigned int step, const PlanarImage & noisy, const PlanarImage & basic,
+	const PlanarImage & denoised, const float sigma, fftwf_plan * plan_2d_for_1, fftwf_plan * plan_2d_for_2,
+	SkipStats * skip_stats, StepWorkspace * workspace, float * tiles)
+{
+	if (plan.nb_x * plan.nb_y == 1)
+		return (step == 1 ? bm3d_1st_step(noisy, basic, sigma, plan_2d_for_1, plan_2d_for_2, skip_stats, workspace) :
+			bm3d_2nd_step(noisy, basic, denoised, sigma, plan_2d_for_1, plan_2d_for_2, workspace));
+
+	// Buffers of the largest tile with its halo
+	const unsigned int chnls = noisy.chnls;
+	unsigned int tile_w, tile_h;
+	bm3d_tile_size(plan, tile_w, tile_h);
+	const size_t tile_size = (size_t)tile_w * tile_h * chnls;
+	float * tiles_local = NULL;
+	if (!tiles)
+	{
+		tiles_local = plane_alloc<float>((step == 2 ? 3 : 2) * tile_size, false, MEM_STAGE_IMAGES);
+		if (!tiles_local)
 		{
-			bior_2d_inverse(group_3D_table, kHard, lpr, hpr, group_3D_table_size);
+			CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_step_tiles!\n");
+			return EXIT_FAILURE;
 		}
+		tiles = tiles_local;
+	}
+	float * tile_noisy = tiles;
+	float * tile_basic = tiles + tile_size;
+	float * tile_denoised = (step == 2 ? tiles + 2 * tile_size : NULL);
+
+	int status = EXIT_SUCCESS;
+	SkipStats stats;
+	for (unsigned int ty = 0; ty < plan.nb_y && status == EXIT_SUCCESS; ty++)
+		for (unsigned int tx = 0; tx < plan.nb_x && status == EXIT_SUCCESS; tx++)
+		{
+			// Interior [x_0, x_1) x [y_0, y_1), and the tile with its halo,
+			// clipped to the image
+			const unsigned int x_0 = plan.x(tx);
+			const unsigned int x_1 = plan.x(tx + 1);
+			const unsigned int y_0 = plan.y(ty);
+			const unsigned int y_1 = plan.y(ty + 1);
+			const unsigned int tile_x = (x_0 > plan.halo ? x_0 - plan.halo : 0);
+			const unsigned int tile_y = (y_0 > plan.halo ? y_0 - plan.halo : 0);
+			const unsigned int w = min(noisy.width, x_1 + plan.halo) - tile_x;
+			const unsigned int h = min(noisy.height, y_1 + plan.halo) - tile_y;
+			const PlanarImage sub_noisy(tile_noisy, w, h, chnls);
+			const PlanarImage sub_basic(tile_basic, w, h, chnls);
+			const PlanarImage sub_denoised(tile_denoised, w, h, chnls);
+
+			copy_rect(noisy, tile_x, tile_y, sub_noisy, 0, 0, w, h);
+			if (step == 1)
+			{
+				SkipStats tile_stats;
+				status = bm3d_1st_step(sub_noisy, sub_basic, sigma, plan_2d_for_1, plan_2d_for_2, &tile_stats, workspace);
+				stats.add(tile_stats);
+				copy_rect(sub_basic, x_0 - tile_x, y_0 - tile_y, basic, x_0, y_0, x_1 - x_0, y_1 - y_0);
+			}
+			else
+			{
+				copy_rect(basic, tile_x, tile_y, sub_basic, 0, 0, w, h);
+				status = bm3d_2nd_step(sub_noisy, sub_basic, sub_denoised, sigma, plan_2d_for_1, plan_2d_for_2, workspace);
+				copy_rect(sub_denoised, x_0 - tile_x, y_0 - tile_y, denoised, x_0, y_0, x_1 - x_0, y_1 - y_0);
+			}
+		}
+	if (skip_stats)
+		*skip_stats = stats;
+
+	plane_free(tiles_local);
+	tiles_local = NULL;
+
+	return status;
+}
+
+//
+// @brief Copy a rectangle of w x h pixels between two planar images of
+//        the same number of channels.
+//
+// @param src: image to read, from its pixel (x_src, y_src);
+// @param dst: image to write, from its pixel (x_dst, y_dst).
+//
+void copy_rect(const PlanarImage & src, const unsigned int x_src, const unsigned int y_src, const PlanarImage & dst,
+	const unsigned int x_dst, const unsigned int y_dst, const unsigned int w, const unsigned int h)
+{
+	for (unsigned int c = 0; c < src.chnls; c++)
+		for (unsigned int i = 0; i < h; i++)
+			memcpy(dst.data + (c * dst.height + y_dst + i) * dst.width + x_dst,
+				src.data + (c * src.height + y_src + i) * src.width + x_src, w * sizeof(float));
+}
 
-		// Registration of the weighted estimation
-		unsigned int dec = 0;
+StepWorkspace::StepWorkspace() : tables(NULL), patch_block(NULL), accumulator(NULL), arena(NULL)
+{
+	release();
+}
+
+//
+// @brief Plane of a workspace of at least bytes bytes: it is only
+//        reallocated when it is too small.
+//
+// @param plane: the plane, NULL if not allocated yet;
+// @param capacity: size of the plane;
+// @param stage: stage of the plane, for mem_stats_add().
+//
+// @return false if the allocation failed.
+//
+template <class T>
+static bool workspace_plane(T * &plane, size_t & capacity, const size_t bytes, const unsigned int stage)
+{
+	if (plane && capacity >= bytes)
+		return true;
+	plane_free(plane);
+	plane = (T *)plane_alloc(bytes, false, stage);
+	capacity = (plane ? bytes : 0);
+	return (plane != NULL);
+}
+
+//
+// @brief Prepare the workspace for a step on an image. The buffers too
+//        small for it are reallocated, the other ones are kept as they
+//        are. Then the small tables are taken at the start of the arena,
+//        and the indexes of the reference patches and the coefficients
+//        of the step are computed.
+//
+// @param step: 1 for the 1st step, 2 for the 2nd one;
+// @param width, height, chnls: size of the image, without its boundary;
+// @param tau_2D: 2D transform of the step, DCT or BIOR;
+// @param nHW, kHW, NHW, pHW: parameters of the step.
+//
+// @return false if an allocation failed, then the workspace is
+//         released.
+//
+bool StepWorkspace::prepare(const unsigned int step, const unsigned int width, const unsigned int height,
+	const unsigned int chnls, const unsigned int tau_2D, const unsigned int nHW, const unsigned int kHW,
+	const unsigned int NHW, const unsigned int pHW)
+{
+	size_t needed[STEP_BUFFER_NB];
+	bm3d_step_buffers(needed, step, width, height, chnls, tau_2D, nHW, kHW, NHW, pHW);
+
+	if (!arena)
+		arena = new ScratchArena;
+	bool ok = (arena != NULL);
+	if (ok && arena->size < needed[STEP_BUFFER_ARENA])
+		ok = arena->reserve(needed[STEP_BUFFER_ARENA]);
+	ok = ok && workspace_plane(tables, bytes[STEP_BUFFER_TABLES], needed[STEP_BUFFER_TABLES], MEM_STAGE_BLOCK_MATCHING)
+		&& workspace_plane(patch_block, bytes[STEP_BUFFER_PATCHES], needed[STEP_BUFFER_PATCHES], MEM_STAGE_BLOCK_MATCHING)
+		&& workspace_plane(accumulator, bytes[STEP_BUFFER_ACCUMULATOR], needed[STEP_BUFFER_ACCUMULATOR], MEM_STAGE_AGGREGATION);
+	if (!ok)
+	{
+		release();
+		return false;
+	}
+	bytes[STEP_BUFFER_ARENA] = arena->size;
+
+	this->width = width + 2 * nHW;
+	this->height = height + 2 * nHW;
+	this->chnls = chnls;
+	this->nHW = nHW;
+	this->kHW = kHW;
+	this->NHW = NHW;
+	this->pHW = pHW;
+	const unsigned int Ns = 2 * nHW + 1;
+	const unsigned int kHW_2 = kHW * kHW;
+
+	// Small tables, at the start of the arena (see bm3d_step_buffers())
+	arena->rewind(0);
+	row_ind = arena->alloc<unsigned int>(ind_count(this->height - kHW + 1, nHW, pHW));
+	column_ind = arena->alloc<unsigned int>(ind_count(this->width - kHW + 1, nHW, pHW));
+	sigma_table = arena->alloc<float>(chnls);
+	kaiser_window = arena->alloc<float>(kHW_2);
+	coef_norm = arena->alloc<float>(kHW_2);
+	coef_norm_inv = arena->alloc<float>(kHW_2);
+	dct_mat = arena->alloc<float>(2 * kHW_2);
+	lpd = arena->alloc<float>(10);
+	hpd = arena->alloc<float>(10);
+	lpr = arena->alloc<float>(10);
+	hpr = arena->alloc<float>(10);
+	sum_table = arena->alloc<float *>((nHW + 1) * Ns);
+	table_distance = arena->alloc<TD>(Ns * Ns);
+	table_distance_size = arena->alloc<unsigned int>(4 * nHW + 2);
+
+	ind_fill(row_ind, this->height - kHW + 1, nHW, pHW, row_ind_size);
+	ind_fill(column_ind, this->width - kHW + 1, nHW, pHW, column_ind_size);
+	preProcess(kaiser_window, coef_norm, coef_norm_inv, kHW);
+	dct_2d_coef(dct_mat, kHW);
+	bior15_coef(lpd, hpd, lpr, hpr);
+
+	// Plans of the inverse 2D DCT of every size of 3D group, so that the
+	// steps neither plan nor look the cache up for each group
+	for (unsigned int n = 0; n < STEP_PLAN_INVERSE_NB; n++)
+		plan_inverse[n] = NULL;
+#ifdef _BM3D_USE_FFTW
+	if (tau_2D == DCT)
+		for (unsigned int n = 0; n < STEP_PLAN_INVERSE_NB && (1u << n) <= NHW; n++)
+			plan_inverse[n] = plan_cache_get_2d(kHW, FFTW_REDFT01, chnls << n, 0);
+#endif      // #ifdef _BM3D_USE_FFTW
+
+	// Planes of the distances in the tables, and the similar patches
+	const size_t plane = (size_t)this->width * this->height;
+	for (unsigned int i = 0; i < (nHW + 1) * Ns; i++)
+		sum_table[i] = tables + i * plane;
+	patch_table = (unsigned int **)patch_block;
+	patch_table_size = (unsigned int *)(patch_table + plane);
+	patches = patch_table_size + plane;
+
+	return true;
+}
+
+//
+// @brief Free all the buffers of the workspace.
+//
+void StepWorkspace::release()
+{
+	plane_free(tables);
+	plane_free(patch_block);
+	plane_free(accumulator);
+	delete arena;
+
+	tables = NULL;
+	patch_block = NULL;
+	accumulator = NULL;
+	arena = NULL;
+	for (unsigned int k = 0; k < STEP_BUFFER_NB; k++)
+		bytes[k] = 0;
+
+	// Tables taken in the arena and in the block of the similar patches
+	row_ind = NULL;
+	column_ind = NULL;
+	sigma_table = NULL;
+	kaiser_window = NULL;
+	coef_norm = NULL;
+	coef_norm_inv = NULL;
+	dct_mat = NULL;
+	lpd = NULL;
+	hpd = NULL;
+	lpr = NULL;
+	hpr = NULL;
+	sum_table = NULL;
+	table_distance = NULL;
+	table_distance_size = NULL;
+	patch_table = NULL;
+	patch_table_size = NULL;
+	patches = NULL;
+	for (unsigned int n = 0; n < STEP_PLAN_INVERSE_NB; n++)
+		plan_inverse[n] = NULL;
+	row_ind_size = 0;
+	column_ind_size = 0;
+	width = height = chnls = 0;
+	nHW = kHW = NHW = pHW = 0;
+}
+
+//
+// @brief Run the basic process of BM3D (1st step). The result
+//        is contained in basic. The image is read with a mirrored
+//        boundary of nHard pixels, which is here only for
+//        block-matching and doesn't need to be denoised.
+//
+// @param noisy: noisy image;
+// @param basic: will contain the denoised image after the 1st step,
+//        same size as noisy;
+// @param sigma: value of assumed noise of the image to denoise;
+// @param useSD: if true, use weight based on the standard variation
+//        of the 3D group for the first step, otherwise use the number
+//        of non-zero coefficients after Hard-thresholding;
+// @param tau_2D: DCT or BIOR;
+// @param plan_2d_for_1, plan_2d_for_2 : for convenience. Used by fftw;
+// @param skip_stats: if not NULL, will contain the work skipped by the
+//        inverse transforms on the zero columns of the groups;
+// @param workspace: if not NULL, working memory of the step, prepared
+//        for the image and kept for the next calls (see StepWorkspace).
+//        Otherwise the step allocates its own.
+//
+// @return EXIT_FAILURE if an allocation failed, otherwise
+//         EXIT_SUCCESS.
+//
+int bm3d_1st_step(const PlanarImage & noisy, const PlanarImage & basic, const float sigma, fftwf_plan *  plan_2d_for_1, fftwf_plan *  plan_2d_for_2, SkipStats * skip_stats, StepWorkspace * workspace)
+{
+    const unsigned int tau_2D = 5;
+    const unsigned int nHard = 7;
+    const unsigned int kHard = (tau_2D == BIOR || sigma < 40.f ? 8 : 12);
+    const unsigned int NHard = 16;
+    const unsigned int pHard = 3;
+    const bool useSD = false;
+    const bool useSpectrumCache = spectrum_cache_env();
+    const unsigned int color_space = 2;
+
+    // The boundary is mirrored on the fly: width and height are the
+    // ones of the image with its boundary, used by the indexes of the
+    // patches
+    const MirroredImage img_noisy(noisy, nHard);
+    float * img_basic = basic.data;
+    const unsigned int width = img_noisy.width();
+    const unsigned int height = img_noisy.height();
+    const unsigned int chnls = noisy.chnls;
+    const unsigned int size = noisy.width * noisy.height * chnls;
+
+	// Working memory of the step, kept by the workspace for the next calls
+	StepWorkspace local;
+	StepWorkspace & ws = (workspace ? *workspace : local);
+	if (!ws.prepare(1, noisy.width, noisy.height, chnls, tau_2D, nHard, kHard, NHard, pHard))
+	{
+		CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_1st_step!\n");
+		return EXIT_FAILURE;
+	}
+
+	// Estimatation of sigma on each channel
+	float * sigma_table = ws.sigma_table;
+	if (estimate_sigma(sigma, sigma_table, chnls, color_space))
+	{
+		return EXIT_FAILURE;
+	}
+
+	// Parameters initialization
+	// Threshold for Hard Thresholding
+	const float    lambdaHard3D = 2.7f;
+
+	// threshold used to determinate similarity between patches
+	const float    tauMatch = (chnls == 1 ? 3.f : 1.f) * (sigma_table[0] < 35.0f ? 2500 : 5000);
+
+	// Initialization for convenience
+	const unsigned int * row_ind = ws.row_ind;
+	const unsigned int row_ind_size = ws.row_ind_size;
+	const unsigned int * column_ind = ws.column_ind;
+	const unsigned int column_ind_size = ws.column_ind_size;
+
+	const unsigned int kHard_2 = kHard * kHard;
+
+	// Kaiser window, coefficients of the DCT and of the Bior transform
+	float * kaiser_window = ws.kaiser_window;
+	float * coef_norm = ws.coef_norm;
+	float * coef_norm_inv = ws.coef_norm_inv;
+	float * dct_mat = ws.dct_mat;
+	float * lpd = ws.lpd;
+	float * hpd = ws.hpd;
+	float * lpr = ws.lpr;
+	float * hpr = ws.hpr;
+
+	// Scratch buffers, taken in the arena after the tables of the workspace
+	ScratchArena & arena = *ws.arena;
+
+	// 3D group being processed. It is inverse transformed and aggregated
+	// as soon as it is filtered, while it is still in cache
+	float * group_3D = arena.alloc<float>(chnls * NHard * kHard_2);
+	float * hadamard_tmp = arena.alloc<float>(NHard * kHard_2);
+	float * weight_table = arena.alloc<float>(chnls);
+	float * kaiser_weighted = arena.alloc<float>(kHard_2);
+
+	// Column masks of the thresholded group, states of its patches, and
+	// work skipped thanks to them
+	unsigned char * column_mask = arena.alloc<unsigned char>(chnls * kHard_2);
+	unsigned char * patch_state = arena.alloc<unsigned char>(chnls * NHard);
+	const size_t row_mark = arena.mark();
+	SkipStats stats;
+#ifdef _BM3D_USE_FFTW
+	const bool skipPatches = (tau_2D != DCT);    // fftw transforms the patches by batches
+#else
+	const bool skipPatches = true;
+#endif      // #ifdef _BM3D_USE_FFTW
+
+	// For aggregation part, on the image without its boundary: the
+	// numerator and the denominator of each pixel, interleaved
+	float * accumulator = ws.accumulator;
+	memset(accumulator, 0, 2 * size * sizeof(float));
+
+	// Precompute Bloc-Matching
+	precompute_BM(ws, img_noisy, tauMatch);
+	unsigned int ** patch_table = ws.patch_table;
+	const unsigned int * patch_table_size = ws.patch_table_size;
+	// nHard -- window size, NHard -- max number of similar patches
+
+
+	// The tables of distances are not used anymore: their plane holds the
+	// table of 2D transforms, or the 2D transform of every patch of the
+	// image, computed only once
+	float * table_2D = NULL;
+	unsigned short * spectrum_2D = NULL;
+	plane_stage(ws.tables, MEM_STAGE_TABLES_2D);
+	if (useSpectrumCache)
+	{
+		spectrum_2D = (unsigned short *)ws.tables;
+		spectrum_2d_process(spectrum_2D, img_noisy, kHard, tau_2D, dct_mat, lpd, hpd);
+	}
+	else
+	{
+		table_2D = ws.tables;
+		memset(table_2D, 0, (2 * nHard + 1) * width * chnls * kHard_2 * sizeof(float));
+	}
+
+	// Loop on i_r
+	for (unsigned int ind_i = 0; ind_i < row_ind_size; ind_i++)
+	{
+		const unsigned int i_r = row_ind[ind_i];
+
+		// The row scratch buffers of the previous row are given back
+		arena.rewind(row_mark);
+
+		// Update of table_2D
+		if (!useSpectrumCache && tau_2D == DCT)
+			dct_2d_process(table_2D, img_noisy, plan_2d_for_1, plan_2d_for_2, nHard,
+			kHard, i_r, pHard, coef_norm, row_ind[0], row_ind[row_ind_size - 1], dct_mat, arena);
+		else if (!useSpectrumCache && tau_2D == BIOR)
+			bior_2d_process(table_2D, img_noisy, nHard, kHard, i_r, pHard,
+			row_ind[0], row_ind[row_ind_size - 1], lpd, hpd);
+
+		// Loop on j_r
 		for (unsigned int ind_j = 0; ind_j < column_ind_size; ind_j++)
 		{
+			// Initialization
 			const unsigned int j_r = column_ind[ind_j];
 			const unsigned int k_r = i_r * width + j_r;
+
+			// Number of similar patches
 			const unsigned int nSx_r = patch_table_size[k_r];
 
+			// Prefetch of the patches of the next group
+			if (!useSpectrumCache && ind_j + 1 < column_ind_size)
+			{
+				const unsigned int k_next = i_r * width + column_ind[ind_j + 1];
+				group_3D_prefetch(table_2D, patch_table[k_next], patch_table_size[k_next],
+					width, 2 * nHard + 1, kHard_2, chnls);
+			}
+
+			// Build of the 3D group, patch by patch:
+			// group_3D[k + n * kHard_2 + c * nSx_r * kHard_2]. This layout is used
+			// by both the Hadamard transform and the 2D inverse transform.
+			if (useSpectrumCache)
+			{
+				for (unsigned int c = 0; c < chnls; c++)
+					for (unsigned int n = 0; n < nSx_r; n++)
+					{
+						const unsigned short * spectrum = spectrum_2D
+							+ (patch_table[k_r][n] + c * (size_t)width * height) * kHard_2;
+						for (unsigned int k = 0; k < kHard_2; k++)
+							group_3D[k + n * kHard_2 + c * nSx_r * kHard_2] =
+							half_to_float(spectrum[k]);
+					}
+			}
+			else
+				group_3D_gather(group_3D, table_2D, patch_table[k_r], nSx_r, width,
+					2 * nHard + 1, kHard_2, chnls);
+
+			// HT filtering of the 3D group
+			ht_filtering_hadamard(group_3D, hadamard_tmp, nSx_r, kHard, chnls, sigma_table,
+				lambdaHard3D, weight_table, !useSD, column_mask);
+
+			// 3D weighting using Standard Deviation
+			if (useSD)
+				sd_weighting(group_3D, nSx_r, kHard, chnls, weight_table);
+
+			// States of the patches for the 2D inverse transform: a group
+			// without any non-zero column is null, and a group with only
+			// DC columns is made of copies of its first patch
 			for (unsigned int c = 0; c < chnls; c++)
 			{
-				for (unsigned int n = 0; n < nSx_r; n++)
+				unsigned int nb_zero = 0;
+				unsigned int nb_dc = 0;
+				for (unsigned int k = 0; k < kHard_2; k++)
 				{
-					const unsigned int k = patch_table[k_r][n] + c * width * height;
-					for (unsigned int p = 0; p < kHard; p++)
-						for (unsigned int q = 0; q < kHard; q++)
-						{
-							const unsigned int ind = k + p * width + q;
-							numerator[ind] += kaiser_window[p * kHard + q]
-								* wx_r_table[c + ind_j * chnls]
-								* group_3D_table[p * kHard + q + n * kHard_2
-								+ c * kHard_2 * nSx_r + dec];
-							denominator[ind] += kaiser_window[p * kHard + q]
-								* wx_r_table[c + ind_j * chnls];
-						}
+					nb_zero += (column_mask[k + c * kHard_2] == COLUMN_ZERO);
+					nb_dc += (column_mask[k + c * kHard_2] == COLUMN_DC);
+				}
+				const unsigned char first = (nb_zero == kHard_2 ? PATCH_ZERO : PATCH_COMPUTE);
+				const unsigned char others = (nb_zero == kHard_2 ? PATCH_ZERO :
+					(nb_zero + nb_dc == kHard_2 ? PATCH_COPY : PATCH_COMPUTE));
+				patch_state[c * nSx_r] = first;
+				for (unsigned int n = 1; n < nSx_r; n++)
+					patch_state[n + c * nSx_r] = others;
+
+				stats.columns += kHard_2;
+				stats.columns_zero += nb_zero;
+				stats.columns_dc += nb_dc;
+				if (skipPatches)
+				{
+					stats.patches += nSx_r;
+					stats.patches_zero += (first == PATCH_ZERO) + (nSx_r - 1) * (others == PATCH_ZERO);
+					stats.patches_copy += (nSx_r - 1) * (others == PATCH_COPY);
 				}
 			}
-			dec += nSx_r * chnls * kHard_2;
-		}
-		delete[] group_3D_table;
-		delete[] wx_r_table;
 
-		group_3D_table = NULL;
-		wx_r_table = NULL;
+			// 2D inverse transform of the group, while it is still in cache
+			if (tau_2D == DCT)
+				dct_2d_inverse(group_3D, kHard, chnls * nSx_r * kHard_2, ws.plan_inverse[ind_log2(nSx_r)],
+					coef_norm_inv, dct_mat, patch_state, arena);
+			else if (tau_2D == BIOR)
+				bior_2d_inverse(group_3D, kHard, lpr, hpr, chnls * nSx_r * kHard_2, patch_state);
+
+			// Registration of the weighted estimation
+			group_aggregate(accumulator, group_3D, patch_table[k_r], nSx_r, noisy.width, noisy.height,
+				chnls, nHard, kHard, kaiser_window, weight_table, kaiser_weighted);
+
+		} // End of loop on j_r
 
 	} // End of loop on i_r
 
-	delete[] table_2D;
-	delete[] hpr;
-	delete[] lpr;
-	delete[] hpd;
-	delete[] lpd;
-	delete[] coef_norm_inv;
-	delete[] coef_norm;
-	delete[] kaiser_window;
-	delete[] hadamard_tmp;
-	delete[] sigma_table;
-
-	table_2D = NULL;
-	hpr = NULL;
-	lpr = NULL;
-	hpd = NULL;
-	lpd = NULL;
-	coef_norm_inv = NULL;
-	coef_norm = NULL;
-	kaiser_window = NULL;
-	hadamard_tmp = NULL;
-	sigma_table = NULL;
+	if (skip_stats)
+		*skip_stats = stats;
 
 	// Final reconstruction
-	for (unsigned int k = 0; k < width * height * chnls; k++)
-	{
-		img_basic[k] = numerator[k] / denominator[k];
-		// Foreback black-blocking problem
-		if (denominator[k] == 0.0)
-		{
-			img_basic[k] = img_noisy[k];
-		}
-	}
-	delete[] numerator;
-	delete[] denominator;
-
-	numerator = NULL;
-	denominator = NULL;
+	aggregate_estimate(accumulator, noisy.data, img_basic, size);
 
-    IplImage * iplImage_basic = transfer_buffer2iplImage(img_basic, width, height, chnls, false);
-    return iplImage_basic;
+	return EXIT_SUCCESS;
 }
 
 //
 // @brief Run the final process of BM3D (2nd step). The result
-//        is contained in img_denoised. The image has boundary, which
-//        are here only for block-matching and doesn't need to be
-//        denoised.
+//        is contained in denoised. The images are read with a
+//        mirrored boundary of nWien pixels, which is here only for
+//        block-matching and doesn't need to be denoised.
 //
-// @param sigma: value of assumed noise of the image to denoise;
-// @param img_noisy: noisy image;
-// @param img_basic: contains the denoised image after the 1st step;
-// @param img_denoised: will contain the final estimate of the denoised
+// @param noisy: noisy image;
+// @param basic: contains the denoised image after the 1st step;
+// @param denoised: will contain the final estimate of the denoised
 //        image after the second step;
-// @param width, height, chnls : size of img_noisy;
-// @param nWien: size of the boundary around img_noisy;
+// @param sigma: value of assumed noise of the image to denoise;
 // @param useSD: if true, use weight based on the standard variation
 //        of the 3D group for the second step, otherwise use the norm
 //        of Wiener coefficients of the 3D group;
-// @param tau_2D: DCT or BIOR.
+// @param tau_2D: DCT or BIOR;
+// @param workspace: if not NULL, working memory of the step, prepared
+//        for the images and kept for the next calls (see StepWorkspace).
+//        Otherwise the step allocates its own.
 //
-// @return none.
+// @return EXIT_FAILURE if an allocation failed, otherwise
+//         EXIT_SUCCESS.
 //
-IplImage * bm3d_2nd_step(IplImage * iplImage, IplImage * iplImage_basic, const float sigma, fftwf_plan *  plan_2d_for_1, fftwf_plan *  plan_2d_for_2, fftwf_plan *  plan_2d_inv)
+int bm3d_2nd_step(const PlanarImage & noisy, const PlanarImage & basic, const PlanarImage & denoised, const float sigma, fftwf_plan *  plan_2d_for_1, fftwf_plan *  plan_2d_for_2, StepWorkspace * workspace)
 {
-    float * img_basic = transfer_iplImage2buffer(iplImage_basic);
-    float * img_noisy = transfer_iplImage2buffer(iplImage);
-    const unsigned int width = iplImage->width;
-    const unsigned int height = iplImage->height;
-    const unsigned int chnls = iplImage->nChannels;
-
-    float * img_denoised = new float[width * height * chnls];
-
     const unsigned int tau_2D = 4;
     const unsigned int nWien = 7;
     const unsigned int kWien = (tau_2D == BIOR || sigma < 40.f ? 4 : 12);
     const unsigned int NWien = 32;
     const unsigned int pWien = 3;
     const bool useSD = true;
+    const bool useSpectrumCache = spectrum_cache_env();
     const unsigned int color_space = 2;
-	// Estimatation of sigma on each channel
-	float * sigma_table = new float[chnls];
-	if (!sigma_table)
+
+    // The boundaries are mirrored on the fly: width and height are the
+    // ones of the images with their boundary, used by the indexes of the
+    // patches
+    const MirroredImage img_basic(basic, nWien);
+    const MirroredImage img_noisy(noisy, nWien);
+    float * img_denoised = denoised.data;
+    const unsigned int width = img_noisy.width();
+    const unsigned int height = img_noisy.height();
+    const unsigned int chnls = noisy.chnls;
+    const unsigned int size = noisy.width * noisy.height * chnls;
+
+	// Working memory of the step, kept by the workspace for the next calls
+	StepWorkspace local;
+	StepWorkspace & ws = (workspace ? *workspace : local);
+	if (!ws.prepare(2, noisy.width, noisy.height, chnls, tau_2D, nWien, kWien, NWien, pWien))
 	{
 		CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_2nd_step!\n");
-		delete[] sigma_table;
-		sigma_table = NULL;
+		return EXIT_FAILURE;
 	}
+
+	// Estimatation of sigma on each channel
+	float * sigma_table = ws.sigma_table;
 	if (estimate_sigma(sigma, sigma_table, chnls, color_space))
 	{
-		return NULL;
+		return EXIT_FAILURE;
 	}
 
 	// Parameters initialization
@@ -755,122 +1846,67 @@ IplImage * bm3d_2nd_step(IplImage * iplImage, IplImage * iplImage_basic, const f
 	const float tauMatch = (sigma_table[0] < 35.0f ? 400.0f : 3500);
 
 	// Initialization for convenience
-	unsigned int * row_ind;
-	unsigned int row_ind_size;
-	ind_initialize(row_ind, height - kWien + 1, nWien, pWien, row_ind_size);
-	unsigned int * column_ind;
-	unsigned int column_ind_size;
-	ind_initialize(column_ind, width - kWien + 1, nWien, pWien, column_ind_size);
+	const unsigned int * row_ind = ws.row_ind;
+	const unsigned int row_ind_size = ws.row_ind_size;
+	const unsigned int * column_ind = ws.column_ind;
+	const unsigned int column_ind_size = ws.column_ind_size;
 	const unsigned int kWien_2 = kWien * kWien;
 
-	float * group_3D_table;
-	float * wx_r_table;
-
-	float * tmp = new float[NWien];
-	float * kaiser_window = new float[kWien_2];
-	float * coef_norm = new float[kWien_2];
-	float * coef_norm_inv = new float[kWien_2];
-	if (!tmp || !kaiser_window || !coef_norm || !coef_norm_inv)
-	{
-		if (!tmp)
-		{
-			delete[] tmp;
-			tmp = NULL;
-		}
-		if (!kaiser_window)
-		{
-			delete[] kaiser_window;
-			kaiser_window = NULL;
-		}
-		if (!coef_norm)
-		{
-			delete[] coef_norm;
-			coef_norm = NULL;
-		}
-		if (!coef_norm_inv)
-		{
-			delete[] coef_norm_inv;
-			coef_norm_inv = NULL;
-		}
-		CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_2nd_step!\n");
-		return NULL;
-	}
-
-	preProcess(kaiser_window, coef_norm, coef_norm_inv, kWien);
-
-	// For aggregation part
-	float * denominator = new float[width * height * chnls]();
-	float * numerator = new float[width * height * chnls]();
-	if (!denominator || !numerator)
-	{
-		if (!denominator)
-		{
-			delete[] denominator;
-			denominator = NULL;
-		}
-		if (!numerator)
-		{
-			delete[] numerator;
-			numerator = NULL;
-		}
-		CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_2nd_step!\n");
-		return NULL;
-	}
+	// Scratch buffers, taken in the arena after the tables of the workspace
+	ScratchArena & arena = *ws.arena;
+
+	// 3D groups being processed. The basic estimate group is inverse
+	// transformed and aggregated as soon as it is filtered
+	float * group_3D_est = arena.alloc<float>(chnls * NWien * kWien_2);
+	float * group_3D_img = arena.alloc<float>(chnls * NWien * kWien_2);
+	float * tmp = arena.alloc<float>(NWien * kWien_2);
+	float * weight_table = arena.alloc<float>(chnls);
+	float * kaiser_weighted = arena.alloc<float>(kWien_2);
+	const size_t row_mark = arena.mark();
+
+	// Kaiser window, coefficients of the DCT and of the Bior transform
+	float * kaiser_window = ws.kaiser_window;
+	float * coef_norm = ws.coef_norm;
+	float * coef_norm_inv = ws.coef_norm_inv;
+	float * dct_mat = ws.dct_mat;
+	float * lpd = ws.lpd;
+	float * hpd = ws.hpd;
+	float * lpr = ws.lpr;
+	float * hpr = ws.hpr;
+
+	// For aggregation part, on the image without its boundary: the
+	// numerator and the denominator of each pixel, interleaved
+	float * accumulator = ws.accumulator;
+	memset(accumulator, 0, 2 * size * sizeof(float));
 
 	// Precompute Bloc-Matching
-	unsigned int ** patch_table;
-	unsigned int * patch_table_size;
-	precompute_BM(patch_table, patch_table_size, img_basic, width, height, kWien, NWien, nWien, pWien, tauMatch);
-
-	// Preprocessing of Bior table
-	float * lpd = new float[10];
-	float * hpd = new float[10];
-	float * lpr = new float[10];
-	float * hpr = new float[10];
-	if (!lpd || !hpd || !lpr || !hpr)
-	{
-		if (!lpd)
-		{
-			delete[] lpd;
-			lpd = NULL;
-		}
-		if (!hpd)
-		{
-			delete[] hpd;
-			hpd = NULL;
-		}
-		if (!lpr)
-		{
-			delete[] lpr;
-			lpr = NULL;
-		}
-		if (!hpr)
-		{
-			delete[] hpr;
-			hpr = NULL;
-		}
-		CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_2nd_step!\n");
-		return NULL;
+	precompute_BM(ws, img_basic, tauMatch);
+	unsigned int ** patch_table = ws.patch_table;
+	const unsigned int * patch_table_size = ws.patch_table_size;
+
+	float * table_2D_img = NULL;
+	float * table_2D_est = NULL;
+	unsigned short * spectrum_2D_img = NULL;
+	unsigned short * spectrum_2D_est = NULL;
+	plane_stage(ws.tables, MEM_STAGE_TABLES_2D);
+	if (useSpectrumCache)
+	{
+		// The tables of distances are not used anymore: their plane holds
+		// the 2D transform of every patch of both images, computed only
+		// once
+		spectrum_2D_img = (unsigned short *)ws.tables;
+		spectrum_2D_est = spectrum_2D_img + (size_t)width * height * chnls * kWien_2;
+		spectrum_2d_process(spectrum_2D_img, img_noisy, kWien, tau_2D, dct_mat, lpd, hpd);
+		spectrum_2d_process(spectrum_2D_est, img_basic, kWien, tau_2D, dct_mat, lpd, hpd);
 	}
-	bior15_coef(lpd, hpd, lpr, hpr);
-
-
-	float * table_2D_img = new float[(2 * nWien + 1) * width * chnls * kWien_2]();
-	float * table_2D_est = new float[(2 * nWien + 1) * width * chnls * kWien_2]();
-	if (!table_2D_img || !table_2D_est)
+	else
 	{
-		if (!table_2D_img)
-		{
-			delete[] table_2D_img;
-			table_2D_img;
-		}
-		if (!table_2D_est)
-		{
-			delete[] table_2D_est;
-			table_2D_est = NULL;
-		}
-		CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_2nd_step!\n");
-		return NULL;
+		// The tables of distances are not used anymore: their plane holds
+		// both tables of 2D transforms
+		const size_t table_size = (2 * nWien + 1) * width * chnls * kWien_2;
+		table_2D_img = ws.tables;
+		table_2D_est = ws.tables + table_size;
+		memset(ws.tables, 0, 2 * table_size * sizeof(float));
 	}
 
 	// Loop on i_r
@@ -878,49 +1914,27 @@ IplImage * bm3d_2nd_step(IplImage * iplImage, IplImage * iplImage_basic, const f
 	{
 		const unsigned int i_r = row_ind[ind_i];
 
+		// The row scratch buffers of the previous row are given back
+		arena.rewind(row_mark);
+
 		// Update of DCT_table_2D
-		if (tau_2D == DCT)
+		if (!useSpectrumCache && tau_2D == DCT)
 		{
 			dct_2d_process(table_2D_img, img_noisy, plan_2d_for_1, plan_2d_for_2,
-				nWien, width, height, chnls, kWien, i_r, pWien, coef_norm,
-				row_ind[0], row_ind[row_ind_size - 1]);
+				nWien, kWien, i_r, pWien, coef_norm,
+				row_ind[0], row_ind[row_ind_size - 1], dct_mat, arena);
 			dct_2d_process(table_2D_est, img_basic, plan_2d_for_1, plan_2d_for_2,
-				nWien, width, height, chnls, kWien, i_r, pWien, coef_norm,
-				row_ind[0], row_ind[row_ind_size - 1]);
+				nWien, kWien, i_r, pWien, coef_norm,
+				row_ind[0], row_ind[row_ind_size - 1], dct_mat, arena);
 		}
-		else if (tau_2D == BIOR)
+		else if (!useSpectrumCache && tau_2D == BIOR)
 		{
-			bior_2d_process(table_2D_img, img_noisy, nWien, width, height,
-				chnls, kWien, i_r, pWien, row_ind[0], row_ind[row_ind_size - 1], lpd, hpd);
-			bior_2d_process(table_2D_est, img_basic, nWien, width, height,
-				chnls, kWien, i_r, pWien, row_ind[0], row_ind[row_ind_size - 1], lpd, hpd);
+			bior_2d_process(table_2D_img, img_noisy, nWien, kWien, i_r, pWien,
+				row_ind[0], row_ind[row_ind_size - 1], lpd, hpd);
+			bior_2d_process(table_2D_est, img_basic, nWien, kWien, i_r, pWien,
+				row_ind[0], row_ind[row_ind_size - 1], lpd, hpd);
 		}
 
-		wx_r_table = new float[chnls * column_ind_size];
-		if (!wx_r_table)
-		{
-			CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_2nd_step!\n");
-			delete[] wx_r_table;
-			wx_r_table = NULL;
-		}
-
-		unsigned int sum_nSx_r = 0;
-		for (unsigned int ind_j = 0; ind_j < column_ind_size; ind_j++)
-		{
-			const unsigned int j_r = column_ind[ind_j];
-			const unsigned int k_r = i_r * width + j_r;
-			sum_nSx_r += patch_table_size[k_r];
-		}
-		unsigned int group_3D_table_size = chnls * sum_nSx_r * kWien_2;
-		group_3D_table = new float[group_3D_table_size];
-		if (!group_3D_table)
-		{
-			CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_2nd_step!\n");
-			delete[] group_3D_table;
-			group_3D_table = NULL;
-		}
-		unsigned int sum = 0;
-
 		// Loop on j_r
 		for (unsigned int ind_j = 0; ind_j < column_ind_size; ind_j++)
 		{
@@ -931,51 +1945,41 @@ IplImage * bm3d_2nd_step(IplImage * iplImage, IplImage * iplImage_basic, const f
 			// Number of similar patches
 			const unsigned int nSx_r = patch_table_size[k_r];
 
-			// Build of the 3D group
-			float * group_3D_est = new float[chnls * nSx_r * kWien_2]();
-			float * group_3D_img = new float[chnls * nSx_r * kWien_2]();
-			float * group_3D_table_ = new float[chnls * nSx_r * kWien_2];
-			if (!group_3D_est || !group_3D_img || !group_3D_table_)
+			// Prefetch of the patches of the next group
+			if (!useSpectrumCache && ind_j + 1 < column_ind_size)
 			{
-				if (!group_3D_est)
-				{
-					delete[] group_3D_est;
-					group_3D_est = NULL;
-				}
-				if (!group_3D_img)
-				{
-					delete[] group_3D_img;
-					group_3D_img = NULL;
-				}
-				if (!group_3D_table_)
-				{
-					delete[] group_3D_table_;
-					group_3D_table_ = NULL;
-				}
-				CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_2nd_step!\n");
-				return NULL;
+				const unsigned int k_next = i_r * width + column_ind[ind_j + 1];
+				group_3D_prefetch(table_2D_est, patch_table[k_next], patch_table_size[k_next],
+					width, 2 * nWien + 1, kWien_2, chnls);
+				group_3D_prefetch(table_2D_img, patch_table[k_next], patch_table_size[k_next],
+					width, 2 * nWien + 1, kWien_2, chnls);
 			}
-			for (unsigned int c = 0; c < chnls; c++)
-				for (unsigned int n = 0; n < nSx_r; n++)
-				{
-					const unsigned int ind = patch_table[k_r][n] + (nWien - i_r) * width;
-					for (unsigned int k = 0; k < kWien_2; k++)
+
+			// Build of the 3D groups, patch by patch (see bm3d_1st_step)
+			if (useSpectrumCache)
+			{
+				for (unsigned int c = 0; c < chnls; c++)
+					for (unsigned int n = 0; n < nSx_r; n++)
 					{
-						group_3D_est[n + k * nSx_r + c * kWien_2 * nSx_r] =
-							table_2D_est[k + ind * kWien_2 + c * kWien_2 * (2 * nWien + 1) * width];
-						group_3D_img[n + k * nSx_r + c * kWien_2 * nSx_r] =
-							table_2D_img[k + ind * kWien_2 + c * kWien_2 * (2 * nWien + 1) * width];
+						const size_t ind = (patch_table[k_r][n] + c * (size_t)width * height) * kWien_2;
+						for (unsigned int k = 0; k < kWien_2; k++)
+						{
+							group_3D_est[k + n * kWien_2 + c * nSx_r * kWien_2] =
+								half_to_float(spectrum_2D_est[k + ind]);
+							group_3D_img[k + n * kWien_2 + c * nSx_r * kWien_2] =
+								half_to_float(spectrum_2D_img[k + ind]);
+						}
 					}
-				}
-
-			// Wiener filtering of the 3D group
-			float * weight_table = new float[chnls];
-			if (!weight_table)
+			}
+			else
 			{
-				CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_2nd_step!\n");
-				delete[] weight_table;
-				weight_table = NULL;
+				group_3D_gather(group_3D_est, table_2D_est, patch_table[k_r], nSx_r, width,
+					2 * nWien + 1, kWien_2, chnls);
+				group_3D_gather(group_3D_img, table_2D_img, patch_table[k_r], nSx_r, width,
+					2 * nWien + 1, kWien_2, chnls);
 			}
+
+			// Wiener filtering of the 3D group
 			wiener_filtering_hadamard(group_3D_img, group_3D_est, tmp, nSx_r, kWien,
 				chnls, sigma_table, weight_table, !useSD);
 
@@ -985,327 +1989,661 @@ IplImage * bm3d_2nd_step(IplImage * iplImage, IplImage * iplImage_basic, const f
 				sd_weighting(group_3D_est, nSx_r, kWien, chnls, weight_table);
 			}
 
-			// Save the 3D group. The DCT 2D inverse will be done after.
-			for (unsigned int c = 0; c < chnls; c++)
-			{
-				for (unsigned int n = 0; n < nSx_r; n++)
-				{
-					for (unsigned int k = 0; k < kWien_2; k++)
-					{
-						unsigned int index = k + n * kWien_2 + c * kWien_2 * nSx_r;
-						group_3D_table_[index] = group_3D_est[n + k * nSx_r + c * kWien_2 * nSx_r];
-					}
-				}
-			}
+			// 2D inverse transform of the group, while it is still in cache
+			if (tau_2D == DCT)
+				dct_2d_inverse(group_3D_est, kWien, chnls * nSx_r * kWien_2, ws.plan_inverse[ind_log2(nSx_r)],
+					coef_norm_inv, dct_mat, NULL, arena);
+			else if (tau_2D == BIOR)
+				bior_2d_inverse(group_3D_est, kWien, lpr, hpr, chnls * nSx_r * kWien_2, NULL);
 
-			unsigned int sz = chnls * nSx_r * kWien_2;
-			for (unsigned int i = 0; i < sz; i++)
-			{
-				group_3D_table[i + sum] = group_3D_table_[i];
-			}
-			sum += sz;
+			// Registration of the weighted estimation
+			group_aggregate(accumulator, group_3D_est, patch_table[k_r], nSx_r, noisy.width, noisy.height,
+				chnls, nWien, kWien, kaiser_window, weight_table, kaiser_weighted);
+		} // End of loop on j_r
 
-			// Save weighting
-			for (unsigned int c = 0; c < chnls; c++)
-			{
-				wx_r_table[chnls * ind_j + c] = weight_table[c];
-			}
+	} // End of loop on i_r
 
-			delete[] group_3D_table_;
-			delete[] weight_table;
-			delete[] group_3D_img;
-			delete[] group_3D_est;
+	// Final reconstruction
+	aggregate_estimate(accumulator, noisy.data, img_denoised, size);
 
-			group_3D_table_ = NULL;
-			weight_table = NULL;
-			group_3D_img = NULL;
-			group_3D_est = NULL;
-		} // End of loop on j_r
+	return EXIT_SUCCESS;
+}
+
+//
+// @brief Index of a patch in a table of 2D transforms. The table
+//        holds nb_rows rows of patches used as a ring buffer: the
+//        patches of the image row i are stored in the row i % nb_rows.
+//
+// @param k : index of the top-left pixel of the patch in the image;
+// @param width : width of the image;
+// @param nb_rows : number of rows of the table (2 * nHW + 1).
+//
+// @return the index of the patch in the table.
+//
+unsigned int table_2D_ind(const unsigned int k, const unsigned int width, const unsigned int nb_rows)
+{
+	return ((k / width) % nb_rows) * width + k % width;
+}
 
-		//  Apply 2D dct inverse
-		if (tau_2D == DCT)
+//
+// @brief Build a 3D group from a table of 2D transforms. The patches
+//        are copied one after the other, so each copy is contiguous:
+//        group_3D[k + n * kHW_2 + c * nSx_r * kHW_2].
+//
+// @param group_3D : will contain the 3D group;
+// @param table_2D : table of 2D transforms (ring buffer of nb_rows rows);
+// @param patches : indexes of the similar patches;
+// @param nSx_r : number of similar patches;
+// @param width : width of the image;
+// @param nb_rows : number of rows of the table (2 * nHW + 1);
+// @param kHW_2 : number of pixels of a patch;
+// @param chnls : number of channels of the image.
+//
+// @return none.
+//
+void group_3D_gather(float * group_3D, float * const table_2D, unsigned int * const patches, const unsigned int nSx_r,
+	const unsigned int width, const unsigned int nb_rows, const unsigned int kHW_2, const unsigned int chnls)
+{
+	const unsigned int table_size = kHW_2 * nb_rows * width;
+	for (unsigned int n = 0; n < nSx_r; n++)
+	{
+		const float * patch = table_2D + table_2D_ind(patches[n], width, nb_rows) * kHW_2;
+		for (unsigned int c = 0; c < chnls; c++)
 		{
-			dct_2d_inverse(group_3D_table, kWien, NWien * chnls * column_ind_size, group_3D_table_size,
-				coef_norm_inv, plan_2d_inv);
+			const float * src = patch + c * table_size;
+			float * dst = group_3D + n * kHW_2 + c * nSx_r * kHW_2;
+			for (unsigned int k = 0; k < kHW_2; k++)
+				dst[k] = src[k];
 		}
-		else if (tau_2D == BIOR)
+	}
+}
+
+//
+// @brief Prefetch the patches of a 3D group from a table of 2D
+//        transforms, see group_3D_gather(). Does nothing without SIMD.
+//
+void group_3D_prefetch(float * const table_2D, unsigned int * const patches, const unsigned int nSx_r,
+	const unsigned int width, const unsigned int nb_rows, const unsigned int kHW_2, const unsigned int chnls)
+{
+#ifdef __SR_USE_SIMD
+	const unsigned int table_size = kHW_2 * nb_rows * width;
+	for (unsigned int n = 0; n < nSx_r; n++)
+	{
+		const float * patch = table_2D + table_2D_ind(patches[n], width, nb_rows) * kHW_2;
+		for (unsigned int c = 0; c < chnls; c++)
+			for (unsigned int k = 0; k < kHW_2; k += 16)          // one cache line = 16 floats
+				_mm_prefetch((const char *)(patch + c * table_size + k), _MM_HINT_T0);
+	}
+#endif      // #ifdef __SR_USE_SIMD
+}
+
+#ifdef _BM3D_USE_FFTW
+//
+// @brief Size of a buffer of nb patches for the cached 2D DCT plans,
+//        see fftw_batch_alloc().
+//
+// @param nb : number of patches;
+// @param kHW_2 : number of pixels of a patch.
+//
+// @return the size in bytes, as taken in a ScratchArena.
+//
+size_t fftw_batch_bytes(const unsigned int nb, const unsigned int kHW_2)
+{
+	const unsigned int nb_r = FFTW_PLAN_BATCH * ((nb + FFTW_PLAN_BATCH - 1) / FFTW_PLAN_BATCH);
+	return ScratchArena::aligned(nb_r * kHW_2 * sizeof(float));
+}
+
+//
+// @brief Take a buffer of nb patches for the cached 2D DCT plans in an
+//        arena. Its size is rounded up to a multiple of FFTW_PLAN_BATCH
+//        patches, the padding being set to 0.
+//
+// @param arena : arena reserved with fftw_batch_bytes();
+// @param nb : number of patches;
+// @param kHW_2 : number of pixels of a patch.
+//
+// @return the buffer, given back by rewinding the arena.
+//
+float * fftw_batch_alloc(ScratchArena & arena, const unsigned int nb, const unsigned int kHW_2)
+{
+	const unsigned int nb_r = FFTW_PLAN_BATCH * ((nb + FFTW_PLAN_BATCH - 1) / FFTW_PLAN_BATCH);
+	float * vec = arena.alloc<float>(nb_r * kHW_2);
+	if (!vec)
+	{
+		CImageUtility::showErrMsg("Fail to allocate buffer in fftw_batch_alloc!\n");
+		return NULL;
+	}
+	for (unsigned int k = nb * kHW_2; k < nb_r * kHW_2; k++)
+		vec[k] = 0.0f;
+	return vec;
+}
+
+//
+// @brief Apply a cached 2D DCT plan on nb patches, by batches of
+//        FFTW_PLAN_BATCH patches.
+//
+// @param plan : plan from plan_cache_get_2d();
+// @param in, out : buffers allocated with fftw_batch_alloc();
+// @param nb : number of patches;
+// @param kHW_2 : number of pixels of a patch.
+//
+void fftw_batch_execute(fftwf_plan * plan, float * in, float * out, const unsigned int nb, const unsigned int kHW_2)
+{
+	for (unsigned int n = 0; n < nb; n += FFTW_PLAN_BATCH)
+		fftwf_execute_r2r(*plan, in + n * kHW_2, out + n * kHW_2);
+}
+#endif      // #ifdef _BM3D_USE_FFTW
+
+//
+// @brief Patch of a MirroredImage. The patches inside the image are read
+//        in place, only the ones which overlap its boundary are copied,
+//        their pixels being mirrored.
+//
+// @param c : channel;
+// @param i, j : top-left pixel of the patch, in the image with its boundary;
+// @param k : size of the patch (k x k);
+// @param buf : will contain the patch if it overlaps the boundary, of size
+//        k x k;
+// @param stride : will contain the distance between two rows of the patch.
+//
+// @return the top-left pixel of the patch.
+//
+float * MirroredImage::patch(const unsigned int c, const unsigned int i, const unsigned int j, const unsigned int k,
+	float * buf, unsigned int & stride) const
+{
+	// Inside the image: fast path
+	if (i >= N && i + k <= N + img.height && j >= N && j + k <= N + img.width)
+	{
+		stride = img.width;
+		return img.data + (c * img.height + i - N) * img.width + j - N;
+	}
+
+	// Overlap of the boundary
+	for (unsigned int p = 0; p < k; p++)
+	{
+		const float * src = img.data + (c * img.height + row(i + p)) * img.width;
+		for (unsigned int q = 0; q < k; q++)
+			buf[p * k + q] = src[column(j + q)];
+	}
+	stride = k;
+	return buf;
+}
+
+//
+// @brief Precompute a 2D DCT transform on all patches contained in
+//        a part of the image.
+//
+// @param DCT_table_2D : will contain the 2d DCT transform for all
+//        chosen patches. The 2 * nHW + 1 rows of the table are used as
+//        a ring buffer, see table_2D_ind();
+// @param img : image on which the 2d DCT will be processed, with its
+//        mirrored boundary of nHW pixels;
+// @param plan_1, plan_2 : for convenience. Used by fftw (only when
+//        built with _BM3D_USE_FFTW);
+// @param nHW : size of the boundary around img;
+// @param kHW : size of patches (kHW x kHW);
+// @param i_r: current index of the reference patches;
+// @param step: space in pixels between two references patches;
+// @param coef_norm : normalization coefficients of the 2D DCT (only
+//        used with fftw);
+// @param i_min (resp. i_max) : minimum (resp. maximum) value
+//        for i_r. In this case the whole 2d transform is applied
+//        on every patches. Otherwise only the step new rows are
+//        processed and the other ones are re-used in place;
+// @param dct_mat : DCT-II matrix used by the native 2D DCT, see
+//        dct_2d_coef();
+// @param arena : scratch memory of the fftw buffers (only used with
+//        fftw), see fftw_batch_bytes().
+//
+void dct_2d_process(float * DCT_table_2D, const MirroredImage & img, fftwf_plan * plan_1, fftwf_plan * plan_2, const unsigned int nHW,
+	const unsigned int kHW, const unsigned int i_r, const unsigned int step, float * const coef_norm, const unsigned int i_min,
+	const unsigned int i_max, float * const dct_mat, ScratchArena & arena)
+{
+	// Declarations
+	const unsigned int width = img.width();
+	const unsigned int chnls = img.img.chnls;
+	const unsigned int kHW_2 = kHW * kHW;
+	float buf[DCT_MAX_SIZE * DCT_MAX_SIZE];
+	unsigned int stride;
+
+	// Rows of patches to process: all of them for the first and last
+	// references, otherwise only the step new rows which overwrite the
+	// oldest ones of the ring buffer
+	const bool all = (i_r == i_min || i_r == i_max);
+	const unsigned int nb_rows = (all ? 2 * nHW + 1 : step);
+	const unsigned int i_0 = (all ? i_r - nHW : i_r + nHW + 1 - step);
+#ifdef _BM3D_USE_FFTW
+	// Allocating Memory
+	const unsigned int nb = chnls * width * nb_rows;
+	const size_t mark = arena.mark();
+	float* vec = fftw_batch_alloc(arena, nb, kHW_2);
+	float* dct = fftw_batch_alloc(arena, nb, kHW_2);
+	if (!vec || !dct)
+		return;
+
+	for (unsigned int c = 0; c < chnls; c++)
+	{
+		const unsigned int dc_p = c * kHW_2 * width * nb_rows;
+		for (unsigned int i = 0; i < nb_rows; i++)
+			for (unsigned int j = 0; j < width - kHW; j++)
+			{
+				const float * patch = img.patch(c, i_0 + i, j, kHW, buf, stride);
+				for (unsigned int p = 0; p < kHW; p++)
+					for (unsigned int q = 0; q < kHW; q++)
+						vec[p * kHW + q + dc_p + (i * width + j) * kHW_2] = patch[p * stride + q];
+			}
+	}
+
+	// Process of all DCTs
+	fftw_batch_execute(all ? plan_1 : plan_2, vec, dct, nb, kHW_2);
+
+	// Getting the result
+	for (unsigned int c = 0; c < chnls; c++)
+	{
+		const unsigned int dc = c * kHW_2 * width * (2 * nHW + 1);
+		const unsigned int dc_p = c * kHW_2 * width * nb_rows;
+		for (unsigned int i = 0; i < nb_rows; i++)
 		{
-			bior_2d_inverse(group_3D_table, kWien, lpr, hpr, group_3D_table_size);
+			const unsigned int i_t = (i_0 + i) % (2 * nHW + 1);
+			for (unsigned int j = 0; j < width - kHW; j++)
+				for (unsigned int k = 0; k < kHW_2; k++)
+					DCT_table_2D[dc + (i_t * width + j) * kHW_2 + k] =
+					dct[dc_p + (i * width + j) * kHW_2 + k] * coef_norm[k];
 		}
-
-		// Registration of the weighted estimation
-		unsigned int dec = 0;
-		for (unsigned int ind_j = 0; ind_j < column_ind_size; ind_j++)
+	}
+	arena.rewind(mark);
+#else
+	for (unsigned int c = 0; c < chnls; c++)
+	{
+		const unsigned int dc_p = c * kHW_2 * width * (2 * nHW + 1);
+		for (unsigned int i = 0; i < nb_rows; i++)
 		{
-			const unsigned int j_r = column_ind[ind_j];
-			const unsigned int k_r = i_r * width + j_r;
-			const unsigned int nSx_r = patch_table_size[k_r];
-			for (unsigned int c = 0; c < chnls; c++)
+			const unsigned int i_t = (i_0 + i) % (2 * nHW + 1);
+			for (unsigned int j = 0; j < width - kHW; j++)
 			{
-				for (unsigned int n = 0; n < nSx_r; n++)
-				{
-					const unsigned int k = patch_table[k_r][n] + c * width * height;
-					for (unsigned int p = 0; p < kWien; p++)
-						for (unsigned int q = 0; q < kWien; q++)
-						{
-							const unsigned int ind = k + p * width + q;
-							numerator[ind] += kaiser_window[p * kWien + q]
-								* wx_r_table[c + ind_j * chnls]
-								* group_3D_table[p * kWien + q + n * kWien_2
-								+ c * kWien_2 * nSx_r + dec];
-							denominator[ind] += kaiser_window[p * kWien + q]
-								* wx_r_table[c + ind_j * chnls];
-						}
-				}
+				float * patch = img.patch(c, i_0 + i, j, kHW, buf, stride);
+				dct_2d_forward(patch, DCT_table_2D, kHW, 0, stride,
+					dc_p + (i_t * width + j) * kHW_2, dct_mat);
 			}
-			dec += nSx_r * chnls * kWien_2;
 		}
+	}
+#endif      // #ifdef _BM3D_USE_FFTW
+}
 
-		delete[] group_3D_table;
-		delete[] wx_r_table;
-
-		group_3D_table = NULL;
-		wx_r_table = NULL;
-
-	} // End of loop on i_r
-
-	delete[] table_2D_img;
-	delete[] table_2D_est;
-	delete[] hpr;
-	delete[] lpr;
-	delete[] hpd;
-	delete[] lpd;
-	delete[] coef_norm_inv;
-	delete[] coef_norm;
-	delete[] kaiser_window;
-	delete[] tmp;
-	delete[] sigma_table;
-
-	table_2D_img = NULL;
-	table_2D_est = NULL;
-	hpr = NULL;
-	lpr = NULL;
-	hpd = NULL;
-	lpd = NULL;
-	coef_norm_inv = NULL;
-	coef_norm = NULL;
-	kaiser_window = NULL;
-	tmp = NULL;
-	sigma_table = NULL;
+//
+// @brief Precompute a 2D bior1.5 transform on all patches contained in
+//        a part of the image.
+//
+// @param bior_table_2D : will contain the 2d bior1.5 transform for all
+//        chosen patches. The 2 * nHW + 1 rows of the table are used as
+//        a ring buffer, see table_2D_ind();
+// @param img : image on which the 2d transform will be processed, with
+//        its mirrored boundary of nHW pixels;
+// @param nHW : size of the boundary around img;
+// @param kHW : size of patches (kHW x kHW). MUST BE A POWER OF 2 !!!
+// @param i_r: current index of the reference patches;
+// @param step: space in pixels between two references patches;
+// @param i_min (resp. i_max) : minimum (resp. maximum) value
+//        for i_r. In this case the whole 2d transform is applied
+//        on every patches. Otherwise only the step new rows are
+//        processed and the other ones are re-used in place;
+// @param lpd : low pass filter of the forward bior1.5 2d transform;
+// @param hpd : high pass filter of the forward bior1.5 2d transform.
 
-	// Final reconstruction
-	for (unsigned int k = 0; k < width * height * chnls; k++)
+void bior_2d_process(float * bior_table_2D, const MirroredImage & img, const unsigned int nHW, const unsigned int kHW,
+	const unsigned int i_r, const unsigned int step, const unsigned int i_min, const unsigned int i_max, float * lpd, float * hpd)
+{
+	// Declarations
+	const unsigned int width = img.width();
+	const unsigned int chnls = img.img.chnls;
+	const unsigned int kHW_2 = kHW * kHW;
+	float buf[DCT_MAX_SIZE * DCT_MAX_SIZE];
+	unsigned int stride;
+
+	// If i_r == ns, then we have to process all Bior1.5 transforms,
+	// otherwise the new rows overwrite the oldest ones of the ring buffer
+	const bool all = (i_r == i_min || i_r == i_max);
+	const unsigned int nb_rows = (all ? 2 * nHW + 1 : step);
+	const unsigned int i_0 = (all ? i_r - nHW : i_r + nHW + 1 - step);
+	for (unsigned int c = 0; c < chnls; c++)
 	{
-		img_denoised[k] = numerator[k] / denominator[k];
-		if (denominator[k] == 0.0)
+		const unsigned int dc_p = c * kHW_2 * width * (2 * nHW + 1);
+		for (unsigned int i = 0; i < nb_rows; i++)
 		{
-			img_denoised[k] = img_noisy[k];
+			const unsigned int i_t = (i_0 + i) % (2 * nHW + 1);
+			for (unsigned int j = 0; j < width - kHW; j++)
+			{
+				float * patch = img.patch(c, i_0 + i, j, kHW, buf, stride);
+				bior_2d_forward(patch, bior_table_2D, kHW, 0, stride,
+					dc_p + (i_t * width + j) * kHW_2, lpd, hpd);
+			}
 		}
 	}
-	delete[] numerator;
-	delete[] denominator;
-
-	numerator = NULL;
-	denominator = NULL;
-
-    IplImage * iplImage_denoised = transfer_buffer2iplImage(img_denoised, width, height, chnls, false);
-    return iplImage_denoised;
 }
 
 //
-// @brief Precompute a 2D DCT transform on all patches contained in
-//        a part of the image.
+// @brief Precompute the 2D transform (DCT or Bior1.5) of every patch
+//        of the image and store it in half precision. The table is
+//        only read afterwards, so the 3D groups can be built in any
+//        order and from any thread, without re-processing the patches
+//        shared by several bands of the image.
 //
-// @param DCT_table_2D : will contain the 2d DCT transform for all
-//        chosen patches;
-// @param img : image on which the 2d DCT will be processed;
-// @param plan_1, plan_2 : for convenience. Used by fftw;
-// @param nHW : size of the boundary around img;
-// @param width, height, chnls: size of img;
+// @param spectrum_2D : will contain the 2D transform of the patch
+//        whose top-left pixel is k, for the channel c, at the index
+//        (k + c * width * height) * kHW * kHW, width and height being
+//        the size of img with its boundary. The index is computed in
+//        size_t, the cache being larger than 4G values from a few tens
+//        of megapixels;
+// @param img : image on which the 2d transform will be processed, with
+//        its mirrored boundary;
 // @param kHW : size of patches (kHW x kHW);
-// @param i_r: current index of the reference patches;
-// @param step: space in pixels between two references patches;
-// @param coef_norm : normalization coefficients of the 2D DCT;
-// @param i_min (resp. i_max) : minimum (resp. maximum) value
-//        for i_r. In this case the whole 2d transform is applied
-//        on every patches. Otherwise the precomputed 2d DCT is re-used
-//        without processing it.
+// @param tau_2D : DCT or BIOR;
+// @param dct_mat : DCT-II matrix used by the 2D DCT, see dct_2d_coef();
+// @param lpd : low pass filter of the forward bior1.5 2d transform;
+// @param hpd : high pass filter of the forward bior1.5 2d transform.
 //
-void dct_2d_process(float * DCT_table_2D, float * const img, fftwf_plan * plan_1, fftwf_plan * plan_2, const unsigned int nHW,
-	const unsigned int width, const unsigned int height, const unsigned int chnls, const unsigned int kHW, const unsigned int i_r,
-	const unsigned int step, float * const coef_norm, const unsigned int i_min, const unsigned int i_max)
+void spectrum_2d_process(unsigned short * spectrum_2D, const MirroredImage & img, const unsigned int kHW,
+	const unsigned int tau_2D, float * const dct_mat, float * lpd, float * hpd)
 {
 	// Declarations
+	const unsigned int width = img.width();
+	const unsigned int height = img.height();
 	const unsigned int kHW_2 = kHW * kHW;
-	const unsigned int size = chnls * kHW_2 * width * (2 * nHW + 1);
+	float vec[DCT_MAX_SIZE * DCT_MAX_SIZE];
+	float buf[DCT_MAX_SIZE * DCT_MAX_SIZE];
+	unsigned int stride;
 
-	// If i_r == ns, then we have to process all DCT
-	if (i_r == i_min || i_r == i_max)
+	for (unsigned int c = 0; c < img.img.chnls; c++)
 	{
-		// Allocating Memory
-		float* vec = (float*)fftwf_malloc(size * sizeof(float));
-		float* dct = (float*)fftwf_malloc(size * sizeof(float));
-
-		for (unsigned int c = 0; c < chnls; c++)
-		{
-			const unsigned int dc = c * width * height;
-			const unsigned int dc_p = c * kHW_2 * width * (2 * nHW + 1);
-			for (unsigned int i = 0; i < 2 * nHW + 1; i++)
-				for (unsigned int j = 0; j < width - kHW; j++)
-					for (unsigned int p = 0; p < kHW; p++)
-						for (unsigned int q = 0; q < kHW; q++)
-							vec[p * kHW + q + dc_p + (i * width + j) * kHW_2] =
-							img[dc + (i_r + i - nHW + p) * width + j + q];
-		}
+		const size_t dc = c * (size_t)width * height;
+		for (unsigned int i = 0; i <= height - kHW; i++)
+			for (unsigned int j = 0; j <= width - kHW; j++)
+			{
+				const size_t k = dc + (size_t)i * width + j;
+				float * patch = img.patch(c, i, j, kHW, buf, stride);
+				if (tau_2D == DCT)
+					dct_2d_forward(patch, vec, kHW, 0, stride, 0, dct_mat);
+				else
+					bior_2d_forward(patch, vec, kHW, 0, stride, 0, lpd, hpd);
+
+				unsigned short * spectrum = spectrum_2D + k * kHW_2;
+				for (unsigned int p = 0; p < kHW_2; p++)
+					spectrum[p] = float_to_half(vec[p]);
+			}
+	}
+}
 
-		// Process of all DCTs
-		fftwf_execute_r2r(*plan_1, vec, dct);
-		fftwf_free(vec);
+//
+// @brief Hard thresholding of a set of coefficients. Coefficients
+//        whose magnitude is not above T are set to zero, the other
+//        ones are multiplied by coef.
+//
+// @param vec : coefficients to threshold (in place);
+// @param N : number of coefficients;
+// @param T : value of thresholding;
+// @param coef : scaling applied to the kept coefficients.
+//
+// @return the number of kept coefficients.
+//
+unsigned int ht_threshold_scale(float * vec, const unsigned int N, const float T, const float coef)
+{
+	// Kernel of the instruction set selected at run time
+	const simd_kernels & kernels = simd_kernels_get();
+	if (kernels.ht_threshold_scale)
+		return kernels.ht_threshold_scale(vec, N, T, coef);
 
-		// Getting the result
-		for (unsigned int c = 0; c < chnls; c++)
-		{
-			const unsigned int dc = c * kHW_2 * width * (2 * nHW + 1);
-			const unsigned int dc_p = c * kHW_2 * width * (2 * nHW + 1);
-			for (unsigned int i = 0; i < 2 * nHW + 1; i++)
-				for (unsigned int j = 0; j < width - kHW; j++)
-					for (unsigned int k = 0; k < kHW_2; k++)
-						DCT_table_2D[dc + (i * width + j) * kHW_2 + k] =
-						dct[dc_p + (i * width + j) * kHW_2 + k] * coef_norm[k];
-		}
-		fftwf_free(dct);
-	}
-	else
+	unsigned int nb = 0;
+	for (unsigned int k = 0; k < N; k++)
 	{
-		const unsigned int ds = step * width * kHW_2;
+		const bool keep = fabs(vec[k]) > T;
+		vec[k] = (keep ? vec[k] * coef : 0.0f);
+		nb += keep;
+	}
 
-		// Re-use of DCT already processed
-		for (unsigned int c = 0; c < chnls; c++)
-		{
-			unsigned int dc = c * width * (2 * nHW + 1) * kHW_2;
-			for (unsigned int i = 0; i < 2 * nHW + 1 - step; i++)
-				for (unsigned int j = 0; j < width - kHW; j++)
-					for (unsigned int k = 0; k < kHW_2; k++)
-						DCT_table_2D[k + (i * width + j) * kHW_2 + dc] =
-						DCT_table_2D[k + (i * width + j) * kHW_2 + dc + ds];
-		}
+	return nb;
+}
 
-		// Compute the new DCT
-		float* vec = (float*)fftwf_malloc(chnls * kHW_2 * step * width * sizeof(float));
-		float* dct = (float*)fftwf_malloc(chnls * kHW_2 * step * width * sizeof(float));
+//
+// @brief Welsh-Hadamard inverse transform of one channel of a 3D group
+//        after hard thresholding, stored patch by patch (nSx_r rows of
+//        kHW_2 coefficients). The columns (i.e. one coefficient of
+//        every patch) are classified in mask:
+//        - COLUMN_ZERO: the whole column is 0, so is its transform;
+//        - COLUMN_DC: only the 3D-DC term is not 0, the transform is
+//          this term broadcast to the whole column;
+//        - COLUMN_FULL: the transform has to be processed.
+//        Without any COLUMN_FULL column the group is obtained by copying
+//        the first patch. With a few of them, only these columns are
+//        transformed.
+//
+// @param group : one channel of the 3D group (in place);
+// @param tmp : allocated vector of size nSx_r * kHW_2;
+// @param nSx_r : number of patches (power of 2);
+// @param kHW_2 : number of coefficients per patch;
+// @param mask : will contain the class of each column.
+//
+// @return true if the inverse transform has been done, false if the
+//         full transform has to be processed by the caller.
+//
+bool hadamard_inverse_sparse(float * group, float * tmp, const unsigned int nSx_r, const unsigned int kHW_2,
+	unsigned char * mask)
+{
+	// Classification of the columns
+	for (unsigned int k = 0; k < kHW_2; k++)
+		mask[k] = (group[k] != 0.0f ? COLUMN_DC : COLUMN_ZERO);
+	for (unsigned int n = 1; n < nSx_r; n++)
+	{
+		const float * row = group + n * kHW_2;
+		for (unsigned int k = 0; k < kHW_2; k++)
+			if (row[k] != 0.0f)
+				mask[k] = COLUMN_FULL;
+	}
+	unsigned int nb_full = 0;
+	for (unsigned int k = 0; k < kHW_2; k++)
+		nb_full += (mask[k] == COLUMN_FULL);
 
-		for (unsigned int c = 0; c < chnls; c++)
-		{
-			const unsigned int dc = c * width * height;
-			const unsigned int dc_p = c * kHW_2 * width * step;
-			for (unsigned int i = 0; i < step; i++)
-				for (unsigned int j = 0; j < width - kHW; j++)
-					for (unsigned int p = 0; p < kHW; p++)
-						for (unsigned int q = 0; q < kHW; q++)
-							vec[p * kHW + q + dc_p + (i * width + j) * kHW_2] =
-							img[(p + i + 2 * nHW + 1 - step + i_r - nHW)
-							* width + j + q + dc];
-		}
+	// Only zero and DC columns: every patch is equal to the first one
+	if (nb_full == 0)
+	{
+		for (unsigned int n = 1; n < nSx_r; n++)
+			for (unsigned int k = 0; k < kHW_2; k++)
+				group[k + n * kHW_2] = group[k];
+		return true;
+	}
 
-		// Process of all DCTs
-		fftwf_execute_r2r(*plan_2, vec, dct);
-		fftwf_free(vec);
+	// Too many columns to transform: gathering them does not pay off
+	if (2 * nb_full > kHW_2)
+		return false;
 
-		// Getting the result
-		for (unsigned int c = 0; c < chnls; c++)
-		{
-			const unsigned int dc = c * kHW_2 * width * (2 * nHW + 1);
-			const unsigned int dc_p = c * kHW_2 * width * step;
-			for (unsigned int i = 0; i < step; i++)
-				for (unsigned int j = 0; j < width - kHW; j++)
-					for (unsigned int k = 0; k < kHW_2; k++)
-						DCT_table_2D[dc + ((i + 2 * nHW + 1 - step) * width + j) * kHW_2 + k] =
-						dct[dc_p + (i * width + j) * kHW_2 + k] * coef_norm[k];
-		}
-		fftwf_free(dct);
+	// Transform of the packed COLUMN_FULL columns
+	float * packed = tmp;
+	float * packed_tmp = tmp + nSx_r * nb_full;
+	for (unsigned int n = 0; n < nSx_r; n++)
+	{
+		const float * row = group + n * kHW_2;
+		for (unsigned int k = 0, i = 0; k < kHW_2; k++)
+			if (mask[k] == COLUMN_FULL)
+				packed[i++ + n * nb_full] = row[k];
+	}
+	hadamard_transform_rows(packed, packed_tmp, nSx_r, nb_full);
+	for (unsigned int n = 0; n < nSx_r; n++)
+	{
+		float * row = group + n * kHW_2;
+		for (unsigned int k = 0, i = 0; k < kHW_2; k++)
+			if (mask[k] == COLUMN_FULL)
+				row[k] = packed[i++ + n * nb_full];
+			else if (mask[k] == COLUMN_DC && n > 0)
+				row[k] = group[k];
 	}
+
+	return true;
 }
 
 //
-// @brief Precompute a 2D bior1.5 transform on all patches contained in
-//        a part of the image.
+// @brief Specialised version of ht_filtering_hadamard() for a patch
+//        size kHW, a number of similar patches N and a number of
+//        channels chnls known at compile time, which lets the compiler
+//        unroll the fixed-size loops. The result is the same as the
+//        generic version.
 //
-// @param bior_table_2D : will contain the 2d bior1.5 transform for all
-//        chosen patches;
-// @param img : image on which the 2d transform will be processed;
-// @param nHW : size of the boundary around img;
-// @param width, height, chnls: size of img;
-// @param kHW : size of patches (kHW x kHW). MUST BE A POWER OF 2 !!!
-// @param i_r: current index of the reference patches;
-// @param step: space in pixels between two references patches;
-// @param i_min (resp. i_max) : minimum (resp. maximum) value
-//        for i_r. In this case the whole 2d transform is applied
-//        on every patches. Otherwise the precomputed 2d DCT is re-used
-//        without processing it;
-// @param lpd : low pass filter of the forward bior1.5 2d transform;
-// @param hpd : high pass filter of the forward bior1.5 2d transform.
-
-void bior_2d_process(float * bior_table_2D, float * const img, const unsigned int nHW, const unsigned int width, const unsigned int height,
-	const unsigned int chnls, const unsigned int kHW, const unsigned int i_r, const unsigned int step, const unsigned int i_min,
-	const unsigned int i_max, float * lpd, float * hpd)
+template <unsigned kHW, unsigned N, unsigned chnls>
+void ht_filtering_hadamard_N(float * group_3D, float * tmp, float * const sigma_table, const float lambdaHard3D,
+	float * weight_table, const bool doWeight, unsigned char * mask)
 {
 	// Declarations
 	const unsigned int kHW_2 = kHW * kHW;
+	const float coef_norm = sqrtf((float)N);
+	const float coef = 1.0f / (float)N;
 
-	// If i_r == ns, then we have to process all Bior1.5 transforms
-	if (i_r == i_min || i_r == i_max)
+	// Process the Welsh-Hadamard transform on the 3rd dimension
+	for (unsigned int c = 0; c < chnls; c++)
+		hadamard_transform_rows_N<N>(group_3D + c * N * kHW_2, tmp, kHW_2);
+
+	// Hard Thresholding, counting of the non-zero coefficients and
+	// normalization of the inverse Hadamard transform
+	for (unsigned int c = 0; c < chnls; c++)
 	{
-		for (unsigned int c = 0; c < chnls; c++)
-		{
-			const unsigned int dc = c * width * height;
-			const unsigned int dc_p = c * kHW_2 * width * (2 * nHW + 1);
-			for (unsigned int i = 0; i < 2 * nHW + 1; i++)
-				for (unsigned int j = 0; j < width - kHW; j++)
-				{
-					bior_2d_forward(img, bior_table_2D, kHW, dc +
-						(i_r + i - nHW) * width + j, width,
-						dc_p + (i * width + j) * kHW_2, lpd, hpd);
-				}
-		}
+		const float T = lambdaHard3D * sigma_table[c] * coef_norm;
+		weight_table[c] = (float)ht_threshold_scale(group_3D + c * N * kHW_2, kHW_2 * N, T, coef);
 	}
-	else
+
+	// Process of the Welsh-Hadamard inverse transform, on the non-zero
+	// columns only when the column mask is requested
+	for (unsigned int c = 0; c < chnls; c++)
 	{
-		const unsigned int ds = step * width * kHW_2;
+		float * group = group_3D + c * N * kHW_2;
+		if (mask && hadamard_inverse_sparse(group, tmp, N, kHW_2, mask + c * kHW_2))
+			continue;
+		hadamard_transform_rows_N<N>(group, tmp, kHW_2);
+	}
 
-		// Re-use of Bior1.5 already processed
+	// Weight for aggregation
+	if (doWeight)
 		for (unsigned int c = 0; c < chnls; c++)
-		{
-			unsigned int dc = c * width * (2 * nHW + 1) * kHW_2;
-			for (unsigned int i = 0; i < 2 * nHW + 1 - step; i++)
-				for (unsigned int j = 0; j < width - kHW; j++)
-					for (unsigned int k = 0; k < kHW_2; k++)
-						bior_table_2D[k + (i * width + j) * kHW_2 + dc] =
-						bior_table_2D[k + (i * width + j) * kHW_2 + dc + ds];
-		}
+			weight_table[c] = (weight_table[c] > 0.0f ? 1.0f / (float)
+			(sigma_table[c] * sigma_table[c] * weight_table[c]) : 1.0f);
+}
 
-		// Compute the new Bior
-		for (unsigned int c = 0; c < chnls; c++)
-		{
-			const unsigned int dc = c * width * height;
-			const unsigned int dc_p = c * kHW_2 * width * (2 * nHW + 1);
-			for (unsigned int i = 0; i < step; i++)
-				for (unsigned int j = 0; j < width - kHW; j++)
-				{
-					bior_2d_forward(img, bior_table_2D, kHW, dc +
-						(i + 2 * nHW + 1 - step + i_r - nHW) * width + j,
-						width, dc_p + ((i + 2 * nHW + 1 - step)
-						* width + j) * kHW_2, lpd, hpd);
-				}
-		}
+//
+// @brief Specialised version of wiener_filtering_hadamard(), see
+//        ht_filtering_hadamard_N().
+//
+template <unsigned kHW, unsigned N, unsigned chnls>
+void wiener_filtering_hadamard_N(float * group_3D_img, float * group_3D_est, float * tmp, float * const sigma_table,
+	float * weight_table, const bool doWeight)
+{
+	// Declarations
+	const unsigned int kHW_2 = kHW * kHW;
+	const float coef = 1.0f / (float)N;
+
+	// Process the Welsh-Hadamard transform on the 3rd dimension, on both
+	// groups in the same pass
+	for (unsigned int c = 0; c < chnls; c++)
+		hadamard_transform_rows_2_N<N>(group_3D_img + c * N * kHW_2, group_3D_est + c * N * kHW_2, tmp, kHW_2);
+
+	// Wiener Filtering
+	for (unsigned int c = 0; c < chnls; c++)
+	{
+		const unsigned int dc = c * N * kHW_2;
+		weight_table[c] = wiener_shrink(group_3D_img + dc, group_3D_est + dc, kHW_2 * N,
+			sigma_table[c] * sigma_table[c], coef);
 	}
+
+	// Process of the Welsh-Hadamard inverse transform
+	for (unsigned int c = 0; c < chnls; c++)
+		hadamard_transform_rows_N<N>(group_3D_est + c * N * kHW_2, tmp, kHW_2);
+
+	// Weight for aggregation
+	if (doWeight)
+		for (unsigned int c = 0; c < chnls; c++)
+			weight_table[c] = (weight_table[c] > 0.0f ? 1.0f / (float)
+			(sigma_table[c] * sigma_table[c] * weight_table[c]) : 1.0f);
+}
+
+typedef void (*ht_kernel)(float *, float *, float * const, const float, float *, const bool, unsigned char *);
+typedef void (*wiener_kernel)(float *, float *, float *, float * const, float *, const bool);
+
+//
+// @brief Dispatch tables of the specialised kernels for a patch size
+//        kHW and chnls channels, indexed by log2 of the number of
+//        similar patches (1 to 32).
+//
+template <unsigned kHW, unsigned chnls>
+struct bm3d_kernels
+{
+	static const ht_kernel ht[6];
+	static const wiener_kernel wiener[6];
+};
+
+template <unsigned kHW, unsigned chnls>
+const ht_kernel bm3d_kernels<kHW, chnls>::ht[6] =
+{
+	&ht_filtering_hadamard_N<kHW, 1, chnls>, &ht_filtering_hadamard_N<kHW, 2, chnls>,
+	&ht_filtering_hadamard_N<kHW, 4, chnls>, &ht_filtering_hadamard_N<kHW, 8, chnls>,
+	&ht_filtering_hadamard_N<kHW, 16, chnls>, &ht_filtering_hadamard_N<kHW, 32, chnls>
+};
+
+template <unsigned kHW, unsigned chnls>
+const wiener_kernel bm3d_kernels<kHW, chnls>::wiener[6] =
+{
+	&wiener_filtering_hadamard_N<kHW, 1, chnls>, &wiener_filtering_hadamard_N<kHW, 2, chnls>,
+	&wiener_filtering_hadamard_N<kHW, 4, chnls>, &wiener_filtering_hadamard_N<kHW, 8, chnls>,
+	&wiener_filtering_hadamard_N<kHW, 16, chnls>, &wiener_filtering_hadamard_N<kHW, 32, chnls>
+};
+
+//
+// @brief Look for a specialised hard thresholding kernel. Patch sizes
+//        4, 8 and 12 with 1 or 3 channels and up to 32 similar patches
+//        are instantiated.
+//
+// @return the kernel, or NULL if the geometry is not supported.
+//
+ht_kernel ht_kernel_select(const unsigned int kHW, const unsigned int nSx_r, const unsigned int chnls)
+{
+	if (nSx_r > 32 || !power_of_2(nSx_r))
+		return NULL;
+	const unsigned int n = ind_log2(nSx_r);
+
+	if (chnls == 1)
+		return (kHW == 4 ? bm3d_kernels<4, 1>::ht[n] :
+			(kHW == 8 ? bm3d_kernels<8, 1>::ht[n] :
+			(kHW == 12 ? bm3d_kernels<12, 1>::ht[n] : NULL)));
+	if (chnls == 3)
+		return (kHW == 4 ? bm3d_kernels<4, 3>::ht[n] :
+			(kHW == 8 ? bm3d_kernels<8, 3>::ht[n] :
+			(kHW == 12 ? bm3d_kernels<12, 3>::ht[n] : NULL)));
+	return NULL;
+}
+
+//
+// @brief Look for a specialised Wiener filtering kernel, see
+//        ht_kernel_select().
+//
+wiener_kernel wiener_kernel_select(const unsigned int kHW, const unsigned int nSx_r, const unsigned int chnls)
+{
+	if (nSx_r > 32 || !power_of_2(nSx_r))
+		return NULL;
+	const unsigned int n = ind_log2(nSx_r);
+
+	if (chnls == 1)
+		return (kHW == 4 ? bm3d_kernels<4, 1>::wiener[n] :
+			(kHW == 8 ? bm3d_kernels<8, 1>::wiener[n] :
+			(kHW == 12 ? bm3d_kernels<12, 1>::wiener[n] : NULL)));
+	if (chnls == 3)
+		return (kHW == 4 ? bm3d_kernels<4, 3>::wiener[n] :
+			(kHW == 8 ? bm3d_kernels<8, 3>::wiener[n] :
+			(kHW == 12 ? bm3d_kernels<12, 3>::wiener[n] : NULL)));
+	return NULL;
 }
 
 //
 // @brief HT filtering using Welsh-Hadamard transform (do only third
 //        dimension transform, Hard Thresholding and inverse transform).
 //
-// @param group_3D : contains the 3D block for a reference patch;
-// @param tmp: allocated vector used in Hadamard transform for convenience;
+// @param group_3D : contains the 3D block for a reference patch, stored
+//        patch by patch: group_3D[k + n * kHW^2 + c * nSx_r * kHW^2];
+// @param tmp: allocated vector of size nSx_r * kHW^2 used in Hadamard
+//        transform for convenience;
 // @param nSx_r : number of similar patches to a reference one;
 // @param kHW : size of patches (kHW x kHW);
 // @param chnls : number of channels of the image;
@@ -1313,47 +2651,53 @@ void bior_2d_process(float * bior_table_2D, float * const img, const unsigned in
 // @param lambdaHard3D : value of thresholding;
 // @param weight_table: the weighting of this 3D group for each channel;
 // @param doWeight: if true process the weighting, do nothing
-//        otherwise.
+//        otherwise;
+// @param mask: if not NULL, will contain the column mask of each
+//        channel (chnls * kHW^2 values, see hadamard_inverse_sparse()),
+//        and the inverse transform is skipped on the zero columns.
 //
 // @return none.
 //
 void ht_filtering_hadamard(float * group_3D, float * tmp, const unsigned int nSx_r, const unsigned int kHard, const unsigned int chnls,
-	float * const sigma_table, const float lambdaHard3D, float * weight_table, const bool doWeight)
+	float * const sigma_table, const float lambdaHard3D, float * weight_table, const bool doWeight, unsigned char * mask)
 {
+	// Specialised kernel for the usual geometries
+	const ht_kernel kernel = ht_kernel_select(kHard, nSx_r, chnls);
+	if (kernel)
+	{
+		kernel(group_3D, tmp, sigma_table, lambdaHard3D, weight_table, doWeight, mask);
+		return;
+	}
+
 	// Declarations
 	const unsigned int kHard_2 = kHard * kHard;
-	for (unsigned int c = 0; c < chnls; c++)
-		weight_table[c] = 0.0f;
 	const float coef_norm = sqrtf((float)nSx_r);
 	const float coef = 1.0f / (float)nSx_r;
 
 	// Process the Welsh-Hadamard transform on the 3rd dimension
-	for (unsigned int n = 0; n < kHard_2 * chnls; n++)
-		hadamard_transform(group_3D, tmp, nSx_r, n * nSx_r);
+	for (unsigned int c = 0; c < chnls; c++)
+		hadamard_transform_rows(group_3D + c * nSx_r * kHard_2, tmp, nSx_r, kHard_2);
 
-	// Hard Thresholding
+	// Hard Thresholding, counting of the non-zero coefficients and
+	// normalization of the inverse Hadamard transform in a single pass.
+	// Since nSx_r is a power of 2, scaling by coef before the inverse
+	// transform gives exactly the same result as scaling after it.
 	for (unsigned int c = 0; c < chnls; c++)
 	{
 		const unsigned int dc = c * nSx_r * kHard_2;
 		const float T = lambdaHard3D * sigma_table[c] * coef_norm;
-		for (unsigned int k = 0; k < kHard_2 * nSx_r; k++)
-		{
-			if (fabs(group_3D[k + dc]) > T)
-				weight_table[c]++;
-			else
-				group_3D[k + dc] = 0.0f;
-		}
+		weight_table[c] = (float)ht_threshold_scale(group_3D + dc, kHard_2 * nSx_r, T, coef);
 	}
 
-	// Process of the Welsh-Hadamard inverse transform
-	for (unsigned int n = 0; n < kHard_2 * chnls; n++)
-		hadamard_transform(group_3D, tmp, nSx_r, n * nSx_r);
-
-	/// Recoding group_3D.size() = chnls * nSx_r * kHard * kHard; 
-	//for (unsigned int k = 0; k < group_3D.size(); k++)
-	unsigned int group_3D_size = chnls * nSx_r * kHard * kHard;
-	for (unsigned int k = 0; k < group_3D_size; k++)
-		group_3D[k] *= coef;
+	// Process of the Welsh-Hadamard inverse transform, on the non-zero
+	// columns only when the column mask is requested
+	for (unsigned int c = 0; c < chnls; c++)
+	{
+		float * group = group_3D + c * nSx_r * kHard_2;
+		if (mask && hadamard_inverse_sparse(group, tmp, nSx_r, kHard_2, mask + c * kHard_2))
+			continue;
+		hadamard_transform_rows(group, tmp, nSx_r, kHard_2);
+	}
 
 	// Weight for aggregation
 	if (doWeight)
@@ -1362,12 +2706,45 @@ void ht_filtering_hadamard(float * group_3D, float * tmp, const unsigned int nSx
 			(sigma_table[c] * sigma_table[c] * weight_table[c]) : 1.0f);
 }
 
+//
+// @brief Wiener shrinkage of a set of coefficients of the noisy group,
+//        driven by the coefficients of the basic estimate group.
+//
+// @param img : coefficients of the noisy group;
+// @param est : coefficients of the basic estimate group. Will contain
+//        the shrunk coefficients of img at the end;
+// @param N : number of coefficients;
+// @param sigma_2 : variance of the noise;
+// @param coef : normalization coefficient of the Hadamard transform.
+//
+// @return the sum of the Wiener coefficients.
+//
+float wiener_shrink(float * const img, float * est, const unsigned int N, const float sigma_2, const float coef)
+{
+	// Kernel of the instruction set selected at run time
+	const simd_kernels & kernels = simd_kernels_get();
+	if (kernels.wiener_shrink)
+		return kernels.wiener_shrink(img, est, N, sigma_2, coef);
+
+	float weight = 0.0f;
+	for (unsigned int k = 0; k < N; k++)
+	{
+		float value = est[k] * est[k] * coef;
+		value /= (value + sigma_2);
+		est[k] = img[k] * value * coef;
+		weight += value;
+	}
+
+	return weight;
+}
+
 //
 // @brief Wiener filtering using Hadamard transform.
 //
 // @param group_3D_img : contains the 3D block built on img_noisy;
 // @param group_3D_est : contains the 3D block built on img_basic;
-// @param tmp: allocated vector used in hadamard transform for convenience;
+// @param tmp: allocated vector of size nSx_r * kWien^2 used in hadamard
+//        transform for convenience;
 // @param nSx_r : number of similar patches to a reference one;
 // @param kWien : size of patches (kWien x kWien);
 // @param chnls : number of channels of the image;
@@ -1381,36 +2758,37 @@ void ht_filtering_hadamard(float * group_3D, float * tmp, const unsigned int nSx
 void wiener_filtering_hadamard(float * group_3D_img, float * group_3D_est, float * tmp, const unsigned int nSx_r, const unsigned int kWien,
 	const unsigned int chnls, float * const sigma_table, float * weight_table, const bool doWeight)
 {
+	// Specialised kernel for the usual geometries
+	const wiener_kernel kernel = wiener_kernel_select(kWien, nSx_r, chnls);
+	if (kernel)
+	{
+		kernel(group_3D_img, group_3D_est, tmp, sigma_table, weight_table, doWeight);
+		return;
+	}
+
 	// Declarations
 	const unsigned int kWien_2 = kWien * kWien;
 	const float coef = 1.0f / (float)nSx_r;
 
+	// Process the Welsh-Hadamard transform on the 3rd dimension, on both
+	// groups in the same pass
 	for (unsigned int c = 0; c < chnls; c++)
-		weight_table[c] = 0.0f;
-
-	// Process the Welsh-Hadamard transform on the 3rd dimension
-	for (unsigned int n = 0; n < kWien_2 * chnls; n++)
 	{
-		hadamard_transform(group_3D_img, tmp, nSx_r, n * nSx_r);
-		hadamard_transform(group_3D_est, tmp, nSx_r, n * nSx_r);
+		const unsigned int dc = c * nSx_r * kWien_2;
+		hadamard_transform_rows_2(group_3D_img + dc, group_3D_est + dc, tmp, nSx_r, kWien_2);
 	}
 
 	// Wiener Filtering
 	for (unsigned int c = 0; c < chnls; c++)
 	{
 		const unsigned int dc = c * nSx_r * kWien_2;
-		for (unsigned int k = 0; k < kWien_2 * nSx_r; k++)
-		{
-			float value = group_3D_est[dc + k] * group_3D_est[dc + k] * coef;
-			value /= (value + sigma_table[c] * sigma_table[c]);
-			group_3D_est[k + dc] = group_3D_img[k + dc] * value * coef;
-			weight_table[c] += value;
-		}
+		weight_table[c] = wiener_shrink(group_3D_img + dc, group_3D_est + dc, kWien_2 * nSx_r,
+			sigma_table[c] * sigma_table[c], coef);
 	}
 
 	// Process of the Welsh-Hadamard inverse transform
-	for (unsigned int n = 0; n < kWien_2 * chnls; n++)
-		hadamard_transform(group_3D_est, tmp, nSx_r, n * nSx_r);
+	for (unsigned int c = 0; c < chnls; c++)
+		hadamard_transform_rows(group_3D_est + c * nSx_r * kWien_2, tmp, nSx_r, kWien_2);
 
 	// Weight for aggregation
 	if (doWeight)
@@ -1424,22 +2802,38 @@ void wiener_filtering_hadamard(float * group_3D_img, float * group_3D_est, float
 //
 // @param group_3D_table: contains a huge number of patches;
 // @param kHW : size of patch;
-// @param coef_norm_inv: contains normalization coefficients;
-// @param plan : for convenience. Used by fftw.
+// @param plan : inverse plan of exactly group_3D_table_size / kHW^2
+//        patches, see StepWorkspace::plan_inverse (only used with fftw);
+// @param coef_norm_inv: contains normalization coefficients (only used
+//        with fftw);
+// @param dct_mat : DCT-II matrix used by the native 2D DCT, see
+//        dct_2d_coef();
+// @param patch_state : if not NULL, state of each patch (PATCH_COMPUTE,
+//        PATCH_ZERO or PATCH_COPY). Null patches are skipped and copies
+//        are taken from the previous patch. Not used with fftw, which
+//        transforms the patches by batches;
+// @param arena : scratch memory of the fftw buffers (only used with
+//        fftw).
 //
 // @return none.
 //
-void dct_2d_inverse(float * group_3D_table, const unsigned int kHW, const unsigned int N, const unsigned int group_3D_table_size,
-	float * const coef_norm_inv, fftwf_plan * plan)
+void dct_2d_inverse(float * group_3D_table, const unsigned int kHW, const unsigned int group_3D_table_size,
+	fftwf_plan plan, float * const coef_norm_inv, float * const dct_mat, const unsigned char * patch_state, ScratchArena & arena)
 {
 	// Declarations
 	const unsigned int kHW_2 = kHW * kHW;
-	const unsigned int size = kHW_2 * N;
 	const unsigned int Ns = group_3D_table_size / kHW_2;
 
-	// Allocate Memory
-	float* vec = (float*)fftwf_malloc(size * sizeof(float));
-	float* dct = (float*)fftwf_malloc(size * sizeof(float));
+#ifdef _BM3D_USE_FFTW
+	// Scratch memory
+	const size_t mark = arena.mark();
+	float* vec = arena.alloc<float>(group_3D_table_size);
+	float* dct = arena.alloc<float>(group_3D_table_size);
+	if (!vec || !dct)
+	{
+		CImageUtility::showErrMsg("Fail to allocate buffer in dct_2d_inverse!\n");
+		return;
+	}
 
 	// Normalization
 	for (unsigned int n = 0; n < Ns; n++)
@@ -1447,24 +2841,145 @@ void dct_2d_inverse(float * group_3D_table, const unsigned int kHW, const unsign
 			dct[k + n * kHW_2] = group_3D_table[k + n * kHW_2] * coef_norm_inv[k];
 
 	// 2D dct inverse
-	fftwf_execute_r2r(*plan, dct, vec);
-	fftwf_free(dct);
+	fftwf_execute_r2r(plan, dct, vec);
 
 	// Getting the result + normalization
 	const float coef = 1.0f / (float)(kHW * 2);
 	for (unsigned int k = 0; k < group_3D_table_size; k++)
 		group_3D_table[k] = coef * vec[k];
 
-	// Free Memory
-	fftwf_free(vec);
+	arena.rewind(mark);
+#else
+	// In place 2D dct inverse of every patch, normalization included
+	for (unsigned int n = 0; n < Ns; n++)
+	{
+		if (patch_state && patch_state[n] != PATCH_COMPUTE)
+		{
+			if (patch_state[n] == PATCH_COPY)
+				for (unsigned int k = 0; k < kHW_2; k++)
+					group_3D_table[k + n * kHW_2] = group_3D_table[k + (n - 1) * kHW_2];
+			continue;
+		}
+		dct_2d_inverse(group_3D_table, kHW, n * kHW_2, dct_mat);
+	}
+#endif      // #ifdef _BM3D_USE_FFTW
+}
+
+//
+// @brief Aggregation of a 3D group, once inverse transformed, in the
+//        numerator and denominator of the estimate. The accumulators
+//        only cover the image: the pixels of the patches which are in
+//        its boundary are dropped. The Kaiser window weighted by the
+//        group is computed once per channel, then each row of a patch
+//        is added to the interleaved accumulators in one pass.
+//
+// @param accumulator : numerator and denominator of each pixel of the
+//        estimate, interleaved;
+// @param group_3D : the 3D group, patch by patch (see group_3D_gather());
+// @param patches : indexes of the patches of the group in the image with
+//        its boundary;
+// @param nSx_r : number of patches;
+// @param width, height, chnls : size of the image, without its boundary;
+// @param nHW : size of the boundary;
+// @param kHW : size of patches;
+// @param kaiser_window : Kaiser window of size kHW x kHW;
+// @param weight_table : weight of the group for each channel;
+// @param kaiser_weighted : buffer of kHW x kHW values, will contain the
+//        Kaiser window weighted by the group for the last channel.
+//
+// @return none.
+//
+void group_aggregate(float * accumulator, float * const group_3D, unsigned int * const patches,
+	const unsigned int nSx_r, const unsigned int width, const unsigned int height, const unsigned int chnls,
+	const unsigned int nHW, const unsigned int kHW, float * const kaiser_window, float * const weight_table,
+	float * kaiser_weighted)
+{
+	const simd_kernels & kernels = simd_kernels_get();
+	const unsigned int kHW_2 = kHW * kHW;
+	const unsigned int width_b = width + 2 * nHW;
+	for (unsigned int c = 0; c < chnls; c++)
+	{
+		for (unsigned int k = 0; k < kHW_2; k++)
+			kaiser_weighted[k] = kaiser_window[k] * weight_table[c];
+
+		for (unsigned int n = 0; n < nSx_r; n++)
+		{
+			// Part [p_0, p_1) x [q_0, q_1) of the patch inside the image
+			const int i = (int)(patches[n] / width_b) - (int)nHW;
+			const int j = (int)(patches[n] % width_b) - (int)nHW;
+			const unsigned int p_0 = (i < 0 ? -i : 0);
+			const unsigned int q_0 = (j < 0 ? -j : 0);
+			const int p_1 = min((int)kHW, (int)height - i);
+			const int q_1 = min((int)kHW, (int)width - j);
+			if (p_1 <= (int)p_0 || q_1 <= (int)q_0)
+				continue;
+			const unsigned int len = q_1 - q_0;
+
+			const unsigned int k = c * width * height + (i + p_0) * width + j + q_0;
+			const float * patch = group_3D + n * kHW_2 + c * kHW_2 * nSx_r;
+			for (unsigned int p = p_0; p < (unsigned int)p_1; p++)
+			{
+				float * acc = accumulator + 2 * (k + (p - p_0) * width);
+				const unsigned int pq = p * kHW + q_0;
+				if (kernels.aggregate_row)
+					kernels.aggregate_row(acc, kaiser_weighted + pq, patch + pq, len);
+				else
+					for (unsigned int q = 0; q < len; q++)
+					{
+						acc[2 * q] += kaiser_weighted[pq + q] * patch[pq + q];
+						acc[2 * q + 1] += kaiser_weighted[pq + q];
+					}
+			}
+		}
+	}
+}
+
+//
+// @brief Final reconstruction of an estimate from its accumulators: the
+//        numerator divided by the denominator. The pixels which no patch
+//        reached keep their value in the noisy image.
+//
+// @param accumulator : numerator and denominator of each pixel,
+//        interleaved, see group_aggregate();
+// @param noisy : noisy image;
+// @param estimate : will contain the estimate;
+// @param size : number of pixels of the images, all channels included.
+//
+// @return none.
+//
+void aggregate_estimate(const float * accumulator, const float * noisy, float * estimate, const unsigned int size)
+{
+	const simd_kernels & kernels = simd_kernels_get();
+	if (kernels.aggregate_divide)
+	{
+		kernels.aggregate_divide(accumulator, noisy, estimate, size);
+		return;
+	}
+
+	for (unsigned int k = 0; k < size; k++)
+	{
+		estimate[k] = accumulator[2 * k] / accumulator[2 * k + 1];
+		// Foreback black-blocking problem
+		if (accumulator[2 * k + 1] == 0.0)
+		{
+			estimate[k] = noisy[k];
+		}
+	}
 }
 
+//
+// @brief Apply 2D bior1.5 inverse to a lot of patches.
+//
+// @param patch_state : if not NULL, state of each patch, see
+//        dct_2d_inverse().
+//
 void bior_2d_inverse(
 	float * group_3D_table,
     const unsigned int kHW,
     float * const lpr,
     float * const hpr,
-    const unsigned int group_3D_table_size
+    const unsigned int group_3D_table_size,
+    const unsigned char * patch_state
 	){
 	// Declarations
 	const unsigned int kHW_2 = kHW * kHW;
@@ -1472,7 +2987,16 @@ void bior_2d_inverse(
 
 	// Bior process
 	for (unsigned int n = 0; n < N; n++)
+	{
+		if (patch_state && patch_state[n] != PATCH_COMPUTE)
+		{
+			if (patch_state[n] == PATCH_COPY)
+				for (unsigned int k = 0; k < kHW_2; k++)
+					group_3D_table[k + n * kHW_2] = group_3D_table[k + (n - 1) * kHW_2];
+			continue;
+		}
 		bior_2d_inverse(group_3D_table, kHW, n * kHW_2, lpr, hpr);
+	}
 }
 
 //
@@ -1491,41 +3015,11 @@ void preProcess(float * kaiserWindow, float * coef_norm, float * coef_norm_inv,
 {
 	// Kaiser Window coefficients
 	if (kHW == 8)
-	{
-		// First quarter of the matrix
-		kaiserWindow[0 + kHW * 0] = 0.1924f; kaiserWindow[0 + kHW * 1] = 0.2989f; kaiserWindow[0 + kHW * 2] = 0.3846f; kaiserWindow[0 + kHW * 3] = 0.4325f;
-		kaiserWindow[1 + kHW * 0] = 0.2989f; kaiserWindow[1 + kHW * 1] = 0.4642f; kaiserWindow[1 + kHW * 2] = 0.5974f; kaiserWindow[1 + kHW * 3] = 0.6717f;
-		kaiserWindow[2 + kHW * 0] = 0.3846f; kaiserWindow[2 + kHW * 1] = 0.5974f; kaiserWindow[2 + kHW * 2] = 0.7688f; kaiserWindow[2 + kHW * 3] = 0.8644f;
-		kaiserWindow[3 + kHW * 0] = 0.4325f; kaiserWindow[3 + kHW * 1] = 0.6717f; kaiserWindow[3 + kHW * 2] = 0.8644f; kaiserWindow[3 + kHW * 3] = 0.9718f;
-
-		// Completing the rest of the matrix by symmetry
-		for (unsigned int i = 0; i < kHW / 2; i++)
-			for (unsigned int j = kHW / 2; j < kHW; j++)
-				kaiserWindow[i + kHW * j] = kaiserWindow[i + kHW * (kHW - j - 1)];
-
-		for (unsigned int i = kHW / 2; i < kHW; i++)
-			for (unsigned int j = 0; j < kHW; j++)
-				kaiserWindow[i + kHW * j] = kaiserWindow[kHW - i - 1 + kHW * j];
-	}
+		for (unsigned int k = 0; k < kHW * kHW; k++)
+			kaiserWindow[k] = kaiser_window_8[k];
 	else if (kHW == 12)
-	{
-		// First quarter of the matrix
-		kaiserWindow[0 + kHW * 0] = 0.1924f; kaiserWindow[0 + kHW * 1] = 0.2615f; kaiserWindow[0 + kHW * 2] = 0.3251f; kaiserWindow[0 + kHW * 3] = 0.3782f;  kaiserWindow[0 + kHW * 4] = 0.4163f;  kaiserWindow[0 + kHW * 5] = 0.4362f;
-		kaiserWindow[1 + kHW * 0] = 0.2615f; kaiserWindow[1 + kHW * 1] = 0.3554f; kaiserWindow[1 + kHW * 2] = 0.4419f; kaiserWindow[1 + kHW * 3] = 0.5139f;  kaiserWindow[1 + kHW * 4] = 0.5657f;  kaiserWindow[1 + kHW * 5] = 0.5927f;
-		kaiserWindow[2 + kHW * 0] = 0.3251f; kaiserWindow[2 + kHW * 1] = 0.4419f; kaiserWindow[2 + kHW * 2] = 0.5494f; kaiserWindow[2 + kHW * 3] = 0.6390f;  kaiserWindow[2 + kHW * 4] = 0.7033f;  kaiserWindow[2 + kHW * 5] = 0.7369f;
-		kaiserWindow[3 + kHW * 0] = 0.3782f; kaiserWindow[3 + kHW * 1] = 0.5139f; kaiserWindow[3 + kHW * 2] = 0.6390f; kaiserWindow[3 + kHW * 3] = 0.7433f;  kaiserWindow[3 + kHW * 4] = 0.8181f;  kaiserWindow[3 + kHW * 5] = 0.8572f;
-		kaiserWindow[4 + kHW * 0] = 0.4163f; kaiserWindow[4 + kHW * 1] = 0.5657f; kaiserWindow[4 + kHW * 2] = 0.7033f; kaiserWindow[4 + kHW * 3] = 0.8181f;  kaiserWindow[4 + kHW * 4] = 0.9005f;  kaiserWindow[4 + kHW * 5] = 0.9435f;
-		kaiserWindow[5 + kHW * 0] = 0.4362f; kaiserWindow[5 + kHW * 1] = 0.5927f; kaiserWindow[5 + kHW * 2] = 0.7369f; kaiserWindow[5 + kHW * 3] = 0.8572f;  kaiserWindow[5 + kHW * 4] = 0.9435f;  kaiserWindow[5 + kHW * 5] = 0.9885f;
-
-		// Completing the rest of the matrix by symmetry
-		for (unsigned int i = 0; i < kHW / 2; i++)
-			for (unsigned int j = kHW / 2; j < kHW; j++)
-				kaiserWindow[i + kHW * j] = kaiserWindow[i + kHW * (kHW - j - 1)];
-
-		for (unsigned int i = kHW / 2; i < kHW; i++)
-			for (unsigned int j = 0; j < kHW; j++)
-				kaiserWindow[i + kHW * j] = kaiserWindow[kHW - i - 1 + kHW * j];
-	}
+		for (unsigned int k = 0; k < kHW * kHW; k++)
+			kaiserWindow[k] = kaiser_window_12[k];
 	else
 		for (unsigned int k = 0; k < kHW * kHW; k++)
 			kaiserWindow[k] = 1.0f;
@@ -1556,32 +3050,41 @@ void preProcess(float * kaiserWindow, float * coef_norm, float * coef_norm_inv,
 //
 // @brief Precompute Bloc Matching (distance inter-patches)
 //
-// @param patch_table: for each patch in the image, will contain
-// all coordonnate of its similar patches
-// @param img: noisy image on which the distance is computed
-// @param width, height: size of img
-// @param kHW: size of patch
-// @param NHW: maximum similar patches wanted
-// @param nHW: size of the boundary of img
+// @param workspace: workspace prepared for the step (see
+//        StepWorkspace::prepare()), whose patch_table will contain, for
+//        each reference patch, all coordonnate of its similar patches.
+//        Its parameters are used: kHW the size of patch, NHW the
+//        maximum similar patches wanted, nHW the size of the boundary
+//        of img and half size of the search window;
+// @param img: noisy image on which the distance is computed, with its
+//        mirrored boundary of nHW pixels. Only its first channel is used
 // @param tauMatch: threshold used to determinate similarity between
 //        patches
 //
 // @return none.
 //
-void precompute_BM(unsigned int ** &patch_table, unsigned int * &patch_table_size, float * const &img, const unsigned int width,
-	const unsigned int height, const unsigned int kHW, const unsigned int NHW, const unsigned int nHW, const unsigned int pHW,
-	const float tauMatch)
+void precompute_BM(StepWorkspace & workspace, const MirroredImage & img, const float tauMatch)
 {
-	// Declarations
+	// Declarations. The indexes of the patches are the ones of the image
+	// with its boundary
+	const unsigned int kHW = workspace.kHW;
+	const unsigned int NHW = workspace.NHW;
+	const unsigned int nHW = workspace.nHW;
+	const unsigned int width = img.width();
+	const unsigned int height = img.height();
+	const unsigned int w = img.img.width;
 	const unsigned int Ns = 2 * nHW + 1;
 	const float threshold = tauMatch * kHW * kHW;
-	float * diff_table = new float[width * height];	
-
-	float ** sum_table = new float*[(nHW + 1) * Ns];
-	for (unsigned int i = 0; i < (nHW + 1) * Ns; ++i)
-	{
-		sum_table[i] = new float[width * height];
-	}
+	const simd_kernels & kernels = simd_kernels_get();
+
+	// Tables of the distances, one plane per offset, then the image of the
+	// square differences, in the plane of the tables of the workspace.
+	// The differences are not computed on the last rows and columns, read
+	// by the sums of the last patches
+	float ** sum_table = workspace.sum_table;
+	float * diff_table = workspace.tables + (size_t)(nHW + 1) * Ns * width * height;
+	plane_stage(workspace.tables, MEM_STAGE_BLOCK_MATCHING);
+	memset(diff_table, 0, (size_t)width * height * sizeof(float));
 	for (unsigned int j = 0; j < (nHW + 1) * Ns; ++j)
 	{
 		for (unsigned int i = 0; i < width*height; ++i)
@@ -1589,28 +3092,47 @@ void precompute_BM(unsigned int ** &patch_table, unsigned int * &patch_table_siz
 			sum_table[j][i] = 2 * threshold;
 		}
 	}
-	patch_table = new unsigned int *[width*height];
-	patch_table_size = new unsigned int[width*height];
+	unsigned int ** patch_table = workspace.patch_table;
+	unsigned int * patch_table_size = workspace.patch_table_size;
 
-	unsigned int * row_ind;
-	unsigned int row_ind_size;
-	ind_initialize(row_ind, height - kHW + 1, nHW, pHW, row_ind_size);
-	unsigned int * column_ind;
-	unsigned int column_ind_size;
-	ind_initialize(column_ind, width - kHW + 1, nHW, pHW, column_ind_size);
+	const unsigned int * row_ind = workspace.row_ind;
+	const unsigned int row_ind_size = workspace.row_ind_size;
+	const unsigned int * column_ind = workspace.column_ind;
+	const unsigned int column_ind_size = workspace.column_ind_size;
 	// For each possible distance, precompute inter-patches distance
 	for (unsigned int di = 0; di <= nHW; di++)	
 		for (unsigned int dj = 0; dj < Ns; dj++)	// Ns*2+1
 		{
-			const int dk = (int)(di * width + dj) - (int)nHW; 
 			const unsigned int ddk = di * Ns + dj;	
 
-			// Process the image containing the square distance between pixels
+			// Process the image containing the square distance between pixels.
+			// The pixels k of the image are compared with the pixels k + dk,
+			// dk = di * width + dj - nHW, of the image with its boundary: the
+			// columns [j_0, j_1) are read in place, the other ones (at most nHW
+			// on each side) are mirrored
+			const int s = (int)dj - (int)nHW;
+			const unsigned int j_0 = (s < 0 ? -s : 0);
+			const unsigned int j_1 = (s > 0 ? w - s : w);
 			for (unsigned int i = nHW; i < height - nHW; i++)	
 			{
-				unsigned int k = i * width + nHW;
-				for (unsigned int j = nHW; j < width - nHW; j++, k++)
-					diff_table[k] = (img[k + dk] - img[k]) * (img[k + dk] - img[k]);
+				const float * row = img.img.data + (i - nHW) * w;
+				const float * row_dk = img.img.data + img.row(i + di) * w;
+				float * diff = diff_table + i * width + nHW;
+				for (unsigned int j = 0; j < j_0; j++)
+				{
+					const float d = row_dk[mirror_ind((int)j + s, w)] - row[j];
+					diff[j] = d * d;
+				}
+				if (kernels.square_diff)
+					kernels.square_diff(row_dk + j_0 + s, row + j_0, diff + j_0, j_1 - j_0);
+				else
+					for (unsigned int j = j_0; j < j_1; j++)
+						diff[j] = (row_dk[j + s] - row[j]) * (row_dk[j + s] - row[j]);
+				for (unsigned int j = j_1; j < w; j++)
+				{
+					const float d = row_dk[mirror_ind((int)j + s, w)] - row[j];
+					diff[j] = d * d;
+				}
 			}
 
 			// Compute the sum for each patches, using the method of the integral images
@@ -1662,25 +3184,27 @@ void precompute_BM(unsigned int ** &patch_table, unsigned int * &patch_table_siz
 
 			}
 		}
-	delete[] diff_table;
-	diff_table = NULL;
-	// Precompute Bloc Matching
-	TD * table_distance;
+	// Precompute Bloc Matching. The distance tables are the ones of the
+	// largest search window. The similar patches of the references are
+	// taken one after the other in the block of the workspace; the last
+	// row (resp. column) of references may repeat the previous one
+	TD * table_distance = workspace.table_distance;
+	unsigned int * table_distance_size_arr = workspace.table_distance_size;
+	unsigned int * patches = workspace.patches;
 
 	for (unsigned int ind_i = 0; ind_i < row_ind_size; ind_i++)
 	{
+		if (ind_i > 0 && row_ind[ind_i] == row_ind[ind_i - 1])
+			continue;
 		for (unsigned int ind_j = 0; ind_j < column_ind_size; ind_j++)
 		{
+			if (ind_j > 0 && column_ind[ind_j] == column_ind[ind_j - 1])
+				continue;
+
 			// Initialization
 			const unsigned int k_r = row_ind[ind_i] * width + column_ind[ind_j];
 
 			unsigned int table_distance_size = 0;
-			unsigned int * table_distance_size_arr = new unsigned int[4 * nHW + 2];
-			if (!table_distance_size_arr)
-			{
-				delete[] table_distance_size_arr;
-				table_distance_size_arr = NULL;
-			}
 			for (int dj = -(int)nHW; dj <= (int)nHW; dj++)
 			{
 				table_distance_size_arr[2 * (dj + nHW)] = table_distance_size;
@@ -1700,12 +3224,6 @@ void precompute_BM(unsigned int ** &patch_table, unsigned int * &patch_table_siz
 					}
 				}
 			}
-			table_distance = new TD[table_distance_size];
-			if (!table_distance)
-			{
-				delete[] table_distance;
-				table_distance = NULL;
-			}
 			// Threshold distances in order to keep similar patches
 			for (int dj = -(int)nHW; dj <= (int)nHW; dj++)
 			{
@@ -1740,16 +3258,9 @@ void precompute_BM(unsigned int ** &patch_table, unsigned int * &patch_table_siz
 			// We assume that NHW is already a power of 2
 			const unsigned int nSx_r = (NHW > table_distance_size ?
 				closest_power_of_2(table_distance_size) : NHW); // nPatcWidth
-			if (nSx_r == 1)
-			{
-				patch_table[k_r] = new unsigned int[nSx_r + 1];
-				patch_table_size[k_r] = nSx_r + 1;
-			}
-			else
-			{
-				patch_table[k_r] = new unsigned int[nSx_r];
-				patch_table_size[k_r] = nSx_r;
-			}
+			patch_table[k_r] = patches;
+			patch_table_size[k_r] = (nSx_r == 1 ? nSx_r + 1 : nSx_r);
+			patches += patch_table_size[k_r];
 
 			// Sort patches according to their distance to the reference one
 			SelectSort(table_distance, table_distance_size);
@@ -1765,20 +3276,8 @@ void precompute_BM(unsigned int ** &patch_table, unsigned int * &patch_table_siz
 			{
 				patch_table[k_r][nSx_r] = table_distance[0].u;
 			}
-			delete[] table_distance;
-			delete[] table_distance_size_arr;
-
-			table_distance = NULL;
-			table_distance_size_arr = NULL;
 		}
 	}
-	for (unsigned int i = 0; i < (nHW + 1) * Ns; ++i)
-	{
-		delete[] sum_table[i];
-		sum_table[i] = NULL;
-	}
-	delete[] sum_table;
-	sum_table = NULL;
 }
 
 //
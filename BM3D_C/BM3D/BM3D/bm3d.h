@@ -6,6 +6,9 @@
 
 #include "ImgProcUtility.h"
 
+struct ScratchArena;
+struct RasterFile;
+
 struct TD
 {
 	float f;
@@ -14,43 +17,383 @@ struct TD
 	TD(float _f, unsigned _u) : f(_f), u(_u) {}
 };
 
-// Main function
-IplImage * run_bm3d(IplImage * iplImage, const float sigma);
+// Classes of the columns of a 3D group after hard thresholding
+#define COLUMN_ZERO  0
+#define COLUMN_DC    1
+#define COLUMN_FULL  2
+
+// States of a patch before the 2D inverse transform
+#define PATCH_COMPUTE  0
+#define PATCH_ZERO     1    // null patch, nothing to do
+#define PATCH_COPY     2    // same as the previous patch
+
+// Work skipped by the inverse transforms of the 1st step
+struct SkipStats
+{
+	unsigned long long columns;          // columns of the inverse Hadamard transforms
+	unsigned long long columns_zero;     // ... skipped since null
+	unsigned long long columns_dc;       // ... replaced by a broadcast of the 3D-DC term
+	unsigned long long patches;          // patches of the 2D inverse transforms
+	unsigned long long patches_zero;     // ... skipped since null
+	unsigned long long patches_copy;     // ... copied from the previous patch
+	SkipStats() : columns(0), columns_zero(0), columns_dc(0), patches(0), patches_zero(0), patches_copy(0) {}
+	void add(const SkipStats & s)
+	{
+		columns += s.columns;
+		columns_zero += s.columns_zero;
+		columns_dc += s.columns_dc;
+		patches += s.patches;
+		patches_zero += s.patches_zero;
+		patches_copy += s.patches_copy;
+	}
+};
+
+// Planar float image: chnls planes of width x height pixels, stored
+// row by row. The view does not own its buffer
+struct PlanarImage
+{
+	float * data;
+	unsigned width;
+	unsigned height;
+	unsigned chnls;
+	PlanarImage() : data(NULL), width(0), height(0), chnls(0) {}
+	PlanarImage(float * _data, unsigned _width, unsigned _height, unsigned _chnls)
+		: data(_data), width(_width), height(_height), chnls(_chnls) {}
+};
+
+// Index in [0, n) of the coordinate x in [-n, 2n) of a signal whose
+// boundaries are mirrored: x = -1 reads 0 and x = n reads n - 1
+inline unsigned mirror_ind(const int x, const unsigned n)
+{
+	return (x < 0 ? (unsigned)(-x - 1) : ((unsigned)x >= n ? 2 * n - (unsigned)x - 1 : (unsigned)x));
+}
+
+// Planar image seen with a boundary of N pixels around it, whose pixels
+// are mirrored from the image when read instead of being stored. The
+// coordinates (i, j) are the ones of the image with its boundary, of size
+// (width + 2N) x (height + 2N). N must not be greater than the size of the
+// image
+struct MirroredImage
+{
+	PlanarImage img;
+	unsigned N;
+	MirroredImage(const PlanarImage & _img, const unsigned _N) : img(_img), N(_N) {}
+
+	// Size of the image with its boundary
+	unsigned width() const { return img.width + 2 * N; }
+	unsigned height() const { return img.height + 2 * N; }
+
+	// Row (resp. column) of the image read for the row i (resp. column j)
+	unsigned row(const unsigned i) const { return mirror_ind((int)i - (int)N, img.height); }
+	unsigned column(const unsigned j) const { return mirror_ind((int)j - (int)N, img.width); }
+
+	// Pixel (i, j) of the channel c
+	float at(const unsigned c, const unsigned i, const unsigned j) const
+	{
+		return img.data[(c * img.height + row(i)) * img.width + column(j)];
+	}
+
+	// Patch of size k x k whose top-left pixel is (i, j), for the channel c
+	float * patch(const unsigned c, const unsigned i, const unsigned j, const unsigned k,
+		float * buf, unsigned & stride) const;
+};
+
+// Environment variable giving the memory budget of run_bm3d in bytes, with
+// an optional K, M or G suffix. No budget if unset or 0
+#define BM3D_MEMORY_BUDGET_ENV  "BM3D_MEMORY_BUDGET"
+
+// Environment variable enabling the half-precision cache of the 2D
+// transforms of every patch (see spectrum_2d_process()) when set to 1.
+// Off by default: the rounding moves some coefficients across the
+// thresholds
+#define BM3D_SPECTRUM_CACHE_ENV  "BM3D_SPECTRUM_CACHE"
+
+// Tiles of an image, denoised one after the other by both steps so that
+// run_bm3d fits in a memory budget. The interiors of the tiles partition
+// the image and start on the grid of the reference patches; each tile is
+// read with a halo of the neighbour tiles around it
+struct TilePlan
+{
+	unsigned width;          // size of the image
+	unsigned height;
+	unsigned nb_x;           // number of tiles along the rows and the columns
+	unsigned nb_y;
+	unsigned halo;           // size of the halo, a multiple of align
+	unsigned align;          // step of the grid of the reference patches
+	size_t peak_bytes;       // predicted peak of the buffers of run_bm3d
+	TilePlan() : width(0), height(0), nb_x(1), nb_y(1), halo(0), align(1), peak_bytes(0) {}
+
+	// Column (resp. row) of the first pixel of the interior of the tile k,
+	// k = nb_x (resp. nb_y) giving the size of the image
+	unsigned x(const unsigned k) const { return start(k, nb_x, width); }
+	unsigned y(const unsigned k) const { return start(k, nb_y, height); }
+
+private:
+	unsigned start(const unsigned k, const unsigned nb, const unsigned size) const
+	{
+		return (k >= nb ? size : (unsigned)((unsigned long long)k * size / nb / align * align));
+	}
+};
+
+// Buffers of a StepWorkspace, see bm3d_step_buffers()
+#define STEP_BUFFER_ARENA        0    // scratch arena: small tables, 3D groups
+#define STEP_BUFFER_TABLES       1    // tables of distances, then tables of 2D transforms
+#define STEP_BUFFER_PATCHES      2    // similar patches of the reference patches
+#define STEP_BUFFER_ACCUMULATOR  3    // numerator and denominator of the estimate
+#define STEP_BUFFER_NB           4
+
+// Inverse 2D DCT plans of a StepWorkspace, one per size 2^n <= 64 of the
+// 3D groups, see ind_log2()
+#define STEP_PLAN_INVERSE_NB     7
+
+// Working memory of the steps of BM3D. Each step prepares it for its image
+// and its parameters: a buffer is only reallocated when it is too small,
+// so once both steps ran on the largest image, the steps make no
+// allocation. The tables of distances of the block matching and the
+// tables of 2D transforms, never used at the same time, share a plane
+struct StepWorkspace
+{
+	// Parameters of the last preparation, and size of its image with
+	// its boundary
+	unsigned width;
+	unsigned height;
+	unsigned chnls;
+	unsigned nHW;
+	unsigned kHW;
+	unsigned NHW;
+	unsigned pHW;
+
+	// Indexes of the reference patches
+	unsigned * row_ind;
+	unsigned * column_ind;
+	unsigned row_ind_size;
+	unsigned column_ind_size;
+
+	// Noise of each channel, Kaiser window, normalization coefficients
+	// and matrix of the DCT, bior1.5 filters
+	float * sigma_table;
+	float * kaiser_window;
+	float * coef_norm;
+	float * coef_norm_inv;
+	float * dct_mat;
+	float * lpd;
+	float * hpd;
+	float * lpr;
+	float * hpr;
+
+	// Block matching: tables of distances and of similar patches. The
+	// similar patches of all the references are in the block patches
+	float ** sum_table;
+	TD * table_distance;
+	unsigned * table_distance_size;
+	unsigned ** patch_table;
+	unsigned * patch_table_size;
+	unsigned * patches;
+
+	// Planes, and their sizes in bytes
+	float * tables;
+	void * patch_block;
+	float * accumulator;
+	size_t bytes[STEP_BUFFER_NB];
+
+	// Scratch arena, whose start holds the small tables above: the step
+	// takes its buffers after them
+	ScratchArena * arena;
+
+	// FFTW plans of the inverse 2D DCT of the 3D groups of chnls * 2^n
+	// patches, 2^n <= NHW, taken from the plan cache. NULL without fftw
+	fftwf_plan plan_inverse[STEP_PLAN_INVERSE_NB];
+
+	StepWorkspace();
+	~StepWorkspace() { release(); }
+
+	// Prepare the buffers of a step (1 or 2) for an image of width x height
+	// pixels, without its boundary
+	bool prepare(const unsigned step, const unsigned width, const unsigned height, const unsigned chnls,
+		const unsigned tau_2D, const unsigned nHW, const unsigned kHW, const unsigned NHW, const unsigned pHW);
+
+	// Free all the buffers
+	void release();
+
+private:
+	StepWorkspace(const StepWorkspace &);
+	StepWorkspace & operator=(const StepWorkspace &);
+};
+
+// Denoiser of a stream of frames of the same size, depth and noise. It
+// owns all the working memory, allocated by init(), and reuses it for
+// every frame: denoise() makes no allocation
+struct BM3DDenoiser
+{
+	unsigned width;
+	unsigned height;
+	unsigned chnls;
+	int depth;
+	float sigma;
+	TilePlan plan;
+	float * images;              // noisy, basic and denoised images, planar
+	float * tiles;               // noisy, basic and denoised tiles, NULL for a single tile
+	StepWorkspace workspace;     // shared by both steps and all the tiles
+	IplImage * output;           // denoised frame, overwritten by each frame, NULL if not owned
+	fftwf_plan plan_hard[1];
+	fftwf_plan plan_wien[1];
+	SkipStats skip_stats;        // work skipped by the 1st step of the last frame
+	bool verbose;                // print the tiles, the kernels and the steps
+
+	BM3DDenoiser();
+	~BM3DDenoiser() { release(); }
+
+	// Allocate the memory of the frames. A memory_budget of 0 uses
+	// BM3D_MEMORY_BUDGET_ENV. Without own_output, the denoised frames
+	// are written in images given by the caller
+	int init(const unsigned width, const unsigned height, const unsigned chnls, const int depth,
+		const float sigma, const size_t memory_budget = 0, const bool own_output = true);
+
+	// Denoise a frame. The result is iplImage_denoised, or output if
+	// NULL, and NULL on failure
+	IplImage * denoise(IplImage * iplImage, IplImage * iplImage_denoised = NULL);
+
+	// Free all the memory
+	void release();
+
+private:
+	BM3DDenoiser(const BM3DDenoiser &);
+	BM3DDenoiser & operator=(const BM3DDenoiser &);
+};
+
+// Main function. A memory_budget of 0 uses BM3D_MEMORY_BUDGET_ENV
+IplImage * run_bm3d(IplImage * iplImage, const float sigma, const size_t memory_budget = 0);
+
+// Largest interior of the tiles of run_bm3d_file, whatever its memory
+// budget
+#define BM3D_FILE_TILE_SIZE  1024
+
+// Out-of-core version of run_bm3d, from a raster to another one. A
+// memory_budget of 0 uses BM3D_MEMORY_BUDGET_ENV
+int run_bm3d_file(const RasterFile & input, const RasterFile & output, const float sigma,
+	const size_t memory_budget = 0);
+
+// Sizes of the buffers of a step on an image of width x height pixels
+void bm3d_step_buffers(size_t bytes[STEP_BUFFER_NB], const unsigned step, const unsigned width, const unsigned height,
+	const unsigned chnls, const unsigned tau_2D, const unsigned nHW, const unsigned kHW, const unsigned NHW,
+	const unsigned pHW);
+
+// Size of a StepWorkspace prepared for both steps, from the sizes of their buffers
+size_t bm3d_workspace_bytes(const size_t bytes_1[STEP_BUFFER_NB], const size_t bytes_2[STEP_BUFFER_NB]);
+
+// Choose the fewest tiles for which run_bm3d fits in a memory budget
+bool bm3d_plan_tiles(TilePlan & plan, const unsigned width, const unsigned height, const unsigned chnls,
+	const unsigned pixel_bytes, const size_t budget, const unsigned nHard, const unsigned kHard,
+	const unsigned NHard, const unsigned pHard, const unsigned nWien, const unsigned kWien,
+	const unsigned NWien, const unsigned pWien);
 
-float * transfer_iplImage2buffer(IplImage * iplImage);
+// Choose the largest tiles for which run_bm3d_file fits in a memory budget
+bool bm3d_plan_file_tiles(TilePlan & plan, const unsigned width, const unsigned height, const unsigned chnls,
+	const unsigned pixel_bytes, const size_t budget, const unsigned nHard, const unsigned kHard,
+	const unsigned NHard, const unsigned pHard, const unsigned nWien, const unsigned kWien,
+	const unsigned NWien, const unsigned pWien);
 
-IplImage * transfer_buffer2iplImage(float * vec, const unsigned width, const unsigned height, const unsigned chnls, const bool clip);
+// Size of the largest tile of a plan, with its halo
+void bm3d_tile_size(const TilePlan & plan, unsigned & tile_w, unsigned & tile_h);
 
-IplImage * bm3d_1st_step(IplImage * iplImage, const float sigma, fftwf_plan *  plan_2d_for_1, fftwf_plan *  plan_2d_for_2, fftwf_plan *  plan_2d_inv);
+// Run a step tile by tile
+int bm3d_step_tiles(const TilePlan & plan, const unsigned step, const PlanarImage & noisy, const PlanarImage & basic,
+	const PlanarImage & denoised, const float sigma, fftwf_plan * plan_2d_for_1, fftwf_plan * plan_2d_for_2,
+	SkipStats * skip_stats, StepWorkspace * workspace = NULL, float * tiles = NULL);
 
-IplImage * bm3d_2nd_step(IplImage * iplImage, IplImage * iplImage_basic, const float sigma, fftwf_plan *  plan_2d_for_1, fftwf_plan *  plan_2d_for_2, fftwf_plan *  plan_2d_inv);
+// Copy a rectangle of w x h pixels between two planar images, for every channel
+void copy_rect(const PlanarImage & src, const unsigned x_src, const unsigned y_src, const PlanarImage & dst,
+	const unsigned x_dst, const unsigned y_dst, const unsigned w, const unsigned h);
+
+// Ingest of an IplImage in the color space of a planar float image
+int transfer_iplImage2buffer(IplImage * iplImage, const PlanarImage & img, const unsigned color_space);
+
+// Egress of a planar float image from its color space to a new IplImage
+IplImage * transfer_buffer2iplImage(const PlanarImage & img, const unsigned color_space, const int depth);
+
+// Egress of a planar float image from its color space to an IplImage of its size
+int transfer_buffer2iplImage(const PlanarImage & img, const unsigned color_space, IplImage * iplImage);
+
+int bm3d_1st_step(const PlanarImage & noisy, const PlanarImage & basic, const float sigma, fftwf_plan *  plan_2d_for_1, fftwf_plan *  plan_2d_for_2, SkipStats * skip_stats, StepWorkspace * workspace = NULL);
+
+int bm3d_2nd_step(const PlanarImage & noisy, const PlanarImage & basic, const PlanarImage & denoised, const float sigma, fftwf_plan *  plan_2d_for_1, fftwf_plan *  plan_2d_for_2, StepWorkspace * workspace = NULL);
+
+// Index of a patch in a table of 2D transforms used as a ring buffer
+unsigned table_2D_ind(
+    const unsigned k,
+    const unsigned width,
+    const unsigned nb_rows
+);
+
+// Build a 3D group (patch by patch) from a table of 2D transforms
+void group_3D_gather(
+    float * group_3D,
+    float * const table_2D,
+    unsigned * const patches,
+    const unsigned nSx_r,
+    const unsigned width,
+    const unsigned nb_rows,
+    const unsigned kHW_2,
+    const unsigned chnls
+);
+
+// Prefetch the patches of a 3D group from a table of 2D transforms
+void group_3D_prefetch(
+    float * const table_2D,
+    unsigned * const patches,
+    const unsigned nSx_r,
+    const unsigned width,
+    const unsigned nb_rows,
+    const unsigned kHW_2,
+    const unsigned chnls
+);
+
+#ifdef _BM3D_USE_FFTW
+// Size of a buffer of patches for the cached 2D DCT plans
+size_t fftw_batch_bytes(
+    const unsigned nb,
+    const unsigned kHW_2
+);
+
+// Take a buffer of patches for the cached 2D DCT plans in an arena
+float * fftw_batch_alloc(
+    ScratchArena & arena,
+    const unsigned nb,
+    const unsigned kHW_2
+);
+
+// Apply a cached 2D DCT plan on a buffer of patches
+void fftw_batch_execute(
+    fftwf_plan * plan,
+    float * in,
+    float * out,
+    const unsigned nb,
+    const unsigned kHW_2
+);
+#endif      // #ifdef _BM3D_USE_FFTW
 
 // Process 2D dct of a group of patches
 void dct_2d_process(
     float * DCT_table_2D,
-    float * const img,
+    const MirroredImage & img,
     fftwf_plan * plan_1,
     fftwf_plan * plan_2,
     const unsigned nHW,
-    const unsigned width,
-    const unsigned height,
-    const unsigned chnls,
     const unsigned kHW,
     const unsigned i_r,
     const unsigned step,
     float * const coef_norm,
     const unsigned i_min,
-    const unsigned i_max
+    const unsigned i_max,
+    float * const dct_mat,
+    ScratchArena & arena
 );
 
 // Process 2D bior1.5 transform of a group of patches
 void bior_2d_process(
     float * bior_table_2D,
-    float * const img,  
+    const MirroredImage & img,
     const unsigned nHW,
-    const unsigned width,
-    const unsigned height,
-    const unsigned chnls,
     const unsigned kHW,
     const unsigned i_r,
     const unsigned step,
@@ -60,13 +403,26 @@ void bior_2d_process(
     float * hpd
 );
 
+// Process 2D transform of every patch of the image, stored in half precision
+void spectrum_2d_process(
+    unsigned short * spectrum_2D,
+    const MirroredImage & img,
+    const unsigned kHW,
+    const unsigned tau_2D,
+    float * const dct_mat,
+    float * lpd,
+    float * hpd
+);
+
 void dct_2d_inverse(
 	float * group_3D_table,
     const unsigned kHW,
-    const unsigned N,	
     const unsigned group_3D_table_size,
+    fftwf_plan plan,
     float * const coef_norm_inv,
-    fftwf_plan * plan
+    float * const dct_mat,
+    const unsigned char * patch_state,
+    ScratchArena & arena
 );
 
 void bior_2d_inverse(
@@ -74,7 +430,49 @@ void bior_2d_inverse(
     const unsigned kHW,  
     float * const lpr,  
     float * const hpr,	
-    const unsigned group_3D_table_size
+    const unsigned group_3D_table_size,
+    const unsigned char * patch_state
+);
+
+// Aggregation of a 3D group in the interleaved numerator and denominator of the estimate
+void group_aggregate(
+    float * accumulator,
+    float * const group_3D,
+    unsigned * const patches,
+    const unsigned nSx_r,
+    const unsigned width,
+    const unsigned height,
+    const unsigned chnls,
+    const unsigned nHW,
+    const unsigned kHW,
+    float * const kaiser_window,
+    float * const weight_table,
+    float * kaiser_weighted
+);
+
+// Division of the numerator of an estimate by its denominator
+void aggregate_estimate(
+    const float * accumulator,
+    const float * noisy,
+    float * estimate,
+    const unsigned size
+);
+
+// Hard thresholding and scaling of coefficients, return the number of kept ones
+unsigned ht_threshold_scale(
+    float * vec,
+    const unsigned N,
+    const float T,
+    const float coef
+);
+
+// Inverse Hadamard transform of a thresholded group, skipping its zero columns
+bool hadamard_inverse_sparse(
+    float * group,
+    float * tmp,
+    const unsigned nSx_r,
+    const unsigned kHW_2,
+    unsigned char * mask
 );
 
 // HT filtering using Welsh-Hadamard transform (do only
@@ -89,7 +487,17 @@ void ht_filtering_hadamard(
     float * const sigma_table,
     const float lambdaThr3D,
     float * weight_table,
-    const bool doWeight
+    const bool doWeight,
+    unsigned char * mask
+);
+
+// Wiener shrinkage of a set of coefficients, return the sum of the Wiener coefficients
+float wiener_shrink(
+    float * const img,
+    float * est,
+    const unsigned N,
+    const float sigma_2,
+    const float coef
 );
 
 // Wiener filtering using Welsh-Hadamard transform
@@ -122,16 +530,10 @@ void preProcess(
     const unsigned kHW
 );
 
+// Precompute the similar patches of the reference patches, in a prepared workspace
 void precompute_BM(
-	unsigned ** &patch_table,	
-    unsigned * &patch_table_size,
-    float * const &img,   
-    const unsigned width,
-    const unsigned height,  
-    const unsigned kHW,  
-    const unsigned NHW,  
-    const unsigned n,   
-    const unsigned pHW, 
+    StepWorkspace & workspace,
+    const MirroredImage & img,
     const float    tauMatch
 );
 
@@ -0,0 +1,187 @@
+/**
+ * @file bm3d_api.cpp
+ * @brief C interface of the BM3D library, on top of BM3DDenoiser
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif      // #ifdef _OPENMP
+
+#include "bm3d_api.h"
+#include "bm3d.h"
+#include "utilities.h"
+
+struct bm3d_context
+{
+	BM3DDenoiser denoiser;       // memory, tiles and plans of the frames
+	unsigned threads;            // OpenMP threads of the ingest and egress, 0 for the default
+};
+
+//
+// @brief Depth of an IplImage from a BM3D_DEPTH_* value.
+//
+// @return the SR_DEPTH_* value, 0 if the depth is not supported.
+//
+static int bm3d_api_depth(const int depth)
+{
+	return (depth == BM3D_DEPTH_8U ? SR_DEPTH_8U :
+		(depth == BM3D_DEPTH_16U ? SR_DEPTH_16U :
+		(depth == BM3D_DEPTH_32F ? SR_DEPTH_32F : 0)));
+}
+
+//
+// @brief Header of an IplImage on a frame of the caller, without copy.
+//
+// @param iplImage: will describe the frame;
+// @param denoiser: gives the size and depth of the frame;
+// @param data, stride: frame and size in bytes of its rows.
+//
+// @return false if the rows are too short for the size of the frame.
+//
+static bool bm3d_api_frame(IplImage & iplImage, const BM3DDenoiser & denoiser, const void * data,
+	const size_t stride)
+{
+	const size_t row_bytes = (size_t)denoiser.width * denoiser.chnls * ((denoiser.depth & 0xFF) / 8);
+	if (!data || stride < row_bytes || stride * denoiser.height > (size_t)0x7FFFFFFF)
+		return false;
+
+	memset(&iplImage, 0, sizeof(iplImage));
+	iplImage.nSize = sizeof(iplImage);
+	iplImage.width = (int)denoiser.width;
+	iplImage.height = (int)denoiser.height;
+	iplImage.nChannels = (int)denoiser.chnls;
+	iplImage.depth = denoiser.depth;
+	iplImage.widthStep = (int)stride;
+	iplImage.imageSize = (int)(stride * denoiser.height);
+	iplImage.imageData = (char *)data;
+	return true;
+}
+
+void bm3d_params_default(bm3d_params * params)
+{
+	memset(params, 0, sizeof(*params));
+	params->chnls = 3;
+	params->depth = BM3D_DEPTH_8U;
+}
+
+//
+// @brief Create a context, see bm3d_api.h. The denoiser of the context
+//        writes the frames in the buffers of the caller, so it has no
+//        output image.
+//
+bm3d_context * bm3d_context_create(const bm3d_params * params)
+{
+	if (!params || !params->width || !params->height || (params->chnls != 1 && params->chnls != 3)
+		|| !bm3d_api_depth(params->depth) || !(params->sigma > 0.0f))
+	{
+		CImageUtility::showErrMsg("Wrong parameters in bm3d_context_create!\n");
+		return NULL;
+	}
+
+	// No exception may cross the C interface
+	bm3d_context * context = NULL;
+	try
+	{
+		context = new bm3d_context;
+		context->threads = params->threads;
+		if (context->denoiser.init(params->width, params->height, params->chnls, bm3d_api_depth(params->depth),
+			params->sigma, params->memory_budget, false) != EXIT_SUCCESS)
+		{
+			delete context;
+			context = NULL;
+		}
+	}
+	catch (...)
+	{
+		CImageUtility::showErrMsg("Fail to allocate buffer in bm3d_context_create!\n");
+		delete context;
+		context = NULL;
+	}
+
+	return context;
+}
+
+//
+// @brief Denoise a frame with a context, see bm3d_api.h. The frames of
+//        the caller are wrapped in IplImage headers on the stack, and the
+//        thread count of the context is restored to the one of the caller
+//        after the call.
+//
+int bm3d_denoise(bm3d_context * context, const void * src, size_t src_stride, void * dst, size_t dst_stride)
+{
+	IplImage iplImage, iplImage_denoised;
+	if (!context || !bm3d_api_frame(iplImage, context->denoiser, src, src_stride)
+		|| !bm3d_api_frame(iplImage_denoised, context->denoiser, dst, dst_stride))
+	{
+		CImageUtility::showErrMsg("Wrong frame in bm3d_denoise!\n");
+		return -1;
+	}
+
+#ifdef _OPENMP
+	const int threads = omp_get_max_threads();
+	if (context->threads)
+		omp_set_num_threads((int)context->threads);
+#endif      // #ifdef _OPENMP
+
+	// No exception may cross the C interface
+	const IplImage * result = NULL;
+	try
+	{
+		result = context->denoiser.denoise(&iplImage, &iplImage_denoised);
+	}
+	catch (...)
+	{
+		CImageUtility::showErrMsg("Fail to denoise the frame in bm3d_denoise!\n");
+		result = NULL;
+	}
+
+#ifdef _OPENMP
+	if (context->threads)
+		omp_set_num_threads(threads);
+#endif      // #ifdef _OPENMP
+
+	return (result ? 0 : -1);
+}
+
+void bm3d_context_destroy(bm3d_context * context)
+{
+	delete context;
+}
+
+//
+// @brief Denoise a raster file, see bm3d_api.h. Both rasters are opened
+//        with raster_open() and processed by run_bm3d_file().
+//
+int bm3d_denoise_file(const bm3d_params * params, const char * src, const char * dst, size_t offset, int map)
+{
+	if (!params || !src || !dst || !params->width || !params->height || (params->chnls != 1 && params->chnls != 3)
+		|| !bm3d_api_depth(params->depth) || !(params->sigma > 0.0f))
+	{
+		CImageUtility::showErrMsg("Wrong parameters in bm3d_denoise_file!\n");
+		return -1;
+	}
+
+	// No exception may cross the C interface
+	int status = EXIT_FAILURE;
+	RasterFile input, output;
+	try
+	{
+		const int depth = bm3d_api_depth(params->depth);
+		if (raster_open(input, src, false, map != 0, params->width, params->height, params->chnls, depth, offset)
+			&& raster_open(output, dst, true, map != 0, params->width, params->height, params->chnls, depth, offset))
+			status = run_bm3d_file(input, output, params->sigma, params->memory_budget);
+	}
+	catch (...)
+	{
+		CImageUtility::showErrMsg("Fail to denoise the raster in bm3d_denoise_file!\n");
+		status = EXIT_FAILURE;
+	}
+	if (!raster_close(input))
+		status = EXIT_FAILURE;
+	if (!raster_close(output))
+		status = EXIT_FAILURE;
+
+	return (status == EXIT_SUCCESS ? 0 : -1);
+}
@@ -0,0 +1,100 @@
+#pragma once
+#ifndef BM3D_API_H_INCLUDED
+#define BM3D_API_H_INCLUDED
+
+/**
+ * @file bm3d_api.h
+ * @brief C interface of the BM3D library (libbm3d.a, libbm3d.so)
+ *
+ * A context is created once for a size of frames and keeps all the
+ * memory, the plans and the tiles of the denoising, so that
+ * bm3d_denoise() only processes the frame, with the threads of the
+ * context. Separate contexts may be used concurrently by different
+ * threads: the state shared by the library (FFTW plan cache, image
+ * pool, memory accounting) is protected by locks. A context must be
+ * used by one thread at a time.
+ **/
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif      /* #ifdef __cplusplus */
+
+/* Depth of the samples of the frames */
+#define BM3D_DEPTH_8U   8       /* unsigned char */
+#define BM3D_DEPTH_16U  16      /* unsigned short */
+#define BM3D_DEPTH_32F  32      /* float, in [0, 255] */
+
+typedef struct bm3d_context bm3d_context;
+
+/* Parameters of a context */
+typedef struct bm3d_params
+{
+    unsigned width;             /* size of the frames */
+    unsigned height;
+    unsigned chnls;             /* 1, or 3 interleaved as blue, green, red */
+    int depth;                  /* one of the BM3D_DEPTH_* values */
+    float sigma;                /* standard deviation of the noise */
+    unsigned threads;           /* OpenMP threads of the ingest and egress of */
+                                /* each frame (both steps are serial), 0 for */
+                                /* the OpenMP default */
+    size_t memory_budget;       /* maximum size in bytes of the context, 0 to read */
+                                /* BM3D_MEMORY_BUDGET (no budget if unset) */
+} bm3d_params;
+
+/*
+ * @brief Default parameters: 3 channels of 8 bits, no budget, OpenMP
+ *        default threads. The size and sigma are left to 0 and must be
+ *        set by the caller.
+ */
+void bm3d_params_default(bm3d_params * params);
+
+/*
+ * @brief Create a context: all the memory of the denoising is allocated
+ *        here, split in tiles if the memory budget requires it.
+ *
+ * @return the context, NULL if the parameters are wrong (sigma must be
+ *         positive), the budget is too small or an allocation failed.
+ */
+bm3d_context * bm3d_context_create(const bm3d_params * params);
+
+/*
+ * @brief Denoise a frame of the size and depth of the context. Nothing
+ *        is allocated.
+ *
+ * @param src, src_stride: noisy frame and size in bytes of its rows;
+ * @param dst, dst_stride: will contain the denoised frame. dst may be
+ *        src, which is fully read before being written.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int bm3d_denoise(bm3d_context * context, const void * src, size_t src_stride, void * dst, size_t dst_stride);
+
+/*
+ * @brief Free a context and all its memory. NULL is ignored.
+ */
+void bm3d_context_destroy(bm3d_context * context);
+
+/*
+ * @brief Denoise a raw planar raster file into another one, out of core:
+ *        only a few tiles are in memory, whatever the size of the
+ *        raster. The samples are in the byte order of the machine,
+ *        plane by plane (red, green and blue for 3 channels), after a
+ *        header of offset bytes. The header of dst is left null.
+ *
+ * @param params: size, depth and sigma of the raster, memory budget of
+ *        the tiles (threads is not used);
+ * @param src, dst: names of the noisy and of the denoised raster files;
+ * @param offset: size of the header of both files;
+ * @param map: not 0 to map the files in memory when the system allows it.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int bm3d_denoise_file(const bm3d_params * params, const char * src, const char * dst, size_t offset, int map);
+
+#ifdef __cplusplus
+}
+#endif      /* #ifdef __cplusplus */
+
+#endif      /* #ifndef BM3D_API_H_INCLUDED */
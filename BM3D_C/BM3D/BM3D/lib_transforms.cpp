@@ -20,12 +20,383 @@
 
 #include "lib_transforms.h"
 #include <math.h>
+#ifdef __SR_USE_SIMD
+#include <emmintrin.h>
+#endif      // #ifdef __SR_USE_SIMD
 
 #include <numeric>
 
 using namespace std;
 
 
+// @brief Product of two N x N matrices: C = A * B. Each row of C is
+//        built as a linear combination of the rows of B, so that the
+//        inner loop runs along contiguous memory.
+//
+// @param A, r_a: first matrix, A(i, k) = A[i * r_a + k];
+// @param B, r_b: second matrix, B(k, j) = B[k * r_b + j];
+// @param C, r_c: will contain the result, C(i, j) = C[i * r_c + j].
+//        Must not overlap A or B;
+// @param N: size of the matrices.
+//
+// @return none.
+//
+static void mat_mul(float * const A, const unsigned r_a, float * const B, const unsigned r_b, float * C, const unsigned r_c,
+	const unsigned N)
+{
+    for (unsigned i = 0; i < N; i++)
+    {
+        float * const a = A + i * r_a;
+        float * c = C + i * r_c;
+        unsigned j = 0;
+
+#ifdef __SR_USE_SIMD
+        for (; j + 4 <= N; j += 4)
+        {
+            __m128 vec_c = _mm_setzero_ps();
+            for (unsigned k = 0; k < N; k++)
+                vec_c = _mm_add_ps(vec_c, _mm_mul_ps(_mm_set1_ps(a[k]), _mm_loadu_ps(B + k * r_b + j)));
+            _mm_storeu_ps(c + j, vec_c);
+        }
+#endif      // #ifdef __SR_USE_SIMD
+
+        for (; j < N; j++)
+        {
+            float v = 0.0f;
+            for (unsigned k = 0; k < N; k++)
+                v += a[k] * B[k * r_b + j];
+            c[j] = v;
+        }
+    }
+}
+
+// @brief Compute a full 2D DCT-II (orthonormal) as two small matrix
+//        products: output = D * input * D^T.
+//
+// @param input: vector on which the transform will be applied;
+// @param output: will contain the result;
+// @param N: size of the 2D patch (N x N). Must not be greater than
+//           DCT_MAX_SIZE;
+// @param d_i: for convenience. Shift for input to access to the patch;
+// @param r_i: for convenience. input(i, j) = input[d_i + i * r_i + j];
+// @param d_o: for convenience. Shift for output;
+// @param dct_mat: DCT-II matrix and its transpose, see dct_2d_coef().
+//
+// @return none.
+//
+void dct_2d_forward(float * const input, float * output, const unsigned N, const unsigned d_i, const unsigned r_i, const unsigned d_o,
+	float * const dct_mat)
+{
+    float tmp[DCT_MAX_SIZE * DCT_MAX_SIZE];
+
+    mat_mul(dct_mat, N, input + d_i, r_i, tmp, N, N);
+    mat_mul(tmp, N, dct_mat + N * N, N, output + d_o, N, N);
+}
+
+// @brief Compute a full 2D DCT-II inverse (orthonormal), in place:
+//        signal = D^T * signal * D.
+//
+// @param signal: vector on which the transform will be applied; It
+//                will contain the result at the end;
+// @param N: size of the 2D patch (N x N). Must not be greater than
+//           DCT_MAX_SIZE;
+// @param d_s: for convenience. Shift for signal to access to the patch;
+// @param dct_mat: DCT-II matrix and its transpose, see dct_2d_coef().
+//
+// @return none.
+//
+void dct_2d_inverse(float * signal, const unsigned N, const unsigned d_s, float * const dct_mat)
+{
+    float tmp[DCT_MAX_SIZE * DCT_MAX_SIZE];
+
+    mat_mul(dct_mat + N * N, N, signal + d_s, N, tmp, N, N);
+    mat_mul(tmp, N, dct_mat, N, signal + d_s, N, N);
+}
+
+//
+// @brief Initialize the DCT-II matrix D of size N x N, followed by its
+//        transpose. D is orthonormal, so that the normalization of the
+//        forward and inverse 2D DCT is already contained in it.
+//
+// @param dct_mat: will contain D then D^T. Its size must be 2 * N * N;
+// @param N: size of the patches.
+//
+// @return none.
+//
+void dct_2d_coef(float * dct_mat, const unsigned N)
+{
+    const double pi = 3.14159265358979323846;
+
+    for (unsigned k = 0; k < N; k++)
+    {
+        const double c_k = (k == 0 ? sqrt(1.0 / (double) N) : sqrt(2.0 / (double) N));
+        for (unsigned n = 0; n < N; n++)
+        {
+            const float value = (float) (c_k * cos(pi * (double) (k * (2 * n + 1)) / (double) (2 * N)));
+            dct_mat[k * N + n] = value;
+            dct_mat[N * N + n * N + k] = value;
+        }
+    }
+}
+
+
+// Number of taps of the Bior1.5 filters, and size of the periodic
+// extension on each side of the signal in the forward transform
+#define BIOR_S_1 10
+#define BIOR_S_2 4
+
+// Maximum number of decomposition levels of the specialised kernels
+#define BIOR_LEVELS_MAX 5
+
+//
+// @brief Periodic extension indices of every decomposition level of
+//        a N x N Bior1.5 transform (forward and inverse). Built once
+//        per patch size, see bior_ext(), bior_2d_forward_N() and
+//        bior_2d_inverse_N().
+//
+template <unsigned N>
+struct bior_ext_table
+{
+    unsigned fwd[BIOR_LEVELS_MAX][N + 2 * BIOR_S_2];
+    unsigned inv[BIOR_LEVELS_MAX][(1 + BIOR_S_2) * N];
+
+    bior_ext_table()
+    {
+        const unsigned iter_max = log2(N);
+        for (unsigned iter = 0; iter < iter_max; iter++)
+        {
+            // Forward: level of size N_1 = N / 2^iter
+            per_ext_ind(fwd[iter], N >> iter, BIOR_S_2);
+
+            // Inverse: level of size N_1 = 2^(iter + 1), N_2 = N_1 / 2
+            per_ext_ind(inv[iter], 2u << iter, BIOR_S_2 * (1u << iter));
+        }
+    }
+};
+
+// Tables of the specialised kernels, built at static initialization: the
+// kernels run in OpenMP workers, and function-local statics are not
+// initialised in a thread-safe way by every compiler
+static const bior_ext_table<4> bior_ext_4;
+static const bior_ext_table<8> bior_ext_8;
+static const bior_ext_table<16> bior_ext_16;
+
+//
+// @brief Table of the periodic extension indices for N x N patches,
+//        N = 4, 8 or 16.
+//
+template <unsigned N>
+static inline const bior_ext_table<N> & bior_ext();
+
+template <>
+inline const bior_ext_table<4> & bior_ext<4>()
+{
+    return bior_ext_4;
+}
+
+template <>
+inline const bior_ext_table<8> & bior_ext<8>()
+{
+    return bior_ext_8;
+}
+
+template <>
+inline const bior_ext_table<16> & bior_ext<16>()
+{
+    return bior_ext_16;
+}
+
+//
+// @brief Transpose a N x N patch: dst(j, i) = src(i, j).
+//
+template <unsigned N>
+static inline void transpose_N(float * const src, float * dst)
+{
+    for (unsigned i = 0; i < N; i++)
+        for (unsigned j = 0; j < N; j++)
+            dst[j * N + i] = src[i * N + j];
+}
+
+//
+// @brief One level of the forward Bior1.5 transform applied on the
+//        N_1 first columns of a N x N patch. Columns are processed
+//        together, so that the filtering is done on contiguous memory.
+//
+// @param patch: N x N patch, filtered in place;
+// @param N_1, N_2: size of the current level, and its half;
+// @param ind_per: periodic extension indices for this level;
+// @param lpd, hpd: low and high frequencies forward filters.
+//
+// @return none.
+//
+template <unsigned N>
+static void bior_forward_columns_N(float * patch, const unsigned N_1, const unsigned N_2, const unsigned * const ind_per,
+	float * const lpd, float * const hpd)
+{
+    float tmp[(N + 2 * BIOR_S_2) * N];
+    const unsigned tmp_size = N_1 + 2 * BIOR_S_2;
+
+    // Periodic extension of the signal in column
+    for (unsigned i = 0; i < tmp_size; i++)
+        for (unsigned j = 0; j < N_1; j++)
+            tmp[i * N + j] = patch[ind_per[i] * N + j];
+
+    // Low and High frequencies filtering
+    for (unsigned i = 0; i < N_2; i++)
+    {
+        unsigned j = 0;
+#ifdef __SR_USE_SIMD
+        for (; j + 4 <= N_1; j += 4)
+        {
+            __m128 vec_l = _mm_setzero_ps();
+            __m128 vec_h = _mm_setzero_ps();
+            for (unsigned k = 0; k < BIOR_S_1; k++)
+            {
+                const __m128 vec_x = _mm_loadu_ps(tmp + (k + i * 2) * N + j);
+                vec_l = _mm_add_ps(vec_l, _mm_mul_ps(vec_x, _mm_set1_ps(lpd[k])));
+                vec_h = _mm_add_ps(vec_h, _mm_mul_ps(vec_x, _mm_set1_ps(hpd[k])));
+            }
+            _mm_storeu_ps(patch + i * N + j, vec_l);
+            _mm_storeu_ps(patch + (i + N_2) * N + j, vec_h);
+        }
+#endif      // #ifdef __SR_USE_SIMD
+        for (; j < N_1; j++)
+        {
+            float v_l = 0.0f, v_h = 0.0f;
+            for (unsigned k = 0; k < BIOR_S_1; k++)
+            {
+                v_l += tmp[(k + i * 2) * N + j] * lpd[k];
+                v_h += tmp[(k + i * 2) * N + j] * hpd[k];
+            }
+            patch[i * N + j] = v_l;
+            patch[(i + N_2) * N + j] = v_h;
+        }
+    }
+}
+
+//
+// @brief One level of the inverse Bior1.5 transform applied on the
+//        N_1 first columns of a N x N patch.
+//
+// @param patch: N x N patch, filtered in place;
+// @param N_1, N_2: size of the current level, and its half;
+// @param ind_per: periodic extension indices for this level;
+// @param lpr, hpr: low and high frequencies inverse filters.
+//
+// @return none.
+//
+template <unsigned N>
+static void bior_inverse_columns_N(float * patch, const unsigned N_1, const unsigned N_2, const unsigned * const ind_per,
+	float * const lpr, float * const hpr)
+{
+    float tmp[(1 + BIOR_S_2) * N * N];
+    const unsigned tmp_size = N_1 + BIOR_S_2 * N_1;
+
+    // Periodic extension of the signal in column
+    for (unsigned i = 0; i < tmp_size; i++)
+        for (unsigned j = 0; j < N_1; j++)
+            tmp[i * N + j] = patch[ind_per[i] * N + j];
+
+    // Low and High frequencies filtering
+    for (unsigned i = 0; i < N_2; i++)
+    {
+        unsigned j = 0;
+#ifdef __SR_USE_SIMD
+        for (; j + 4 <= N_1; j += 4)
+        {
+            __m128 vec_l = _mm_setzero_ps();
+            __m128 vec_h = _mm_setzero_ps();
+            for (unsigned k = 0; k < BIOR_S_1; k++)
+            {
+                const __m128 vec_x = _mm_loadu_ps(tmp + (k * N_2 + i) * N + j);
+                vec_l = _mm_add_ps(vec_l, _mm_mul_ps(_mm_set1_ps(lpr[k]), vec_x));
+                vec_h = _mm_add_ps(vec_h, _mm_mul_ps(_mm_set1_ps(hpr[k]), vec_x));
+            }
+            _mm_storeu_ps(patch + i * 2 * N + j, vec_h);
+            _mm_storeu_ps(patch + (i * 2 + 1) * N + j, vec_l);
+        }
+#endif      // #ifdef __SR_USE_SIMD
+        for (; j < N_1; j++)
+        {
+            float v_l = 0.0f, v_h = 0.0f;
+            for (unsigned k = 0; k < BIOR_S_1; k++)
+            {
+                v_l += lpr[k] * tmp[(k * N_2 + i) * N + j];
+                v_h += hpr[k] * tmp[(k * N_2 + i) * N + j];
+            }
+            patch[i * 2 * N + j] = v_h;
+            patch[(i * 2 + 1) * N + j] = v_l;
+        }
+    }
+}
+
+//
+// @brief Bior1.5 2D forward transform specialised for N x N patches.
+//        Same arithmetic as the generic bior_2d_forward(), without any
+//        allocation. The row filtering is done as a column filtering
+//        of the transposed patch.
+//
+template <unsigned N>
+static void bior_2d_forward_N(float * const input, float * output, const unsigned d_i, const unsigned r_i, const unsigned d_o,
+	float * const lpd, float * const hpd)
+{
+    const bior_ext_table<N> & ext = bior_ext<N>();
+    float patch_t[N * N];
+    float * patch = output + d_o;
+
+    // Initializing output
+    for (unsigned i = 0; i < N; i++)
+        for (unsigned j = 0; j < N; j++)
+            patch[i * N + j] = input[i * r_i + j + d_i];
+
+    unsigned N_1 = N;
+    unsigned N_2 = N / 2;
+    for (unsigned iter = 0; N_2 > 0; iter++)
+    {
+        // Row filtering
+        transpose_N<N>(patch, patch_t);
+        bior_forward_columns_N<N>(patch_t, N_1, N_2, ext.fwd[iter], lpd, hpd);
+        transpose_N<N>(patch_t, patch);
+
+        // Column filtering
+        bior_forward_columns_N<N>(patch, N_1, N_2, ext.fwd[iter], lpd, hpd);
+
+        // Sizes update
+        N_1 /= 2;
+        N_2 /= 2;
+    }
+}
+
+//
+// @brief Bior1.5 2D inverse transform specialised for N x N patches.
+//        Same arithmetic as the generic bior_2d_inverse(), without any
+//        allocation.
+//
+template <unsigned N>
+static void bior_2d_inverse_N(float * signal, const unsigned d_s, float * const lpr, float * const hpr)
+{
+    const bior_ext_table<N> & ext = bior_ext<N>();
+    float patch_t[N * N];
+    float * patch = signal + d_s;
+
+    unsigned N_1 = 2;
+    unsigned N_2 = 1;
+    for (unsigned iter = 0; N_1 <= N; iter++)
+    {
+        // Column filtering
+        bior_inverse_columns_N<N>(patch, N_1, N_2, ext.inv[iter], lpr, hpr);
+
+        // Row filtering
+        transpose_N<N>(patch, patch_t);
+        bior_inverse_columns_N<N>(patch_t, N_1, N_2, ext.inv[iter], lpr, hpr);
+        transpose_N<N>(patch_t, patch);
+
+        // Sizes update
+        N_1 *= 2;
+        N_2 *= 2;
+    }
+}
+
 // @brief Compute a full 2D Bior 1.5 spline wavelet (normalized)
 //
 // @param input: vector on which the transform will be applied;
@@ -43,6 +414,23 @@ using namespace std;
 void bior_2d_forward(float * const input, float * output, const unsigned N, const unsigned d_i, const unsigned r_i, const unsigned d_o, 
 	float * const lpd, float * const hpd)
 {
+    // Specialised kernels for the usual patch sizes
+    if (N == 8)
+    {
+        bior_2d_forward_N<8>(input, output, d_i, r_i, d_o, lpd, hpd);
+        return;
+    }
+    else if (N == 4)
+    {
+        bior_2d_forward_N<4>(input, output, d_i, r_i, d_o, lpd, hpd);
+        return;
+    }
+    else if (N == 16)
+    {
+        bior_2d_forward_N<16>(input, output, d_i, r_i, d_o, lpd, hpd);
+        return;
+    }
+
     // Initializing output
     for (unsigned i = 0; i < N; i++)
         for (unsigned j = 0; j < N; j++)
@@ -147,6 +535,23 @@ void bior_2d_forward(float * const input, float * output, const unsigned N, cons
 //
 void bior_2d_inverse(float * signal, const unsigned N, const unsigned d_s, float * const lpr, float * const hpr)
 {
+    // Specialised kernels for the usual patch sizes
+    if (N == 8)
+    {
+        bior_2d_inverse_N<8>(signal, d_s, lpr, hpr);
+        return;
+    }
+    else if (N == 4)
+    {
+        bior_2d_inverse_N<4>(signal, d_s, lpr, hpr);
+        return;
+    }
+    else if (N == 16)
+    {
+        bior_2d_inverse_N<16>(signal, d_s, lpr, hpr);
+        return;
+    }
+
     // Initialization
     const unsigned iter_max = log2(N);
     unsigned N_1 = 2;
@@ -342,6 +747,244 @@ void hadamard_transform(float * vec, float * tmp, const unsigned N, const unsign
     }
 }
 
+//
+// @brief Apply Welsh-Hadamard transform (non normalized !!) on N rows of
+//        L coefficients, along the rows: for each l < L, the transform
+//        is applied on vec[l], vec[l + L], ..., vec[l + (N - 1) * L].
+//        Same butterflies as hadamard_transform(), but each one is
+//        applied on a whole row, so the inner loops are contiguous.
+//
+// @param vec: N rows of L coefficients. Will contain the transforms at
+//        the end;
+// @param tmp: allocated vector of size N / 2 * L, used for convenience;
+// @param N: number of rows. N must be a power of 2!!!!
+// @param L: length of the rows.
+//
+// @return None.
+//
+void hadamard_transform_rows(float * vec, float * tmp, const unsigned N, const unsigned L)
+{
+    if (N == 1)
+        return;
+    else if (N == 2)
+    {
+        for (unsigned l = 0; l < L; l++)
+        {
+            const float a = vec[l];
+            const float b = vec[L + l];
+            vec[l] = a + b;
+            vec[L + l] = a - b;
+        }
+    }
+    else
+    {
+        const unsigned n = N / 2;
+        for (unsigned k = 0; k < n; k++)
+            for (unsigned l = 0; l < L; l++)
+            {
+                const float a = vec[2 * k * L + l];
+                const float b = vec[(2 * k + 1) * L + l];
+                vec[k * L + l] = a + b;
+                tmp[k * L + l] = a - b;
+            }
+        for (unsigned k = 0; k < n * L; k++)
+            vec[n * L + k] = tmp[k];
+
+        hadamard_transform_rows(vec, tmp, n, L);
+        hadamard_transform_rows(vec + n * L, tmp, n, L);
+    }
+}
+
+//
+// @brief Same as hadamard_transform_rows() for a number of rows N known
+//        at compile time, so the recursion is resolved by the compiler.
+//
+// @param vec: N rows of L coefficients (in place);
+// @param tmp: allocated vector of size N / 2 * L;
+// @param L: length of the rows.
+//
+// @return None.
+//
+template <>
+void hadamard_transform_rows_N<1>(float *, float *, const unsigned)
+{
+}
+
+template <>
+void hadamard_transform_rows_N<2>(float * vec, float *, const unsigned L)
+{
+    for (unsigned l = 0; l < L; l++)
+    {
+        const float a = vec[l];
+        const float b = vec[L + l];
+        vec[l] = a + b;
+        vec[L + l] = a - b;
+    }
+}
+
+template <unsigned N>
+void hadamard_transform_rows_N(float * vec, float * tmp, const unsigned L)
+{
+    const unsigned n = N / 2;
+    for (unsigned k = 0; k < n; k++)
+    {
+        const float * a = vec + 2 * k * L;
+        const float * b = a + L;
+        float * s = vec + k * L;
+        float * d = tmp + k * L;
+        for (unsigned l = 0; l < L; l++)
+        {
+            const float x = a[l];
+            const float y = b[l];
+            s[l] = x + y;
+            d[l] = x - y;
+        }
+    }
+    for (unsigned k = 0; k < n * L; k++)
+        vec[n * L + k] = tmp[k];
+
+    hadamard_transform_rows_N<N / 2>(vec, tmp, L);
+    hadamard_transform_rows_N<N / 2>(vec + n * L, tmp, L);
+}
+
+// Sizes of 3D groups used by BM3D
+template void hadamard_transform_rows_N<4>(float * vec, float * tmp, const unsigned L);
+template void hadamard_transform_rows_N<8>(float * vec, float * tmp, const unsigned L);
+template void hadamard_transform_rows_N<16>(float * vec, float * tmp, const unsigned L);
+template void hadamard_transform_rows_N<32>(float * vec, float * tmp, const unsigned L);
+
+//
+// @brief Apply hadamard_transform_rows() on vec_1 and vec_2 in the same
+//        pass: each butterfly is applied on the rows of both groups,
+//        which halves the loop and recursion overhead.
+//
+// @param vec_1, vec_2: N rows of L coefficients each. Will contain the
+//        transforms at the end;
+// @param tmp: allocated vector of size N * L, used for convenience;
+// @param N: number of rows. N must be a power of 2!!!!
+// @param L: length of the rows.
+//
+// @return None.
+//
+void hadamard_transform_rows_2(float * vec_1, float * vec_2, float * tmp, const unsigned N, const unsigned L)
+{
+    if (N == 1)
+        return;
+    else if (N == 2)
+    {
+        for (unsigned l = 0; l < L; l++)
+        {
+            const float a_1 = vec_1[l];
+            const float b_1 = vec_1[L + l];
+            const float a_2 = vec_2[l];
+            const float b_2 = vec_2[L + l];
+            vec_1[l] = a_1 + b_1;
+            vec_1[L + l] = a_1 - b_1;
+            vec_2[l] = a_2 + b_2;
+            vec_2[L + l] = a_2 - b_2;
+        }
+    }
+    else
+    {
+        const unsigned n = N / 2;
+        float * tmp_2 = tmp + n * L;
+        for (unsigned k = 0; k < n; k++)
+            for (unsigned l = 0; l < L; l++)
+            {
+                const float a_1 = vec_1[2 * k * L + l];
+                const float b_1 = vec_1[(2 * k + 1) * L + l];
+                const float a_2 = vec_2[2 * k * L + l];
+                const float b_2 = vec_2[(2 * k + 1) * L + l];
+                vec_1[k * L + l] = a_1 + b_1;
+                tmp[k * L + l] = a_1 - b_1;
+                vec_2[k * L + l] = a_2 + b_2;
+                tmp_2[k * L + l] = a_2 - b_2;
+            }
+        for (unsigned k = 0; k < n * L; k++)
+        {
+            vec_1[n * L + k] = tmp[k];
+            vec_2[n * L + k] = tmp_2[k];
+        }
+
+        hadamard_transform_rows_2(vec_1, vec_2, tmp, n, L);
+        hadamard_transform_rows_2(vec_1 + n * L, vec_2 + n * L, tmp, n, L);
+    }
+}
+
+//
+// @brief Same as hadamard_transform_rows_2() for a number of rows N
+//        known at compile time, see hadamard_transform_rows_N().
+//
+// @param vec_1, vec_2: N rows of L coefficients each (in place);
+// @param tmp: allocated vector of size N * L;
+// @param L: length of the rows.
+//
+// @return None.
+//
+template <>
+void hadamard_transform_rows_2_N<1>(float *, float *, float *, const unsigned)
+{
+}
+
+template <>
+void hadamard_transform_rows_2_N<2>(float * vec_1, float * vec_2, float *, const unsigned L)
+{
+    for (unsigned l = 0; l < L; l++)
+    {
+        const float a_1 = vec_1[l];
+        const float b_1 = vec_1[L + l];
+        const float a_2 = vec_2[l];
+        const float b_2 = vec_2[L + l];
+        vec_1[l] = a_1 + b_1;
+        vec_1[L + l] = a_1 - b_1;
+        vec_2[l] = a_2 + b_2;
+        vec_2[L + l] = a_2 - b_2;
+    }
+}
+
+template <unsigned N>
+void hadamard_transform_rows_2_N(float * vec_1, float * vec_2, float * tmp, const unsigned L)
+{
+    const unsigned n = N / 2;
+    float * tmp_2 = tmp + n * L;
+    for (unsigned k = 0; k < n; k++)
+    {
+        const float * a_1 = vec_1 + 2 * k * L;
+        const float * b_1 = a_1 + L;
+        const float * a_2 = vec_2 + 2 * k * L;
+        const float * b_2 = a_2 + L;
+        float * s_1 = vec_1 + k * L;
+        float * s_2 = vec_2 + k * L;
+        float * d_1 = tmp + k * L;
+        float * d_2 = tmp_2 + k * L;
+        for (unsigned l = 0; l < L; l++)
+        {
+            const float x_1 = a_1[l];
+            const float y_1 = b_1[l];
+            const float x_2 = a_2[l];
+            const float y_2 = b_2[l];
+            s_1[l] = x_1 + y_1;
+            d_1[l] = x_1 - y_1;
+            s_2[l] = x_2 + y_2;
+            d_2[l] = x_2 - y_2;
+        }
+    }
+    for (unsigned k = 0; k < n * L; k++)
+    {
+        vec_1[n * L + k] = tmp[k];
+        vec_2[n * L + k] = tmp_2[k];
+    }
+
+    hadamard_transform_rows_2_N<N / 2>(vec_1, vec_2, tmp, L);
+    hadamard_transform_rows_2_N<N / 2>(vec_1 + n * L, vec_2 + n * L, tmp, L);
+}
+
+// Sizes of 3D groups used by BM3D
+template void hadamard_transform_rows_2_N<4>(float * vec_1, float * vec_2, float * tmp, const unsigned L);
+template void hadamard_transform_rows_2_N<8>(float * vec_1, float * vec_2, float * tmp, const unsigned L);
+template void hadamard_transform_rows_2_N<16>(float * vec_1, float * vec_2, float * tmp, const unsigned L);
+template void hadamard_transform_rows_2_N<32>(float * vec_1, float * vec_2, float * tmp, const unsigned L);
+
 //
 // @brief Obtain the ceil of log_2(N)
 //
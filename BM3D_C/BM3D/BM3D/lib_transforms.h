@@ -4,6 +4,9 @@
 
 #include<vector>
 
+// Maximum size of the patches handled by the native 2D DCT
+#define DCT_MAX_SIZE 16
+
 // Compute a Bior1.5 2D
 void bior_2d_forward(float * const input, float * output, const unsigned N, const unsigned d_i, const unsigned r_i, const unsigned d_o,
 	float * const lpd, float * const hpd);
@@ -11,12 +14,50 @@ void bior_2d_forward(float * const input, float * output, const unsigned N, cons
 // Compute a Bior1.5 2D inverse
 void bior_2d_inverse(float * signal, const unsigned N, const unsigned d_s, float * const lpr, float * const hpr);
 
+// Compute a DCT-II 2D (orthonormal)
+void dct_2d_forward(float * const input, float * output, const unsigned N, const unsigned d_i, const unsigned r_i, const unsigned d_o,
+	float * const dct_mat);
+
+// Compute a DCT-II 2D inverse (orthonormal)
+void dct_2d_inverse(float * signal, const unsigned N, const unsigned d_s, float * const dct_mat);
+
+// Precompute the DCT-II matrix (normalization included)
+void dct_2d_coef(float * dct_mat, const unsigned N);
+
 // Precompute the Bior1.5 coefficients
 void bior15_coef(float * lp1, float * hp1, float * lp2, float * hp2);
 
 // Apply Walsh-Hadamard transform (non normalized) on a vector of size N = 2^n
 void hadamard_transform(float * vec, float * tmp, const unsigned N, const unsigned d) ;
 
+// Apply Walsh-Hadamard transform (non normalized) along N = 2^n rows of L coefficients
+void hadamard_transform_rows(float * vec, float * tmp, const unsigned N, const unsigned L);
+
+// Same as hadamard_transform_rows() for N known at compile time. Available for
+// N = 1, 2, 4, 8, 16 and 32
+template <unsigned N>
+void hadamard_transform_rows_N(float * vec, float * tmp, const unsigned L);
+
+template <>
+void hadamard_transform_rows_N<1>(float * vec, float * tmp, const unsigned L);
+
+template <>
+void hadamard_transform_rows_N<2>(float * vec, float * tmp, const unsigned L);
+
+// Apply hadamard_transform_rows() on two groups of N = 2^n rows of L coefficients at once
+void hadamard_transform_rows_2(float * vec_1, float * vec_2, float * tmp, const unsigned N, const unsigned L);
+
+// Same as hadamard_transform_rows_2() for N known at compile time. Available for
+// N = 1, 2, 4, 8, 16 and 32
+template <unsigned N>
+void hadamard_transform_rows_2_N(float * vec_1, float * vec_2, float * tmp, const unsigned L);
+
+template <>
+void hadamard_transform_rows_2_N<1>(float * vec_1, float * vec_2, float * tmp, const unsigned L);
+
+template <>
+void hadamard_transform_rows_2_N<2>(float * vec_1, float * vec_2, float * tmp, const unsigned L);
+
 // Process the log2 of N
 unsigned log2(const unsigned N);
 
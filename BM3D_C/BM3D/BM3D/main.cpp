@@ -29,9 +29,82 @@ using namespace std;
 // @author MARC LEBRUN  <marc.lebrun@cmla.ens-cachan.fr>
 //
 
+//
+// @brief Out-of-core mode: denoise a raw planar raster file into another
+//        one with run_bm3d_file(), tile by tile.
+//
+//        BM3D --raw input output width height chnls depth sigma
+//             [--offset bytes] [--mmap] [--budget MB]
+//
+//        depth is 8, 16 or 32 (float); offset is the size of the header
+//        of both files, the one of output is left null.
+//
+// @return EXIT_FAILURE if the arguments are wrong or the rasters can't
+//         be processed, otherwise EXIT_SUCCESS.
+//
+static int main_raw(int argc, char **argv)
+{
+	if (argc < 9)
+	{
+		cout << "usage: " << argv[0] << " --raw input output width height chnls depth sigma"
+			<< " [--offset bytes] [--mmap] [--budget MB]" << endl;
+		return EXIT_FAILURE;
+	}
+	const unsigned int width = (unsigned int)atoi(argv[4]);
+	const unsigned int height = (unsigned int)atoi(argv[5]);
+	const unsigned int chnls = (unsigned int)atoi(argv[6]);
+	const int bits = atoi(argv[7]);
+	const int depth = (bits == 8 ? SR_DEPTH_8U : (bits == 16 ? SR_DEPTH_16U : (bits == 32 ? SR_DEPTH_32F : 0)));
+	const float fSigma = (float)atof(argv[8]);
+	unsigned long long offset = 0;
+	bool map = false;
+	size_t budget = 0;
+	for (int k = 9; k < argc; k++)
+	{
+		if (!strcmp(argv[k], "--offset") && k + 1 < argc)
+			offset = strtoul(argv[++k], NULL, 10);
+		else if (!strcmp(argv[k], "--mmap"))
+			map = true;
+		else if (!strcmp(argv[k], "--budget") && k + 1 < argc)
+			budget = (size_t)(atof(argv[++k]) * 1048576.0);
+		else
+		{
+			cout << "Unknown option " << argv[k] << endl;
+			return EXIT_FAILURE;
+		}
+	}
+	if (!width || !height || (chnls != 1 && chnls != 3) || !depth || !(fSigma > 0.0f))
+	{
+		cout << "Wrong size, depth or sigma of the raster!!" << endl;
+		return EXIT_FAILURE;
+	}
+
+	RasterFile input, output;
+	int status = EXIT_FAILURE;
+	if (raster_open(input, argv[2], false, map, width, height, chnls, depth, offset)
+		&& raster_open(output, argv[3], true, map, width, height, chnls, depth, offset))
+	{
+		cout << endl << "Denoise parameter [sigma = " << fSigma << "] ...\n";
+		status = run_bm3d_file(input, output, fSigma, budget);
+	}
+	if (!raster_close(input))
+		status = EXIT_FAILURE;
+	if (!raster_close(output))
+		status = EXIT_FAILURE;
+
+#ifdef _BM3D_USE_FFTW
+	// Release the FFTW plans (the wisdom is kept in its file)
+	plan_cache_clear();
+#endif      // #ifdef _BM3D_USE_FFTW
+
+	return status;
+}
 
 int main(int argc, char **argv)
 {
+	if (argc > 1 && !strcmp(argv[1], "--raw"))
+		return main_raw(argc, argv);
+
 	argv[0] = "BM3D";
 	argv[1] = "test.jpg";
 	argv[2] = "10";
@@ -55,6 +128,19 @@ int main(int argc, char **argv)
 	//if (save_image(argv[3], iplImage_denoised) != EXIT_SUCCESS)
 	//	return EXIT_FAILURE;
     CImageUtility::saveImage(argv[3], iplImage_denoised, 0, 1, 8);
+	CImageUtility::safeReleaseImage(&iplImage, &iplImage_denoised);
+
+	// Images reused from the pool by run_bm3d
+	unsigned long long pool_hits, pool_misses;
+	size_t pool_bytes;
+	CImageUtility::getImagePoolStats(pool_hits, pool_misses, pool_bytes);
+	cout << "image pool: " << pool_hits << " hits, " << pool_misses << " misses" << endl;
+	CImageUtility::resetImagePool();
+
+#ifdef _BM3D_USE_FFTW
+	// Release the FFTW plans (the wisdom is kept in its file)
+	plan_cache_clear();
+#endif      // #ifdef _BM3D_USE_FFTW
 
     //system("pause");
 	return 0;
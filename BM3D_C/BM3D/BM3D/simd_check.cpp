@@ -0,0 +1,318 @@
+/**
+ * @file simd_check.cpp
+ * @brief Check of the kernels of every instruction set supported by the
+ *        CPU against the generic code of bm3d.cpp, on rows of 1 to
+ *        CHECK_N_MAX values. Built and run by `make check`
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "simd_kernels.h"
+
+#define CHECK_N_MAX  69
+#define CHECK_SIZE   (3 * CHECK_N_MAX + 8)    // buffers, with a margin checked for overruns
+
+// Matrices of the OPP color space and of its inverse, see
+// color_space_matrix()
+static const float opp[9] = { 0.333f, 0.333f, 0.333f, 0.500f, 0.000f, -0.500f, 0.250f, -0.500f, 0.250f };
+static const float opp_inv[9] = { 1.0f, 1.0f, 0.666f, 1.0f, 0.0f, -1.333f, 1.0f, -1.0f, 0.666f };
+static const float identity[9] = { 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f };
+
+//
+// @brief Random value in [lo, hi).
+//
+static float random_float(const float lo, const float hi)
+{
+    return lo + (hi - lo) * (float)rand() / ((float)RAND_MAX + 1.0f);
+}
+
+//
+// @brief Fill a buffer with random values in [lo, hi).
+//
+static void random_fill(float * buf, const unsigned size, const float lo, const float hi)
+{
+    for (unsigned k = 0; k < size; k++)
+        buf[k] = random_float(lo, hi);
+}
+
+//
+// @brief Report a kernel whose result differs from the generic code.
+//
+// @return 1, the number of failures to add.
+//
+static unsigned check_fail(const unsigned isa, const char * kernel, const unsigned N)
+{
+    printf("%s: %s differs from the generic code for N = %u\n", simd_isa_name(isa), kernel, N);
+    return 1;
+}
+
+//
+// @brief Relative difference within tol, for the kernels which divide
+//        with an approximate reciprocal.
+//
+static bool check_close(const float a, const float b, const float tol)
+{
+    return fabs(a - b) <= tol * fabs(b) + 1e-30f;
+}
+
+//
+// @brief Hard thresholding and scaling, generic code of ht_threshold_scale().
+//
+static unsigned ht_threshold_scale_ref(float * vec, const unsigned N, const float T, const float coef)
+{
+    unsigned nb = 0;
+    for (unsigned k = 0; k < N; k++)
+    {
+        const bool keep = fabs(vec[k]) > T;
+        vec[k] = (keep ? vec[k] * coef : 0.0f);
+        nb += keep;
+    }
+    return nb;
+}
+
+//
+// @brief Wiener shrinkage, generic code of wiener_shrink().
+//
+static float wiener_shrink_ref(float * const img, float * est, const unsigned N, const float sigma_2, const float coef)
+{
+    float weight = 0.0f;
+    for (unsigned k = 0; k < N; k++)
+    {
+        float value = est[k] * est[k] * coef;
+        value /= (value + sigma_2);
+        est[k] = img[k] * value * coef;
+        weight += value;
+    }
+    return weight;
+}
+
+//
+// @brief Ingest of a row of 3 channels, generic code of ingest_row().
+//
+template <class T>
+static void ingest_row_ref(const T * src, float * plane_0, float * plane_1, float * plane_2, const float * mat,
+    const unsigned N)
+{
+    for (unsigned k = 0; k < N; k++)
+    {
+        const float red = (float)src[3 * k + 2];
+        const float green = (float)src[3 * k + 1];
+        const float blue = (float)src[3 * k];
+        plane_0[k] = mat[0] * red + mat[1] * green + mat[2] * blue;
+        plane_1[k] = mat[3] * red + mat[4] * green + mat[5] * blue;
+        plane_2[k] = mat[6] * red + mat[7] * green + mat[8] * blue;
+    }
+}
+
+//
+// @brief Egress of a row of 3 channels, generic code of egress_row().
+//
+template <class T>
+static void egress_row_ref(const float * plane_0, const float * plane_1, const float * plane_2, T * dst,
+    const float * mat, const float max_value, const bool round, const unsigned N)
+{
+    const float offset = (round ? 0.5f : 0.0f);
+    for (unsigned k = 0; k < N; k++)
+    {
+        const float value[3] = { plane_0[k], plane_1[k], plane_2[k] };
+        for (unsigned c = 0; c < 3; c++)
+        {
+            float pix = mat[3 * c] * value[0] + mat[3 * c + 1] * value[1] + mat[3 * c + 2] * value[2];
+            pix = (pix > max_value ? max_value : (pix < 0.0f ? 0.0f : pix));
+            dst[3 * k + 2 - c] = (T)(pix + offset);
+        }
+    }
+}
+
+//
+// @brief Check the kernels of the 3D filtering: thresholding is exact,
+//        the Wiener shrinkage within the error of its reciprocal.
+//
+static unsigned check_filtering(const unsigned isa, const simd_kernels & kernels, const unsigned N)
+{
+    unsigned fails = 0;
+    float vec[CHECK_SIZE], ref[CHECK_SIZE];
+
+    if (kernels.ht_threshold_scale)
+    {
+        random_fill(vec, CHECK_SIZE, -100.0f, 100.0f);
+        memcpy(ref, vec, sizeof(vec));
+        const unsigned nb = kernels.ht_threshold_scale(vec, N, 40.0f, 0.125f);
+        if (nb != ht_threshold_scale_ref(ref, N, 40.0f, 0.125f) || memcmp(vec, ref, sizeof(vec)))
+            fails += check_fail(isa, "ht_threshold_scale", N);
+    }
+
+    if (kernels.wiener_shrink)
+    {
+        float img[CHECK_SIZE];
+        random_fill(img, CHECK_SIZE, -100.0f, 100.0f);
+        random_fill(vec, CHECK_SIZE, -100.0f, 100.0f);
+        memcpy(ref, vec, sizeof(vec));
+        const float weight = kernels.wiener_shrink(img, vec, N, 400.0f, 0.25f);
+        bool same = check_close(weight, wiener_shrink_ref(img, ref, N, 400.0f, 0.25f), 1e-5f);
+        for (unsigned k = 0; k < CHECK_SIZE; k++)
+            same = same && check_close(vec[k], ref[k], 1e-5f);
+        if (!same)
+            fails += check_fail(isa, "wiener_shrink", N);
+    }
+
+    return fails;
+}
+
+//
+// @brief Check the kernels of the block matching and of the aggregation,
+//        which must give the results of the generic code exactly.
+//
+static unsigned check_aggregation(const unsigned isa, const simd_kernels & kernels, const unsigned N)
+{
+    unsigned fails = 0;
+    float a[CHECK_SIZE], b[CHECK_SIZE], out[CHECK_SIZE], ref[CHECK_SIZE];
+
+    if (kernels.square_diff)
+    {
+        random_fill(a, CHECK_SIZE, 0.0f, 255.0f);
+        random_fill(b, CHECK_SIZE, 0.0f, 255.0f);
+        random_fill(out, CHECK_SIZE, 0.0f, 1.0f);
+        memcpy(ref, out, sizeof(out));
+        kernels.square_diff(a, b, out, N);
+        for (unsigned k = 0; k < N; k++)
+            ref[k] = (a[k] - b[k]) * (a[k] - b[k]);
+        if (memcmp(out, ref, sizeof(out)))
+            fails += check_fail(isa, "square_diff", N);
+    }
+
+    if (kernels.aggregate_row)
+    {
+        random_fill(a, CHECK_SIZE, 0.0f, 1.0f);
+        random_fill(b, CHECK_SIZE, -10.0f, 265.0f);
+        random_fill(out, CHECK_SIZE, 0.0f, 1000.0f);
+        memcpy(ref, out, sizeof(out));
+        kernels.aggregate_row(out, a, b, N);
+        for (unsigned q = 0; q < N; q++)
+        {
+            ref[2 * q] += a[q] * b[q];
+            ref[2 * q + 1] += a[q];
+        }
+        if (memcmp(out, ref, sizeof(out)))
+            fails += check_fail(isa, "aggregate_row", N);
+    }
+
+    if (kernels.aggregate_divide)
+    {
+        // Accumulators, a quarter of them reached by no patch
+        random_fill(a, CHECK_SIZE, 0.0f, 1000.0f);
+        for (unsigned k = 1; k < CHECK_SIZE; k += 2)
+            if (rand() % 4 == 0)
+                a[k] = 0.0f;
+        random_fill(b, CHECK_SIZE, 0.0f, 255.0f);
+        random_fill(out, CHECK_SIZE, 0.0f, 1.0f);
+        memcpy(ref, out, sizeof(out));
+        kernels.aggregate_divide(a, b, out, N);
+        for (unsigned k = 0; k < N; k++)
+            ref[k] = (a[2 * k + 1] == 0.0f ? b[k] : a[2 * k] / a[2 * k + 1]);
+        if (memcmp(out, ref, sizeof(out)))
+            fails += check_fail(isa, "aggregate_divide", N);
+    }
+
+    return fails;
+}
+
+//
+// @brief Check an ingest kernel, which must give the results of the
+//        generic code exactly.
+//
+template <class T>
+static unsigned check_ingest(const unsigned isa, void (*kernel)(const T *, float *, float *, float *, const float *,
+    const unsigned), const char * name, const float max_value, const unsigned N)
+{
+    if (!kernel)
+        return 0;
+
+    T src[CHECK_SIZE];
+    for (unsigned k = 0; k < CHECK_SIZE; k++)
+        src[k] = (T)random_float(0.0f, max_value);
+    float out[3][CHECK_SIZE], ref[3][CHECK_SIZE];
+    for (unsigned c = 0; c < 3; c++)
+        random_fill(out[c], CHECK_SIZE, 0.0f, 1.0f);
+    memcpy(ref, out, sizeof(out));
+
+    kernel(src, out[0], out[1], out[2], opp, N);
+    ingest_row_ref(src, ref[0], ref[1], ref[2], opp, N);
+    return (memcmp(out, ref, sizeof(out)) ? check_fail(isa, name, N) : 0);
+}
+
+//
+// @brief Check an egress kernel, which must give the results of the
+//        generic code exactly: with the inverse OPP matrix on values
+//        out of range, then with the identity on values halfway between
+//        two integers.
+//
+template <class T>
+static unsigned check_egress(const unsigned isa, void (*kernel)(const float *, const float *, const float *, T *,
+    const float *, const unsigned), const char * name, const float max_value, const bool round, const unsigned N)
+{
+    if (!kernel)
+        return 0;
+
+    unsigned fails = 0;
+    float src[3][CHECK_SIZE];
+    T out[CHECK_SIZE], ref[CHECK_SIZE];
+    for (unsigned pass = 0; pass < 2; pass++)
+    {
+        for (unsigned c = 0; c < 3; c++)
+            for (unsigned k = 0; k < CHECK_SIZE; k++)
+                src[c][k] = (pass == 0 ? random_float(-0.1f * max_value, 1.1f * max_value) :
+                    floorf(random_float(0.0f, max_value)) + 0.5f);
+        for (unsigned k = 0; k < CHECK_SIZE; k++)
+            out[k] = ref[k] = (T)(k % 7);
+
+        const float * mat = (pass == 0 ? opp_inv : identity);
+        kernel(src[0], src[1], src[2], out, mat, N);
+        egress_row_ref(src[0], src[1], src[2], ref, mat, max_value, round, N);
+        if (memcmp(out, ref, sizeof(out)))
+            fails += check_fail(isa, name, N);
+    }
+    return fails;
+}
+
+int main()
+{
+    unsigned fails = 0;
+#ifdef BM3D_ISA_X86
+    // Every instruction set up to the one selected for this run
+    srand(1);
+    for (unsigned isa = BM3D_ISA_SSE42; isa <= simd_isa(); isa++)
+    {
+        simd_kernels kernels;
+        memset(&kernels, 0, sizeof(kernels));
+        if (isa == BM3D_ISA_SSE42)
+            simd_kernels_sse42(kernels);
+        else if (isa == BM3D_ISA_AVX2)
+            simd_kernels_avx2(kernels);
+        else
+            simd_kernels_avx512(kernels);
+
+        unsigned isa_fails = 0;
+        for (unsigned N = 1; N <= CHECK_N_MAX; N++)
+        {
+            isa_fails += check_filtering(isa, kernels, N);
+            isa_fails += check_aggregation(isa, kernels, N);
+            isa_fails += check_ingest(isa, kernels.ingest_row_8u, "ingest_row_8u", 255.0f, N);
+            isa_fails += check_ingest(isa, kernels.ingest_row_16u, "ingest_row_16u", 65535.0f, N);
+            isa_fails += check_ingest(isa, kernels.ingest_row_32f, "ingest_row_32f", 255.0f, N);
+            isa_fails += check_egress(isa, kernels.egress_row_8u, "egress_row_8u", 255.0f, true, N);
+            isa_fails += check_egress(isa, kernels.egress_row_16u, "egress_row_16u", 65535.0f, true, N);
+            isa_fails += check_egress(isa, kernels.egress_row_32f, "egress_row_32f", 255.0f, false, N);
+        }
+        printf("%s: %s\n", simd_isa_name(isa), (isa_fails ? "FAILED" : "ok"));
+        fails += isa_fails;
+    }
+#endif      // #ifdef BM3D_ISA_X86
+    if (simd_isa() == BM3D_ISA_GENERIC)
+        printf("generic: no kernel to check\n");
+
+    return (fails ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,187 @@
+/**
+ * @file simd_kernels.cpp
+ * @brief Runtime selection of the instruction set used by the hot
+ *        BM3D kernels
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "simd_kernels.h"
+
+#ifdef BM3D_ISA_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif      // #ifdef _MSC_VER
+#endif      // #ifdef BM3D_ISA_X86
+
+#ifdef BM3D_ISA_X86
+//
+// @brief Execute the cpuid instruction.
+//
+// @param leaf, subleaf : requested leaf and sub-leaf;
+// @param regs : will contain eax, ebx, ecx and edx.
+//
+static void cpuid(const unsigned leaf, const unsigned subleaf, unsigned regs[4])
+{
+#ifdef _MSC_VER
+    int r[4];
+    __cpuidex(r, (int)leaf, (int)subleaf);
+    for (unsigned k = 0; k < 4; k++)
+        regs[k] = (unsigned)r[k];
+#else
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif      // #ifdef _MSC_VER
+}
+
+//
+// @brief Read the XCR0 register, i.e. the register states saved by
+//        the OS. Must only be called if OSXSAVE is set.
+//
+static unsigned xcr0()
+{
+#ifdef _MSC_VER
+    return (unsigned)_xgetbv(0);
+#else
+    unsigned eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return eax;
+#endif      // #ifdef _MSC_VER
+}
+
+//
+// @brief Detect the best instruction set supported by the CPU and the OS.
+//
+static unsigned detect_isa()
+{
+    unsigned regs[4];
+    cpuid(0, 0, regs);
+    const unsigned max_leaf = regs[0];
+    if (max_leaf < 1)
+        return BM3D_ISA_GENERIC;
+
+    cpuid(1, 0, regs);
+    const unsigned ecx_1 = regs[2];
+    const bool sse42 = (ecx_1 >> 20) & 1;
+    const bool fma = (ecx_1 >> 12) & 1;
+    const bool osxsave = (ecx_1 >> 27) & 1;
+    const bool avx = (ecx_1 >> 28) & 1;
+    if (!sse42)
+        return BM3D_ISA_GENERIC;
+
+    // AVX state (xmm and ymm) must be enabled by the OS
+    if (!osxsave || !avx || max_leaf < 7)
+        return BM3D_ISA_SSE42;
+    const unsigned xcr = xcr0();
+    if ((xcr & 0x6) != 0x6)
+        return BM3D_ISA_SSE42;
+
+    cpuid(7, 0, regs);
+    const bool avx2 = (regs[1] >> 5) & 1;
+    const bool avx512f = (regs[1] >> 16) & 1;
+    if (!avx2 || !fma)
+        return BM3D_ISA_SSE42;
+
+    // AVX-512 state (opmask, zmm0-15 upper halves, zmm16-31)
+    if (avx512f && (xcr & 0xe0) == 0xe0)
+        return BM3D_ISA_AVX512;
+
+    return BM3D_ISA_AVX2;
+}
+#endif      // #ifdef BM3D_ISA_X86
+
+//
+// @brief Name of an instruction set.
+//
+// @param isa : one of the BM3D_ISA_* values.
+//
+// @return the name, as accepted by BM3D_ISA_ENV.
+//
+const char * simd_isa_name(const unsigned isa)
+{
+    return (isa == BM3D_ISA_SSE42 ? "sse42" :
+        (isa == BM3D_ISA_AVX2 ? "avx2" :
+        (isa == BM3D_ISA_AVX512 ? "avx512" : "generic")));
+}
+
+//
+// @brief Select the instruction set of this run: the best one supported
+//        by the CPU, unless a lower one is requested through the
+//        environment variable BM3D_ISA_ENV.
+//
+static unsigned select_isa()
+{
+    unsigned isa = BM3D_ISA_GENERIC;
+#ifdef BM3D_ISA_X86
+    isa = detect_isa();
+#endif      // #ifdef BM3D_ISA_X86
+
+    const char * env = getenv(BM3D_ISA_ENV);
+    if (env)
+        for (unsigned k = BM3D_ISA_GENERIC; k <= BM3D_ISA_AVX512; k++)
+            if (!strcmp(env, simd_isa_name(k)))
+            {
+                // An instruction set not supported by the CPU is ignored
+                if (k < isa)
+                    isa = k;
+                break;
+            }
+
+    return isa;
+}
+
+//
+// @brief Fill the table of kernels of an instruction set.
+//
+static simd_kernels select_kernels(const unsigned isa)
+{
+    simd_kernels kernels;
+    memset(&kernels, 0, sizeof(kernels));
+#ifdef BM3D_ISA_X86
+    switch (isa)
+    {
+    case BM3D_ISA_AVX512:
+        simd_kernels_avx512(kernels);
+        break;
+    case BM3D_ISA_AVX2:
+        simd_kernels_avx2(kernels);
+        break;
+    case BM3D_ISA_SSE42:
+        simd_kernels_sse42(kernels);
+        break;
+    default:
+        break;
+    }
+#else
+    (void)isa;
+#endif      // #ifdef BM3D_ISA_X86
+    return kernels;
+}
+
+// Instruction set and kernels selected once, at static initialization,
+// so the OpenMP workers and the contexts of the library only read them
+static const unsigned selected_isa = select_isa();
+static const simd_kernels selected_kernels = select_kernels(selected_isa);
+
+//
+// @brief Instruction set used for this run, see select_isa().
+//
+// @return one of the BM3D_ISA_* values.
+//
+unsigned simd_isa()
+{
+    return selected_isa;
+}
+
+//
+// @brief Kernels of the selected instruction set.
+//
+// @return the table of kernels. Entries are NULL for the generic code.
+//
+const simd_kernels & simd_kernels_get()
+{
+    return selected_kernels;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#ifndef SIMD_KERNELS_H_INCLUDED
+#define SIMD_KERNELS_H_INCLUDED
+
+/**
+ * @file simd_kernels.h
+ * @brief Runtime selection of the instruction set used by the hot
+ *        BM3D kernels
+ **/
+
+// Instruction sets for which the kernels are built
+#define BM3D_ISA_GENERIC  0
+#define BM3D_ISA_SSE42    1
+#define BM3D_ISA_AVX2     2
+#define BM3D_ISA_AVX512   3
+
+// Environment variable used to force an instruction set (generic,
+// sse42, avx2 or avx512). The CPU must support the requested one.
+#define BM3D_ISA_ENV      "BM3D_ISA"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BM3D_ISA_X86
+#endif
+
+// Set of kernels built for one instruction set. A NULL entry means that
+// the generic code has to be used.
+struct simd_kernels
+{
+    // Hard thresholding and scaling, see ht_threshold_scale()
+    unsigned (*ht_threshold_scale)(float * vec, const unsigned N, const float T, const float coef);
+
+    // Wiener shrinkage, see wiener_shrink(), dividing with an approximate
+    // reciprocal refined by one Newton-Raphson step
+    float (*wiener_shrink)(float * const img, float * est, const unsigned N, const float sigma_2,
+        const float coef);
+
+    // Square difference between two rows of pixels: diff[k] = (a[k] - b[k])^2
+    void (*square_diff)(const float * a, const float * b, float * diff, const unsigned N);
+
+    // Aggregation of a row of a patch in interleaved accumulators:
+    // acc[2k] += kaiser[k] * patch[k], acc[2k + 1] += kaiser[k], the Kaiser
+    // window being already weighted by the group
+    void (*aggregate_row)(float * acc, const float * kaiser, const float * patch, const unsigned N);
+
+    // Final division of interleaved accumulators, see aggregate_estimate():
+    // dst[k] = acc[2k] / acc[2k + 1], or fallback[k] if acc[2k + 1] == 0
+    void (*aggregate_divide)(const float * acc, const float * fallback, float * dst, const unsigned N);
+
+    // Ingest of a row of N pixels stored as (blue, green, red): the three
+    // planes of a color space, plane_c[k] = mat[3c] * red + mat[3c + 1] *
+    // green + mat[3c + 2] * blue, one kernel per depth of the pixels
+    void (*ingest_row_8u)(const unsigned char * src, float * plane_0, float * plane_1, float * plane_2,
+        const float * mat, const unsigned N);
+    void (*ingest_row_16u)(const unsigned short * src, float * plane_0, float * plane_1, float * plane_2,
+        const float * mat, const unsigned N);
+    void (*ingest_row_32f)(const float * src, float * plane_0, float * plane_1, float * plane_2,
+        const float * mat, const unsigned N);
+
+    // Egress of a row of N pixels from the three planes of a color space:
+    // red = mat[0] * plane_0 + mat[1] * plane_1 + mat[2] * plane_2, green and
+    // blue with the next rows of mat, clipped to [0, 255] ([0, 65535] for
+    // 16U), rounded for 8U and 16U and stored as (blue, green, red)
+    void (*egress_row_8u)(const float * plane_0, const float * plane_1, const float * plane_2,
+        unsigned char * dst, const float * mat, const unsigned N);
+    void (*egress_row_16u)(const float * plane_0, const float * plane_1, const float * plane_2,
+        unsigned short * dst, const float * mat, const unsigned N);
+    void (*egress_row_32f)(const float * plane_0, const float * plane_1, const float * plane_2,
+        float * dst, const float * mat, const unsigned N);
+};
+
+// Instruction set selected for this run (cpuid and BM3D_ISA_ENV)
+unsigned simd_isa();
+
+// Name of an instruction set
+const char * simd_isa_name(const unsigned isa);
+
+// Kernels of the selected instruction set
+const simd_kernels & simd_kernels_get();
+
+#ifdef BM3D_ISA_X86
+// Kernels built for each instruction set, see simd_kernels_*.cpp
+void simd_kernels_sse42(simd_kernels & kernels);
+void simd_kernels_avx2(simd_kernels & kernels);
+void simd_kernels_avx512(simd_kernels & kernels);
+#endif      // #ifdef BM3D_ISA_X86
+
+#endif // SIMD_KERNELS_H_INCLUDED
@@ -0,0 +1,439 @@
+/**
+ * @file simd_kernels_avx2.cpp
+ * @brief Hot BM3D kernels built for AVX2 and FMA. This file must be
+ *        compiled with AVX2 and FMA enabled (-mavx2 -mfma), see
+ *        simd_kernels.h
+ **/
+
+#include <math.h>
+
+#include "simd_kernels.h"
+
+#ifdef BM3D_ISA_X86
+#include <immintrin.h>
+
+//
+// @brief Sum of the 8 lanes of a vector.
+//
+static inline float hsum_avx2(const __m256 vec)
+{
+    __m128 vec_s = _mm_add_ps(_mm256_castps256_ps128(vec), _mm256_extractf128_ps(vec, 1));
+    vec_s = _mm_hadd_ps(vec_s, vec_s);
+    vec_s = _mm_hadd_ps(vec_s, vec_s);
+    return _mm_cvtss_f32(vec_s);
+}
+
+//
+// @brief Hard thresholding and scaling, see ht_threshold_scale().
+//
+static unsigned ht_threshold_scale_avx2(float * vec, const unsigned N, const float T, const float coef)
+{
+    const __m256 vec_abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    const __m256 vec_T = _mm256_set1_ps(T);
+    const __m256 vec_coef = _mm256_set1_ps(coef);
+    __m256i vec_nb = _mm256_setzero_si256();
+    unsigned k = 0;
+    for (; k + 8 <= N; k += 8)
+    {
+        const __m256 vec_x = _mm256_loadu_ps(vec + k);
+        const __m256 vec_keep = _mm256_cmp_ps(_mm256_and_ps(vec_x, vec_abs_mask), vec_T, _CMP_GT_OQ);
+        _mm256_storeu_ps(vec + k, _mm256_and_ps(_mm256_mul_ps(vec_x, vec_coef), vec_keep));
+        vec_nb = _mm256_sub_epi32(vec_nb, _mm256_castps_si256(vec_keep));
+    }
+    __m128i vec_nb_s = _mm_add_epi32(_mm256_castsi256_si128(vec_nb), _mm256_extracti128_si256(vec_nb, 1));
+    vec_nb_s = _mm_hadd_epi32(vec_nb_s, vec_nb_s);
+    vec_nb_s = _mm_hadd_epi32(vec_nb_s, vec_nb_s);
+    unsigned nb = (unsigned)_mm_cvtsi128_si32(vec_nb_s);
+
+    for (; k < N; k++)
+    {
+        const bool keep = fabs(vec[k]) > T;
+        vec[k] = (keep ? vec[k] * coef : 0.0f);
+        nb += keep;
+    }
+    return nb;
+}
+
+//
+// @brief Wiener shrinkage, see wiener_shrink(). The division is an
+//        approximate reciprocal refined by one Newton-Raphson step
+//        with FMA.
+//
+static float wiener_shrink_avx2(float * const img, float * est, const unsigned N, const float sigma_2, const float coef)
+{
+    const __m256 vec_coef = _mm256_set1_ps(coef);
+    const __m256 vec_sigma_2 = _mm256_set1_ps(sigma_2);
+    const __m256 vec_const2 = _mm256_set1_ps(2.0f);
+    __m256 vec_weight = _mm256_setzero_ps();
+    unsigned k = 0;
+    for (; k + 8 <= N; k += 8)
+    {
+        const __m256 vec_e = _mm256_loadu_ps(est + k);
+        const __m256 vec_v = _mm256_mul_ps(_mm256_mul_ps(vec_e, vec_e), vec_coef);
+        const __m256 vec_d = _mm256_add_ps(vec_v, vec_sigma_2);
+
+        // 1 / d with one Newton-Raphson step: r = r * (2 - d * r)
+        __m256 vec_r = _mm256_rcp_ps(vec_d);
+        vec_r = _mm256_mul_ps(vec_r, _mm256_fnmadd_ps(vec_d, vec_r, vec_const2));
+
+        const __m256 vec_w = _mm256_mul_ps(vec_v, vec_r);
+        _mm256_storeu_ps(est + k, _mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(img + k), vec_w), vec_coef));
+        vec_weight = _mm256_add_ps(vec_weight, vec_w);
+    }
+    float weight = hsum_avx2(vec_weight);
+
+    for (; k < N; k++)
+    {
+        float value = est[k] * est[k] * coef;
+        value /= (value + sigma_2);
+        est[k] = img[k] * value * coef;
+        weight += value;
+    }
+    return weight;
+}
+
+//
+// @brief Square difference between two rows, see simd_kernels.
+//
+static void square_diff_avx2(const float * a, const float * b, float * diff, const unsigned N)
+{
+    unsigned k = 0;
+    for (; k + 8 <= N; k += 8)
+    {
+        const __m256 vec_d = _mm256_sub_ps(_mm256_loadu_ps(a + k), _mm256_loadu_ps(b + k));
+        _mm256_storeu_ps(diff + k, _mm256_mul_ps(vec_d, vec_d));
+    }
+    for (; k < N; k++)
+        diff[k] = (a[k] - b[k]) * (a[k] - b[k]);
+}
+
+//
+// @brief Aggregation of a row of a patch, see group_aggregate(). The
+//        products and the weights of 8 pixels are interleaved to be
+//        added to the accumulators.
+//
+static void aggregate_row_avx2(float * acc, const float * kaiser, const float * patch, const unsigned N)
+{
+    unsigned k = 0;
+    for (; k + 8 <= N; k += 8)
+    {
+        const __m256 vec_kw = _mm256_loadu_ps(kaiser + k);
+        const __m256 vec_num = _mm256_mul_ps(vec_kw, _mm256_loadu_ps(patch + k));
+
+        // (num, kw) of the pixels 0, 1, 4, 5 and 2, 3, 6, 7
+        const __m256 vec_lo = _mm256_unpacklo_ps(vec_num, vec_kw);
+        const __m256 vec_hi = _mm256_unpackhi_ps(vec_num, vec_kw);
+        _mm256_storeu_ps(acc + 2 * k, _mm256_add_ps(_mm256_loadu_ps(acc + 2 * k),
+            _mm256_permute2f128_ps(vec_lo, vec_hi, 0x20)));
+        _mm256_storeu_ps(acc + 2 * k + 8, _mm256_add_ps(_mm256_loadu_ps(acc + 2 * k + 8),
+            _mm256_permute2f128_ps(vec_lo, vec_hi, 0x31)));
+    }
+    for (; k < N; k++)
+    {
+        acc[2 * k] += kaiser[k] * patch[k];
+        acc[2 * k + 1] += kaiser[k];
+    }
+}
+
+//
+// @brief Final division of interleaved accumulators, see
+//        aggregate_estimate().
+//
+static void aggregate_divide_avx2(const float * acc, const float * fallback, float * dst, const unsigned N)
+{
+    const __m256 vec_zero = _mm256_setzero_ps();
+    unsigned k = 0;
+    for (; k + 8 <= N; k += 8)
+    {
+        // Numerators and denominators of the pixels 0, 1, 4, 5, 2, 3, 6, 7,
+        // put back in order
+        const __m256 vec_a = _mm256_loadu_ps(acc + 2 * k);
+        const __m256 vec_b = _mm256_loadu_ps(acc + 2 * k + 8);
+        const __m256 vec_num = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(
+            _mm256_shuffle_ps(vec_a, vec_b, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+        const __m256 vec_den = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(
+            _mm256_shuffle_ps(vec_a, vec_b, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+        _mm256_storeu_ps(dst + k, _mm256_blendv_ps(_mm256_div_ps(vec_num, vec_den), _mm256_loadu_ps(fallback + k),
+            _mm256_cmp_ps(vec_den, vec_zero, _CMP_EQ_OQ)));
+    }
+    for (; k < N; k++)
+        dst[k] = (acc[2 * k + 1] == 0.0f ? fallback[k] : acc[2 * k] / acc[2 * k + 1]);
+}
+
+//
+// @brief De-interleave 8 pixels (blue, green, red) loaded in 3 vectors.
+//        The pixel k of a channel is in the lane 3k + c % 8 of one of the
+//        vectors, so two blends gather each channel, and a permutation
+//        puts its pixels in order.
+//
+static inline void deinterleave_avx2(const __m256 vec_a, const __m256 vec_b, const __m256 vec_c,
+    __m256 & vec_blue, __m256 & vec_green, __m256 & vec_red)
+{
+    const __m256i vec_ind_0 = _mm256_setr_epi32(0, 3, 6, 1, 4, 7, 2, 5);
+    const __m256i vec_ind_1 = _mm256_setr_epi32(1, 4, 7, 2, 5, 0, 3, 6);
+    const __m256i vec_ind_2 = _mm256_setr_epi32(2, 5, 0, 3, 6, 1, 4, 7);
+    vec_blue = _mm256_permutevar8x32_ps(_mm256_blend_ps(_mm256_blend_ps(vec_a, vec_b, 0x92), vec_c, 0x24), vec_ind_0);
+    vec_green = _mm256_permutevar8x32_ps(_mm256_blend_ps(_mm256_blend_ps(vec_a, vec_b, 0x24), vec_c, 0x49), vec_ind_1);
+    vec_red = _mm256_permutevar8x32_ps(_mm256_blend_ps(_mm256_blend_ps(vec_a, vec_b, 0x49), vec_c, 0x92), vec_ind_2);
+}
+
+//
+// @brief Apply the matrix of a color space on 8 pixels and store the
+//        three planes. The sums are done in the order of the generic
+//        code, so the results are the same.
+//
+static inline void color_store_avx2(const __m256 vec_blue, const __m256 vec_green, const __m256 vec_red,
+    const __m256 * vec_mat, float * plane_0, float * plane_1, float * plane_2)
+{
+    float * planes[3] = { plane_0, plane_1, plane_2 };
+    for (unsigned c = 0; c < 3; c++)
+        _mm256_storeu_ps(planes[c], _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vec_mat[3 * c], vec_red),
+            _mm256_mul_ps(vec_mat[3 * c + 1], vec_green)), _mm256_mul_ps(vec_mat[3 * c + 2], vec_blue)));
+}
+
+//
+// @brief Ingest of the last pixels of a row, see simd_kernels.
+//
+template <class T>
+static inline void ingest_tail(const T * src, float * plane_0, float * plane_1, float * plane_2,
+    const float * mat, const unsigned k_0, const unsigned N)
+{
+    for (unsigned k = k_0; k < N; k++)
+    {
+        const float red = (float)src[3 * k + 2];
+        const float green = (float)src[3 * k + 1];
+        const float blue = (float)src[3 * k];
+        plane_0[k] = mat[0] * red + mat[1] * green + mat[2] * blue;
+        plane_1[k] = mat[3] * red + mat[4] * green + mat[5] * blue;
+        plane_2[k] = mat[6] * red + mat[7] * green + mat[8] * blue;
+    }
+}
+
+//
+// @brief Ingest of a row of 8-bit pixels, see simd_kernels.
+//
+static void ingest_row_8u_avx2(const unsigned char * src, float * plane_0, float * plane_1, float * plane_2,
+    const float * mat, const unsigned N)
+{
+    __m256 vec_mat[9];
+    for (unsigned k = 0; k < 9; k++)
+        vec_mat[k] = _mm256_set1_ps(mat[k]);
+
+    unsigned k = 0;
+    for (; k + 8 <= N; k += 8)
+    {
+        const unsigned char * pix = src + 3 * k;
+        const __m256 vec_a = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)pix)));
+        const __m256 vec_b = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(pix + 8))));
+        const __m256 vec_c = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(pix + 16))));
+        __m256 vec_blue, vec_green, vec_red;
+        deinterleave_avx2(vec_a, vec_b, vec_c, vec_blue, vec_green, vec_red);
+        color_store_avx2(vec_blue, vec_green, vec_red, vec_mat, plane_0 + k, plane_1 + k, plane_2 + k);
+    }
+    ingest_tail(src, plane_0, plane_1, plane_2, mat, k, N);
+}
+
+//
+// @brief Ingest of a row of 16-bit pixels, see simd_kernels.
+//
+static void ingest_row_16u_avx2(const unsigned short * src, float * plane_0, float * plane_1, float * plane_2,
+    const float * mat, const unsigned N)
+{
+    __m256 vec_mat[9];
+    for (unsigned k = 0; k < 9; k++)
+        vec_mat[k] = _mm256_set1_ps(mat[k]);
+
+    unsigned k = 0;
+    for (; k + 8 <= N; k += 8)
+    {
+        const unsigned short * pix = src + 3 * k;
+        const __m256 vec_a = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)pix)));
+        const __m256 vec_b = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(pix + 8))));
+        const __m256 vec_c = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(pix + 16))));
+        __m256 vec_blue, vec_green, vec_red;
+        deinterleave_avx2(vec_a, vec_b, vec_c, vec_blue, vec_green, vec_red);
+        color_store_avx2(vec_blue, vec_green, vec_red, vec_mat, plane_0 + k, plane_1 + k, plane_2 + k);
+    }
+    ingest_tail(src, plane_0, plane_1, plane_2, mat, k, N);
+}
+
+//
+// @brief Ingest of a row of float pixels, see simd_kernels.
+//
+static void ingest_row_32f_avx2(const float * src, float * plane_0, float * plane_1, float * plane_2,
+    const float * mat, const unsigned N)
+{
+    __m256 vec_mat[9];
+    for (unsigned k = 0; k < 9; k++)
+        vec_mat[k] = _mm256_set1_ps(mat[k]);
+
+    unsigned k = 0;
+    for (; k + 8 <= N; k += 8)
+    {
+        const float * pix = src + 3 * k;
+        __m256 vec_blue, vec_green, vec_red;
+        deinterleave_avx2(_mm256_loadu_ps(pix), _mm256_loadu_ps(pix + 8), _mm256_loadu_ps(pix + 16),
+            vec_blue, vec_green, vec_red);
+        color_store_avx2(vec_blue, vec_green, vec_red, vec_mat, plane_0 + k, plane_1 + k, plane_2 + k);
+    }
+    ingest_tail(src, plane_0, plane_1, plane_2, mat, k, N);
+}
+
+//
+// @brief Inverse color transform of 8 pixels from the three planes,
+//        clipped to [0, max_value] and increased by offset. The inverse
+//        of deinterleave_avx2() gives them as (blue, green, red) in 3
+//        vectors. The sums are done in the order of the generic code.
+//
+static inline void color_interleave_avx2(const float * plane_0, const float * plane_1, const float * plane_2,
+    const __m256 * vec_mat, const __m256 vec_max, const __m256 vec_offset, __m256 & vec_a, __m256 & vec_b,
+    __m256 & vec_c)
+{
+    const __m256i vec_ind_0 = _mm256_setr_epi32(0, 3, 6, 1, 4, 7, 2, 5);
+    const __m256i vec_ind_1 = _mm256_setr_epi32(5, 0, 3, 6, 1, 4, 7, 2);
+    const __m256i vec_ind_2 = _mm256_setr_epi32(2, 5, 0, 3, 6, 1, 4, 7);
+    const __m256 vec_0 = _mm256_loadu_ps(plane_0);
+    const __m256 vec_1 = _mm256_loadu_ps(plane_1);
+    const __m256 vec_2 = _mm256_loadu_ps(plane_2);
+    __m256 vec_rgb[3];
+    for (unsigned c = 0; c < 3; c++)
+    {
+        const __m256 vec_pix = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vec_mat[3 * c], vec_0),
+            _mm256_mul_ps(vec_mat[3 * c + 1], vec_1)), _mm256_mul_ps(vec_mat[3 * c + 2], vec_2));
+        vec_rgb[c] = _mm256_add_ps(_mm256_min_ps(_mm256_max_ps(vec_pix, _mm256_setzero_ps()), vec_max), vec_offset);
+    }
+    const __m256 vec_blue = _mm256_permutevar8x32_ps(vec_rgb[2], vec_ind_0);
+    const __m256 vec_green = _mm256_permutevar8x32_ps(vec_rgb[1], vec_ind_1);
+    const __m256 vec_red = _mm256_permutevar8x32_ps(vec_rgb[0], vec_ind_2);
+    vec_a = _mm256_blend_ps(_mm256_blend_ps(vec_blue, vec_green, 0x92), vec_red, 0x24);
+    vec_b = _mm256_blend_ps(_mm256_blend_ps(vec_blue, vec_green, 0x24), vec_red, 0x49);
+    vec_c = _mm256_blend_ps(_mm256_blend_ps(vec_blue, vec_green, 0x49), vec_red, 0x92);
+}
+
+//
+// @brief Egress of the last pixels of a row, see simd_kernels.
+//
+template <class T>
+static inline void egress_tail(const float * plane_0, const float * plane_1, const float * plane_2, T * dst,
+    const float * mat, const float max_value, const float offset, const unsigned k_0, const unsigned N)
+{
+    for (unsigned k = k_0; k < N; k++)
+        for (unsigned c = 0; c < 3; c++)
+        {
+            float pix = mat[3 * c] * plane_0[k] + mat[3 * c + 1] * plane_1[k] + mat[3 * c + 2] * plane_2[k];
+            pix = (pix > max_value ? max_value : (pix < 0.0f ? 0.0f : pix));
+            dst[3 * k + 2 - c] = (T)(pix + offset);
+        }
+}
+
+//
+// @brief Pack 8 pixels of 3 channels, already clipped and rounded, in
+//        24 unsigned 16-bit values: (a, b) in vec_ab and c in vec_c.
+//
+static inline void pack_16u_avx2(const __m256 vec_a, const __m256 vec_b, const __m256 vec_c,
+    __m256i & vec_ab, __m128i & vec_c16)
+{
+    const __m256i vec_c32 = _mm256_cvttps_epi32(vec_c);
+    vec_ab = _mm256_permute4x64_epi64(_mm256_packus_epi32(_mm256_cvttps_epi32(vec_a), _mm256_cvttps_epi32(vec_b)), 0xD8);
+    vec_c16 = _mm_packus_epi32(_mm256_castsi256_si128(vec_c32), _mm256_extracti128_si256(vec_c32, 1));
+}
+
+//
+// @brief Egress of a row of 8-bit pixels, see simd_kernels.
+//
+static void egress_row_8u_avx2(const float * plane_0, const float * plane_1, const float * plane_2,
+    unsigned char * dst, const float * mat, const unsigned N)
+{
+    __m256 vec_mat[9];
+    for (unsigned k = 0; k < 9; k++)
+        vec_mat[k] = _mm256_set1_ps(mat[k]);
+    const __m256 vec_max = _mm256_set1_ps(255.0f);
+    const __m256 vec_offset = _mm256_set1_ps(0.5f);
+
+    unsigned k = 0;
+    for (; k + 8 <= N; k += 8)
+    {
+        __m256 vec_a, vec_b, vec_c;
+        color_interleave_avx2(plane_0 + k, plane_1 + k, plane_2 + k, vec_mat, vec_max, vec_offset,
+            vec_a, vec_b, vec_c);
+        __m256i vec_ab;
+        __m128i vec_c16;
+        pack_16u_avx2(vec_a, vec_b, vec_c, vec_ab, vec_c16);
+        _mm_storeu_si128((__m128i *)(dst + 3 * k), _mm_packus_epi16(_mm256_castsi256_si128(vec_ab),
+            _mm256_extracti128_si256(vec_ab, 1)));
+        _mm_storel_epi64((__m128i *)(dst + 3 * k + 16), _mm_packus_epi16(vec_c16, vec_c16));
+    }
+    egress_tail(plane_0, plane_1, plane_2, dst, mat, 255.0f, 0.5f, k, N);
+}
+
+//
+// @brief Egress of a row of 16-bit pixels, see simd_kernels.
+//
+static void egress_row_16u_avx2(const float * plane_0, const float * plane_1, const float * plane_2,
+    unsigned short * dst, const float * mat, const unsigned N)
+{
+    __m256 vec_mat[9];
+    for (unsigned k = 0; k < 9; k++)
+        vec_mat[k] = _mm256_set1_ps(mat[k]);
+    const __m256 vec_max = _mm256_set1_ps(65535.0f);
+    const __m256 vec_offset = _mm256_set1_ps(0.5f);
+
+    unsigned k = 0;
+    for (; k + 8 <= N; k += 8)
+    {
+        __m256 vec_a, vec_b, vec_c;
+        color_interleave_avx2(plane_0 + k, plane_1 + k, plane_2 + k, vec_mat, vec_max, vec_offset,
+            vec_a, vec_b, vec_c);
+        __m256i vec_ab;
+        __m128i vec_c16;
+        pack_16u_avx2(vec_a, vec_b, vec_c, vec_ab, vec_c16);
+        _mm256_storeu_si256((__m256i *)(dst + 3 * k), vec_ab);
+        _mm_storeu_si128((__m128i *)(dst + 3 * k + 16), vec_c16);
+    }
+    egress_tail(plane_0, plane_1, plane_2, dst, mat, 65535.0f, 0.5f, k, N);
+}
+
+//
+// @brief Egress of a row of float pixels, see simd_kernels.
+//
+static void egress_row_32f_avx2(const float * plane_0, const float * plane_1, const float * plane_2,
+    float * dst, const float * mat, const unsigned N)
+{
+    __m256 vec_mat[9];
+    for (unsigned k = 0; k < 9; k++)
+        vec_mat[k] = _mm256_set1_ps(mat[k]);
+    const __m256 vec_max = _mm256_set1_ps(255.0f);
+    const __m256 vec_offset = _mm256_setzero_ps();
+
+    unsigned k = 0;
+    for (; k + 8 <= N; k += 8)
+    {
+        __m256 vec_a, vec_b, vec_c;
+        color_interleave_avx2(plane_0 + k, plane_1 + k, plane_2 + k, vec_mat, vec_max, vec_offset,
+            vec_a, vec_b, vec_c);
+        _mm256_storeu_ps(dst + 3 * k, vec_a);
+        _mm256_storeu_ps(dst + 3 * k + 8, vec_b);
+        _mm256_storeu_ps(dst + 3 * k + 16, vec_c);
+    }
+    egress_tail(plane_0, plane_1, plane_2, dst, mat, 255.0f, 0.0f, k, N);
+}
+
+//
+// @brief Fill the table with the AVX2 kernels.
+//
+void simd_kernels_avx2(simd_kernels & kernels)
+{
+    kernels.ht_threshold_scale = ht_threshold_scale_avx2;
+    kernels.wiener_shrink = wiener_shrink_avx2;
+    kernels.square_diff = square_diff_avx2;
+    kernels.aggregate_row = aggregate_row_avx2;
+    kernels.aggregate_divide = aggregate_divide_avx2;
+    kernels.ingest_row_8u = ingest_row_8u_avx2;
+    kernels.ingest_row_16u = ingest_row_16u_avx2;
+    kernels.ingest_row_32f = ingest_row_32f_avx2;
+    kernels.egress_row_8u = egress_row_8u_avx2;
+    kernels.egress_row_16u = egress_row_16u_avx2;
+    kernels.egress_row_32f = egress_row_32f_avx2;
+}
+
+#endif      // #ifdef BM3D_ISA_X86
@@ -0,0 +1,180 @@
+/**
+ * @file simd_kernels_avx512.cpp
+ * @brief Hot BM3D kernels built for AVX-512F. This file must be compiled
+ *        with AVX-512F enabled (-mavx512f), see simd_kernels.h
+ **/
+
+#include "simd_kernels.h"
+
+// Visual Studio supports AVX-512 intrinsics from VS2017 15.3
+#if defined(BM3D_ISA_X86) && (!defined(_MSC_VER) || _MSC_VER >= 1911)
+#define BM3D_ISA_AVX512_BUILD
+#endif
+
+#ifdef BM3D_ISA_AVX512_BUILD
+#include <immintrin.h>
+
+//
+// @brief Mask of the n first lanes of a vector (n <= 16).
+//
+static inline __mmask16 lanes_avx512(const unsigned n)
+{
+    return (__mmask16)((1u << n) - 1);
+}
+
+//
+// @brief Sum of the 16 lanes of a vector.
+//
+static inline float hsum_avx512(const __m512 vec)
+{
+    float lanes[16];
+    _mm512_storeu_ps(lanes, vec);
+    float sum = 0.0f;
+    for (unsigned k = 0; k < 16; k++)
+        sum += lanes[k];
+    return sum;
+}
+
+//
+// @brief Hard thresholding and scaling, see ht_threshold_scale(). The
+//        last lanes are processed with masks.
+//
+static unsigned ht_threshold_scale_avx512(float * vec, const unsigned N, const float T, const float coef)
+{
+    const __m512 vec_T = _mm512_set1_ps(T);
+    const __m512 vec_coef = _mm512_set1_ps(coef);
+    const __m512 vec_one = _mm512_set1_ps(1.0f);
+    __m512 vec_nb = _mm512_setzero_ps();
+    for (unsigned k = 0; k < N; k += 16)
+    {
+        const __mmask16 lanes = (k + 16 <= N ? (__mmask16)0xFFFF : lanes_avx512(N - k));
+        const __m512 vec_x = _mm512_maskz_loadu_ps(lanes, vec + k);
+        const __mmask16 keep = _mm512_mask_cmp_ps_mask(lanes, _mm512_abs_ps(vec_x), vec_T, _CMP_GT_OQ);
+        _mm512_mask_storeu_ps(vec + k, lanes, _mm512_maskz_mul_ps(keep, vec_x, vec_coef));
+        vec_nb = _mm512_mask_add_ps(vec_nb, keep, vec_nb, vec_one);
+    }
+    return (unsigned)hsum_avx512(vec_nb);
+}
+
+//
+// @brief Wiener shrinkage, see wiener_shrink(). The last lanes are
+//        processed with masks. The division is an approximate
+//        reciprocal refined by one Newton-Raphson step with FMA.
+//
+static float wiener_shrink_avx512(float * const img, float * est, const unsigned N, const float sigma_2, const float coef)
+{
+    const __m512 vec_coef = _mm512_set1_ps(coef);
+    const __m512 vec_sigma_2 = _mm512_set1_ps(sigma_2);
+    const __m512 vec_const2 = _mm512_set1_ps(2.0f);
+    __m512 vec_weight = _mm512_setzero_ps();
+    for (unsigned k = 0; k < N; k += 16)
+    {
+        const __mmask16 lanes = (k + 16 <= N ? (__mmask16)0xFFFF : lanes_avx512(N - k));
+        const __m512 vec_e = _mm512_maskz_loadu_ps(lanes, est + k);
+        const __m512 vec_v = _mm512_mul_ps(_mm512_mul_ps(vec_e, vec_e), vec_coef);
+        const __m512 vec_d = _mm512_add_ps(vec_v, vec_sigma_2);
+
+        // 1 / d with one Newton-Raphson step: r = r * (2 - d * r)
+        __m512 vec_r = _mm512_rcp14_ps(vec_d);
+        vec_r = _mm512_mul_ps(vec_r, _mm512_fnmadd_ps(vec_d, vec_r, vec_const2));
+
+        const __m512 vec_w = _mm512_mul_ps(vec_v, vec_r);
+        _mm512_mask_storeu_ps(est + k, lanes,
+            _mm512_mul_ps(_mm512_mul_ps(_mm512_maskz_loadu_ps(lanes, img + k), vec_w), vec_coef));
+        vec_weight = _mm512_mask_add_ps(vec_weight, lanes, vec_weight, vec_w);
+    }
+    return hsum_avx512(vec_weight);
+}
+
+//
+// @brief Square difference between two rows, see simd_kernels.
+//
+static void square_diff_avx512(const float * a, const float * b, float * diff, const unsigned N)
+{
+    for (unsigned k = 0; k < N; k += 16)
+    {
+        const __mmask16 lanes = (k + 16 <= N ? (__mmask16)0xFFFF : lanes_avx512(N - k));
+        const __m512 vec_d = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, a + k), _mm512_maskz_loadu_ps(lanes, b + k));
+        _mm512_mask_storeu_ps(diff + k, lanes, _mm512_mul_ps(vec_d, vec_d));
+    }
+}
+
+//
+// @brief Aggregation of a row of a patch, see group_aggregate(). The
+//        products and the weights of 16 pixels are interleaved to be
+//        added to the accumulators.
+//
+static void aggregate_row_avx512(float * acc, const float * kaiser, const float * patch, const unsigned N)
+{
+    const __m512i vec_ind_lo = _mm512_setr_epi32(0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+    const __m512i vec_ind_hi = _mm512_setr_epi32(8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+    for (unsigned k = 0; k < N; k += 16)
+    {
+        // Lanes of the 16 pixels, then of the accumulators of the first
+        // and the last 8 ones
+        const unsigned n = (k + 16 <= N ? 16 : N - k);
+        const __mmask16 lanes = lanes_avx512(n);
+        const __mmask16 lanes_lo = (n >= 8 ? (__mmask16)0xFFFF : lanes_avx512(2 * n));
+        const __mmask16 lanes_hi = (n >= 16 ? (__mmask16)0xFFFF : (n > 8 ? lanes_avx512(2 * (n - 8)) : (__mmask16)0));
+
+        const __m512 vec_kw = _mm512_maskz_loadu_ps(lanes, kaiser + k);
+        const __m512 vec_num = _mm512_mul_ps(vec_kw, _mm512_maskz_loadu_ps(lanes, patch + k));
+        _mm512_mask_storeu_ps(acc + 2 * k, lanes_lo, _mm512_add_ps(_mm512_maskz_loadu_ps(lanes_lo, acc + 2 * k),
+            _mm512_permutex2var_ps(vec_num, vec_ind_lo, vec_kw)));
+        _mm512_mask_storeu_ps(acc + 2 * k + 16, lanes_hi, _mm512_add_ps(_mm512_maskz_loadu_ps(lanes_hi, acc + 2 * k + 16),
+            _mm512_permutex2var_ps(vec_num, vec_ind_hi, vec_kw)));
+    }
+}
+
+//
+// @brief Final division of interleaved accumulators, see
+//        aggregate_estimate().
+//
+static void aggregate_divide_avx512(const float * acc, const float * fallback, float * dst, const unsigned N)
+{
+    const __m512i vec_ind_num = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i vec_ind_den = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+    const __m512 vec_zero = _mm512_setzero_ps();
+    for (unsigned k = 0; k < N; k += 16)
+    {
+        const unsigned n = (k + 16 <= N ? 16 : N - k);
+        const __mmask16 lanes = lanes_avx512(n);
+        const __mmask16 lanes_lo = (n >= 8 ? (__mmask16)0xFFFF : lanes_avx512(2 * n));
+        const __mmask16 lanes_hi = (n >= 16 ? (__mmask16)0xFFFF : (n > 8 ? lanes_avx512(2 * (n - 8)) : (__mmask16)0));
+
+        const __m512 vec_a = _mm512_maskz_loadu_ps(lanes_lo, acc + 2 * k);
+        const __m512 vec_b = _mm512_maskz_loadu_ps(lanes_hi, acc + 2 * k + 16);
+        const __m512 vec_num = _mm512_permutex2var_ps(vec_a, vec_ind_num, vec_b);
+        const __m512 vec_den = _mm512_permutex2var_ps(vec_a, vec_ind_den, vec_b);
+        const __mmask16 zero = _mm512_cmp_ps_mask(vec_den, vec_zero, _CMP_EQ_OQ);
+        _mm512_mask_storeu_ps(dst + k, lanes, _mm512_mask_mov_ps(_mm512_div_ps(vec_num, vec_den), zero,
+            _mm512_maskz_loadu_ps(lanes, fallback + k)));
+    }
+}
+
+//
+// @brief Fill the table with the AVX-512 kernels.
+//
+void simd_kernels_avx512(simd_kernels & kernels)
+{
+    // The kernels without an AVX-512 version are the AVX2 ones
+    simd_kernels_avx2(kernels);
+    kernels.ht_threshold_scale = ht_threshold_scale_avx512;
+    kernels.wiener_shrink = wiener_shrink_avx512;
+    kernels.square_diff = square_diff_avx512;
+    kernels.aggregate_row = aggregate_row_avx512;
+    kernels.aggregate_divide = aggregate_divide_avx512;
+}
+
+#elif defined(BM3D_ISA_X86)
+
+//
+// @brief The compiler can not build the AVX-512 kernels: fall back on
+//        the AVX2 ones.
+//
+void simd_kernels_avx512(simd_kernels & kernels)
+{
+    simd_kernels_avx2(kernels);
+}
+
+#endif      // #ifdef BM3D_ISA_AVX512_BUILD
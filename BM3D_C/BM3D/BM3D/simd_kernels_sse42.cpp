@@ -0,0 +1,153 @@
+/**
+ * @file simd_kernels_sse42.cpp
+ * @brief Hot BM3D kernels built for SSE4.2. This file must be compiled
+ *        with SSE4.2 enabled (-msse4.2), see simd_kernels.h
+ **/
+
+#include <math.h>
+
+#include "simd_kernels.h"
+
+#ifdef BM3D_ISA_X86
+#include <nmmintrin.h>
+
+//
+// @brief Hard thresholding and scaling, see ht_threshold_scale().
+//
+static unsigned ht_threshold_scale_sse42(float * vec, const unsigned N, const float T, const float coef)
+{
+    const __m128 vec_abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 vec_T = _mm_set1_ps(T);
+    const __m128 vec_coef = _mm_set1_ps(coef);
+    __m128i vec_nb = _mm_setzero_si128();
+    unsigned k = 0;
+    for (; k + 4 <= N; k += 4)
+    {
+        const __m128 vec_x = _mm_loadu_ps(vec + k);
+        const __m128 vec_keep = _mm_cmpgt_ps(_mm_and_ps(vec_x, vec_abs_mask), vec_T);
+        _mm_storeu_ps(vec + k, _mm_and_ps(_mm_mul_ps(vec_x, vec_coef), vec_keep));
+        vec_nb = _mm_sub_epi32(vec_nb, _mm_castps_si128(vec_keep));
+    }
+    vec_nb = _mm_hadd_epi32(vec_nb, vec_nb);
+    vec_nb = _mm_hadd_epi32(vec_nb, vec_nb);
+    unsigned nb = (unsigned)_mm_cvtsi128_si32(vec_nb);
+
+    for (; k < N; k++)
+    {
+        const bool keep = fabs(vec[k]) > T;
+        vec[k] = (keep ? vec[k] * coef : 0.0f);
+        nb += keep;
+    }
+    return nb;
+}
+
+//
+// @brief Wiener shrinkage, see wiener_shrink(). The division is an
+//        approximate reciprocal refined by one Newton-Raphson step.
+//
+static float wiener_shrink_sse42(float * const img, float * est, const unsigned N, const float sigma_2, const float coef)
+{
+    const __m128 vec_coef = _mm_set1_ps(coef);
+    const __m128 vec_sigma_2 = _mm_set1_ps(sigma_2);
+    const __m128 vec_const2 = _mm_set1_ps(2.0f);
+    __m128 vec_weight = _mm_setzero_ps();
+    unsigned k = 0;
+    for (; k + 4 <= N; k += 4)
+    {
+        const __m128 vec_e = _mm_loadu_ps(est + k);
+        const __m128 vec_v = _mm_mul_ps(_mm_mul_ps(vec_e, vec_e), vec_coef);
+        const __m128 vec_d = _mm_add_ps(vec_v, vec_sigma_2);
+
+        // 1 / d with one Newton-Raphson step: r = r * (2 - d * r)
+        __m128 vec_r = _mm_rcp_ps(vec_d);
+        vec_r = _mm_mul_ps(vec_r, _mm_sub_ps(vec_const2, _mm_mul_ps(vec_d, vec_r)));
+
+        const __m128 vec_w = _mm_mul_ps(vec_v, vec_r);
+        _mm_storeu_ps(est + k, _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(img + k), vec_w), vec_coef));
+        vec_weight = _mm_add_ps(vec_weight, vec_w);
+    }
+    vec_weight = _mm_hadd_ps(vec_weight, vec_weight);
+    vec_weight = _mm_hadd_ps(vec_weight, vec_weight);
+    float weight = _mm_cvtss_f32(vec_weight);
+
+    for (; k < N; k++)
+    {
+        float value = est[k] * est[k] * coef;
+        value /= (value + sigma_2);
+        est[k] = img[k] * value * coef;
+        weight += value;
+    }
+    return weight;
+}
+
+//
+// @brief Square difference between two rows, see simd_kernels.
+//
+static void square_diff_sse42(const float * a, const float * b, float * diff, const unsigned N)
+{
+    unsigned k = 0;
+    for (; k + 4 <= N; k += 4)
+    {
+        const __m128 vec_d = _mm_sub_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k));
+        _mm_storeu_ps(diff + k, _mm_mul_ps(vec_d, vec_d));
+    }
+    for (; k < N; k++)
+        diff[k] = (a[k] - b[k]) * (a[k] - b[k]);
+}
+
+//
+// @brief Aggregation of a row of a patch, see group_aggregate(). The
+//        products and the weights of 4 pixels are interleaved to be
+//        added to the accumulators.
+//
+static void aggregate_row_sse42(float * acc, const float * kaiser, const float * patch, const unsigned N)
+{
+    unsigned k = 0;
+    for (; k + 4 <= N; k += 4)
+    {
+        const __m128 vec_kw = _mm_loadu_ps(kaiser + k);
+        const __m128 vec_num = _mm_mul_ps(vec_kw, _mm_loadu_ps(patch + k));
+        _mm_storeu_ps(acc + 2 * k, _mm_add_ps(_mm_loadu_ps(acc + 2 * k), _mm_unpacklo_ps(vec_num, vec_kw)));
+        _mm_storeu_ps(acc + 2 * k + 4, _mm_add_ps(_mm_loadu_ps(acc + 2 * k + 4), _mm_unpackhi_ps(vec_num, vec_kw)));
+    }
+    for (; k < N; k++)
+    {
+        acc[2 * k] += kaiser[k] * patch[k];
+        acc[2 * k + 1] += kaiser[k];
+    }
+}
+
+//
+// @brief Final division of interleaved accumulators, see
+//        aggregate_estimate().
+//
+static void aggregate_divide_sse42(const float * acc, const float * fallback, float * dst, const unsigned N)
+{
+    const __m128 vec_zero = _mm_setzero_ps();
+    unsigned k = 0;
+    for (; k + 4 <= N; k += 4)
+    {
+        const __m128 vec_a = _mm_loadu_ps(acc + 2 * k);
+        const __m128 vec_b = _mm_loadu_ps(acc + 2 * k + 4);
+        const __m128 vec_num = _mm_shuffle_ps(vec_a, vec_b, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 vec_den = _mm_shuffle_ps(vec_a, vec_b, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(dst + k, _mm_blendv_ps(_mm_div_ps(vec_num, vec_den), _mm_loadu_ps(fallback + k),
+            _mm_cmpeq_ps(vec_den, vec_zero)));
+    }
+    for (; k < N; k++)
+        dst[k] = (acc[2 * k + 1] == 0.0f ? fallback[k] : acc[2 * k] / acc[2 * k + 1]);
+}
+
+//
+// @brief Fill the table with the SSE4.2 kernels.
+//
+void simd_kernels_sse42(simd_kernels & kernels)
+{
+    kernels.ht_threshold_scale = ht_threshold_scale_sse42;
+    kernels.wiener_shrink = wiener_shrink_sse42;
+    kernels.square_diff = square_diff_sse42;
+    kernels.aggregate_row = aggregate_row_sse42;
+    kernels.aggregate_divide = aggregate_divide_sse42;
+}
+
+#endif      // #ifdef BM3D_ISA_X86
@@ -19,11 +19,27 @@
 // 
 
 #include <iostream>
+#include <algorithm>
 #include <stdlib.h>
 #include <time.h>
 #include "unistd.h"
 #include <math.h>
 
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif      // #ifdef _WIN32
+#ifndef _WIN32
+#include <pthread.h>
+#endif      // #ifndef _WIN32
+
 #include "mt19937ar.h"
 #include "utilities.h"
 #include "bm3d.h"
@@ -104,293 +120,51 @@ bool power_of_2(const unsigned n)
 }
 
 //
-//  @brief Add boundaries by symetry
-// 
-//  @param img : image to symetrize
-//  @param img_sym : will contain img with symetrized boundaries
-//  @param width, height, chnls : size of img
-//  @param N : size of the boundary
-// 
-//  @return none.
-// 
-void symetrize(float * &img, float * &img_sym, const unsigned width, const unsigned height, const unsigned chnls, const unsigned N)
-{
-	// Declaration
-	const unsigned w = width + 2 * N;
-	const unsigned h = height + 2 * N;
-
-	for (unsigned c = 0; c < chnls; c++)
-	{
-		unsigned dc = c * width * height;
-		unsigned dc_2 = c * w * h + N * w + N;
-
-		// Center of the image
-		for (unsigned i = 0; i < height; i++)
-			for (unsigned j = 0; j < width; j++, dc++)
-				img_sym[dc_2 + i * w + j] = img[dc];
-
-		// Top and bottom
-		dc_2 = c * w * h;
-		for (unsigned j = 0; j < w; j++, dc_2++)
-			for (unsigned i = 0; i < N; i++)
-			{
-				img_sym[dc_2 + i * w] = img_sym[dc_2 + (2 * N - i - 1) * w];
-				img_sym[dc_2 + (h - i - 1) * w] = img_sym[dc_2 + (h - 2 * N + i) * w];
-			}
-
-		// Right and left
-		dc_2 = c * w * h;
-		for (unsigned i = 0; i < h; i++)
-		{
-			const unsigned di = dc_2 + i * w;
-			for (unsigned j = 0; j < N; j++)
-			{
-				img_sym[di + j] = img_sym[di + 2 * N - j - 1];
-				img_sym[di + w - j - 1] = img_sym[di + w - 2 * N + j];
-			}
-		}
-	}
-
-	return;
-}
-
-IplImage * symetrize(IplImage * iplImage, const unsigned N)
-{
-    const unsigned int width = iplImage->width;
-    const unsigned int height = iplImage->height;
-    const unsigned int chnls = iplImage->nChannels;
-    const unsigned int w = width + 2 * N;
-    const unsigned int h = height + 2 * N;
-
-    float * img = transfer_iplImage2buffer(iplImage);
-    float * img_sym = new float[w * h * chnls];
-    if (!img_sym)
-    {
-        delete[] img_sym;
-        img_sym = NULL;
-    }
-    for (unsigned c = 0; c < chnls; c++)
-    {
-        unsigned dc = c * width * height;
-        unsigned dc_2 = c * w * h + N * w + N;
-
-        // Center of the image
-        for (unsigned i = 0; i < height; i++)
-            for (unsigned j = 0; j < width; j++, dc++)
-                img_sym[dc_2 + i * w + j] = img[dc];
-
-        // Top and bottom
-        dc_2 = c * w * h;
-        for (unsigned j = 0; j < w; j++, dc_2++)
-            for (unsigned i = 0; i < N; i++)
-            {
-                img_sym[dc_2 + i * w] = img_sym[dc_2 + (2 * N - i - 1) * w];
-                img_sym[dc_2 + (h - i - 1) * w] = img_sym[dc_2 + (h - 2 * N + i) * w];
-            }
-
-        // Right and left
-        dc_2 = c * w * h;
-        for (unsigned i = 0; i < h; i++)
-        {
-            const unsigned di = dc_2 + i * w;
-            for (unsigned j = 0; j < N; j++)
-            {
-                img_sym[di + j] = img_sym[di + 2 * N - j - 1];
-                img_sym[di + w - j - 1] = img_sym[di + w - 2 * N + j];
-            }
-        }
-    }
-
-    IplImage *iplImage_sym = transfer_buffer2iplImage(img_sym, w, h, 3, false);
-    save_image("sym.bmp", iplImage_sym);
-    delete[] img_sym;
-    img_sym = NULL;
-
-    return iplImage_sym;
-}
-
-//
-// @brief Transform the color space of the image
-//
-// @param img: image to transform
-// @param color_space: choice between OPP, YUV, YCbCr, RGB
-// @param width, height, chnls: size of img
-// @param rgb2yuv: if true, transform the color space
-//        from RGB to YUV, otherwise do the inverse
+// @brief Matrix of a color space transform. The forward transform gives
+//        the channels of the color space from (red, green, blue), the
+//        inverse one gives (red, green, blue) from the channels:
+//        out[c] = mat[3c] * in[0] + mat[3c + 1] * in[1] + mat[3c + 2] * in[2].
+//        The matrix is applied by the ingest and the egress of the image,
+//        see transfer_iplImage2buffer() and transfer_buffer2iplImage().
+//
+// @param color_space: choice between OPP, YUV, YCbCr, RGB;
+// @param rgb2yuv: if true, the forward transform, otherwise the inverse;
+// @param mat: will contain the 3 x 3 matrix.
 //
 // @return EXIT_FAILURE if color_space has not expected
 //         type, otherwise return EXIT_SUCCESS.
 //
-int color_space_transform(float * &img, const unsigned color_space, const unsigned width, const unsigned height, const unsigned chnls, const bool rgb2yuv)
+int color_space_matrix(const unsigned color_space, const bool rgb2yuv, float * mat)
 {
-	if (chnls == 1 || color_space == RGB)
-		return EXIT_SUCCESS;
-
-	// Declarations
-	float * tmp = new float[chnls * width * height];
-	if (!tmp)
-	{
-		delete[] tmp;
-		tmp = NULL;
-	}
-	const unsigned int red = 0;
-	const unsigned int green = width * height;
-	const unsigned int blue = width * height * 2;
+	static const float yuv[9] = { 0.299f, 0.587f, 0.114f, -0.14713f, -0.28886f, 0.436f, 0.615f, -0.51498f, -0.10001f };
+	static const float yuv_inv[9] = { 1.0f, 0.0f, 1.13983f, 1.0f, -0.39465f, -0.5806f, 1.0f, 2.03211f, 0.0f };
+	static const float ycbcr[9] = { 0.299f, 0.587f, 0.114f, -0.169f, -0.331f, 0.500f, 0.500f, -0.419f, -0.081f };
+	static const float ycbcr_inv[9] = { 1.000f, 0.000f, 1.402f, 1.000f, -0.344f, -0.714f, 1.000f, 1.772f, 0.000f };
+	static const float opp[9] = { 0.333f, 0.333f, 0.333f, 0.500f, 0.000f, -0.500f, 0.250f, -0.500f, 0.250f };
+	static const float opp_inv[9] = { 1.0f, 1.0f, 0.666f, 1.0f, 0.0f, -1.333f, 1.0f, -1.0f, 0.666f };
+	static const float rgb[9] = { 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f };
 
-	// Transformations depending on the mode
+	const float * src;
 	if (color_space == YUV)
-	{
-		if (rgb2yuv)
-		{
-			for (unsigned int k = 0; k < width * height; k++)
-			{
-				// Y
-				tmp[k + red] = 0.299f   * img[k + red] + 0.587f   * img[k + green] + 0.114f   * img[k + blue];
-				// U
-				tmp[k + green] = -0.14713f * img[k + red] - 0.28886f * img[k + green] + 0.436f   * img[k + blue];
-				// V
-				tmp[k + blue] = 0.615f   * img[k + red] - 0.51498f * img[k + green] - 0.10001f * img[k + blue];
-			}
-		}
-		else
-		{
-			for (unsigned int k = 0; k < width * height; k++)
-			{
-				// Red   channel
-				tmp[k + red] = img[k + red] + 1.13983f * img[k + blue];
-				// Green channel
-				tmp[k + green] = img[k + red] - 0.39465f * img[k + green] - 0.5806f * img[k + blue];
-				// Blue  channel
-				tmp[k + blue] = img[k + red] + 2.03211f * img[k + green];
-			}
-		}
-	}
+		src = (rgb2yuv ? yuv : yuv_inv);
 	else if (color_space == YCBCR)
-	{
-		if (rgb2yuv)
-		{
-			for (unsigned int k = 0; k < width * height; k++)
-			{
-				// Y
-				tmp[k + red] = 0.299f * img[k + red] + 0.587f * img[k + green] + 0.114f * img[k + blue];
-				// U
-				tmp[k + green] = -0.169f * img[k + red] - 0.331f * img[k + green] + 0.500f * img[k + blue];
-				// V
-				tmp[k + blue] = 0.500f * img[k + red] - 0.419f * img[k + green] - 0.081f * img[k + blue];
-			}
-		}
-		else
-		{
-			for (unsigned int k = 0; k < width * height; k++)
-			{
-				// Red   channel
-				tmp[k + red] = 1.000f * img[k + red] + 0.000f * img[k + green] + 1.402f * img[k + blue];
-				// Green channel
-				tmp[k + green] = 1.000f * img[k + red] - 0.344f * img[k + green] - 0.714f * img[k + blue];
-				// Blue  channel
-				tmp[k + blue] = 1.000f * img[k + red] + 1.772f * img[k + green] + 0.000f * img[k + blue];
-			}
-		}
-	}
+		src = (rgb2yuv ? ycbcr : ycbcr_inv);
 	else if (color_space == OPP)
-	{
-		if (rgb2yuv)
-		{
-			for (unsigned int k = 0; k < width * height; k++)
-			{
-				// Y
-				tmp[k + red] = 0.333f * img[3 * k + 2] + 0.333f * img[3 * k + 1] + 0.333f * img[3 * k];
-				// U
-				tmp[k + green] = 0.500f * img[3 * k + 2] + 0.000f * img[3 * k + 1] - 0.500f * img[3 * k];
-				// V
-				tmp[k + blue] = 0.250f * img[3 * k + 2] - 0.500f * img[3 * k + 1] + 0.250f * img[3 * k];
-			}
-		}
-		else
-		{
-			for (unsigned int k = 0; k < width * height; k++)
-			{	
-				// Red   channel
-				tmp[3 * k + 2] = 1.0f * img[k + red] + 1.0f * img[k + green] + 0.666f * img[k + blue];
-				// Green channel
-				tmp[3 * k + 1] = 1.0f * img[k + red] + 0.0f * img[k + green] - 1.333f * img[k + blue];
-				// Blue  channel
-				tmp[3 * k] = 1.0f * img[k + red] - 1.0f * img[k + green] + 0.666f * img[k + blue];
-			}
-		}
-	}
+		src = (rgb2yuv ? opp : opp_inv);
+	else if (color_space == RGB)
+		src = rgb;
 	else
 	{
 		cout << "Wrong type of transform. Must be OPP, YUV, or YCbCr!!" << endl;
 		return EXIT_FAILURE;
 	}
 
-	for (unsigned int k = 0; k < width * height * chnls; k++)
-	{
-		img[k] = tmp[k];
-	}
-	delete[] tmp;
-	tmp = NULL;
+	for (unsigned k = 0; k < 9; k++)
+		mat[k] = src[k];
 
 	return EXIT_SUCCESS;
 }
 
-IplImage * color_space_transform(IplImage * iplImage, const bool rgb2yuv)
-{
-    const unsigned int width = iplImage->width;
-    const unsigned int height = iplImage->height;
-    const unsigned int chnls = iplImage->nChannels;
-
-    const unsigned int red = 0;
-    const unsigned int green = width * height;
-    const unsigned int blue = width * height * 2;
-
-    float * tmp = new float[chnls * width * height];
-    if (!tmp)
-    {
-        delete[] tmp;
-        tmp = NULL;
-    }
-    float * img = transfer_iplImage2buffer(iplImage);
-    if (rgb2yuv)
-    {
-        for (unsigned int k = 0; k < width * height; k++)
-        {
-            // Y
-            tmp[k + red] = 0.333f * img[3 * k + 2] + 0.333f * img[3 * k + 1] + 0.333f * img[3 * k];
-            // U
-            tmp[k + green] = 0.500f * img[3 * k + 2] + 0.000f * img[3 * k + 1] - 0.500f * img[3 * k];
-            // V
-            tmp[k + blue] = 0.250f * img[3 * k + 2] - 0.500f * img[3 * k + 1] + 0.250f * img[3 * k];
-        }
-    }
-    else
-    {
-        for (unsigned int k = 0; k < width * height; k++)
-        {
-            // Red   channel
-            tmp[3 * k + 2] = 1.0f * img[k + red] + 1.0f * img[k + green] + 0.666f * img[k + blue];
-            // Green channel
-            tmp[3 * k + 1] = 1.0f * img[k + red] + 0.0f * img[k + green] - 1.333f * img[k + blue];
-            // Blue  channel
-            tmp[3 * k] = 1.0f * img[k + red] - 1.0f * img[k + green] + 0.666f * img[k + blue];
-        }
-    }
-
-    //FILE *pFile_2 = fopen("img_ipl.txt", "w");
-    //for (unsigned int i = 0; i < width * height; ++i)
-    //{
-    //    fprintf(pFile_2, "%f, %f, %f\n", tmp[3 * i], tmp[3 * i + 1], tmp[3 * i + 2]);
-    //}
-    //fclose(pFile_2);
-
-    IplImage * iplImage_ = transfer_buffer2iplImage(tmp, width, height, chnls, false);
-    delete[] tmp;
-    tmp = NULL;
-
-    return iplImage_;
-}
-
 //
 // @brief Look for the closest power of 2 number
 //
@@ -471,32 +245,36 @@ int estimate_sigma(const float sigma, float * sigma_table, const unsigned chnls,
 	return EXIT_SUCCESS;
 }
 //
-// @brief Initialize a set of indices.
+// @brief Number of indices of a set built by ind_initialize() or
+//        ind_fill().
+//
+// @param max_size, N, step: see ind_initialize().
+//
+// @return the number of indices.
+//
+unsigned ind_count(const unsigned max_size, const unsigned N, const unsigned step)
+{
+	const unsigned size = (max_size - 2 * N + step - 1) / step;
+	return (N > 1 ? size + 1 : size);
+}
+
+//
+// @brief Fill a set of indices in a buffer of at least ind_count()
+//        values.
 //
 // @param ind_set: will contain the set of indices;
-// @param max_size: indices can't go over this size;
-// @param N : boundary;
-// @param step: step between two indices.
+// @param max_size, N, step: see ind_initialize();
+// @param size: will contain the number of indices.
 //
 // @return none.
 //
-void ind_initialize(unsigned * &ind_set, const unsigned max_size, const unsigned N, const unsigned step, unsigned &size)
+void ind_fill(unsigned * ind_set, const unsigned max_size, const unsigned N, const unsigned step, unsigned &size)
 {
-	/// Recoding
-	if ((max_size - 2 * N) % step == 0)
-	{
-		size = (max_size - 2 * N) / step;
-	}
-	else
-	{
-		size = (max_size - 2 * N) / step + 1;
-	}
+	size = ind_count(max_size, N, step);
 
 	unsigned ind = N;
 	if (N > 1)
 	{
-		size += 1;
-		ind_set = new unsigned[size];
 		for (unsigned int i = 0; i < size - 1; i++)
 		{
 			ind_set[i] = ind;
@@ -506,7 +284,6 @@ void ind_initialize(unsigned * &ind_set, const unsigned max_size, const unsigned
 	}
 	else
 	{
-		ind_set = new unsigned[size];
 		for (unsigned int i = 0; i < size; i++)
 		{
 			ind_set[i] = ind;
@@ -515,6 +292,22 @@ void ind_initialize(unsigned * &ind_set, const unsigned max_size, const unsigned
 	}
 }
 
+//
+// @brief Initialize a set of indices.
+//
+// @param ind_set: will contain the set of indices;
+// @param max_size: indices can't go over this size;
+// @param N : boundary;
+// @param step: step between two indices.
+//
+// @return none.
+//
+void ind_initialize(unsigned * &ind_set, const unsigned max_size, const unsigned N, const unsigned step, unsigned &size)
+{
+	ind_set = new unsigned[ind_count(max_size, N, step)];
+	ind_fill(ind_set, max_size, N, step, size);
+}
+
 //
 // @brief For convenience. Estimate the size of the ind_set vector built
 //        with the function ind_initialize().
@@ -536,6 +329,7 @@ unsigned ind_size(const unsigned max_size, const unsigned N, const unsigned step
 	return k;
 }
 
+#ifdef _BM3D_USE_FFTW
 //
 // @brief Initialize a 2D fftwf_plan with some parameters
 //
@@ -581,6 +375,134 @@ void allocate_plan_1d(fftwf_plan* plan, const unsigned N, const fftwf_r2r_kind k
 	fftwf_free(vec);
 }
 
+// Plans built once and shared by every call of run_bm3d
+struct cached_plan
+{
+	unsigned       N;
+	fftwf_r2r_kind kind;
+	unsigned       nb;
+	int            alignment;
+	fftwf_plan     plan;
+};
+
+static std::vector<cached_plan> plan_cache;
+static bool plan_cache_wisdom_loaded = false;
+
+// The FFTW planner is not thread-safe: the cache is protected by a lock
+#ifdef _WIN32
+static SRWLOCK plan_cache_lock = SRWLOCK_INIT;
+#define PLAN_CACHE_LOCK()   AcquireSRWLockExclusive(&plan_cache_lock)
+#define PLAN_CACHE_UNLOCK() ReleaseSRWLockExclusive(&plan_cache_lock)
+#else
+static pthread_mutex_t plan_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PLAN_CACHE_LOCK()   pthread_mutex_lock(&plan_cache_lock)
+#define PLAN_CACHE_UNLOCK() pthread_mutex_unlock(&plan_cache_lock)
+#endif      // #ifdef _WIN32
+
+//
+// @brief Name of the wisdom file: FFTW_WISDOM_ENV if set, otherwise
+//        FFTW_WISDOM_FILE in the current directory.
+//
+static const char * plan_cache_wisdom_file()
+{
+	const char * env = getenv(FFTW_WISDOM_ENV);
+	return (env && *env ? env : FFTW_WISDOM_FILE);
+}
+
+//
+// @brief Planner flag: FFTW_PLANNER_ENV may be set to estimate,
+//        measure or patient. Default is FFTW_MEASURE.
+//
+static unsigned plan_cache_planner()
+{
+	const char * env = getenv(FFTW_PLANNER_ENV);
+	if (env && !strcmp(env, "estimate"))
+		return FFTW_ESTIMATE;
+	if (env && !strcmp(env, "patient"))
+		return FFTW_PATIENT;
+	return FFTW_MEASURE;
+}
+
+//
+// @brief Get a 2D fftwf_plan from the plan cache. The plan is built on
+//        the first request, with the wisdom file loaded beforehand and
+//        saved afterwards, so that following runs (and processes) pay
+//        no planning cost. Plans are out-of-place and can be executed
+//        with fftwf_execute_r2r() on any pair of arrays with the same
+//        alignment. Thread-safe.
+//
+// @param N: size of the patch to apply the 2D transform;
+// @param kind: forward or backward;
+// @param nb: number of 2D transform processed by one execution;
+// @param alignment: alignment of the arrays, see fftwf_alignment_of().
+//
+// @return the plan. It is owned by the cache, see plan_cache_clear().
+//
+fftwf_plan plan_cache_get_2d(const unsigned N, const fftwf_r2r_kind kind, const unsigned nb, const int alignment)
+{
+	PLAN_CACHE_LOCK();
+	for (unsigned k = 0; k < plan_cache.size(); k++)
+		if (plan_cache[k].N == N && plan_cache[k].kind == kind && plan_cache[k].nb == nb
+			&& plan_cache[k].alignment == alignment)
+		{
+			fftwf_plan plan = plan_cache[k].plan;
+			PLAN_CACHE_UNLOCK();
+			return plan;
+		}
+
+	if (!plan_cache_wisdom_loaded)
+	{
+		fftwf_import_wisdom_from_filename(plan_cache_wisdom_file());
+		plan_cache_wisdom_loaded = true;
+	}
+
+	int            nb_table[2] = { N, N };
+	int            nembed[2] = { N, N };
+	fftwf_r2r_kind kind_table[2] = { kind, kind };
+
+	// Arrays with the requested alignment, overwritten by the planner
+	const size_t size = N * N * nb * sizeof(float) + alignment;
+	char * in = (char *)fftwf_malloc(size);
+	char * out = (char *)fftwf_malloc(size);
+
+	cached_plan entry;
+	entry.N = N;
+	entry.kind = kind;
+	entry.nb = nb;
+	entry.alignment = alignment;
+	entry.plan = fftwf_plan_many_r2r(2, nb_table, nb, (float *)(in + alignment), nembed, 1, N * N,
+		(float *)(out + alignment), nembed, 1, N * N, kind_table, plan_cache_planner());
+	plan_cache.push_back(entry);
+
+	fftwf_free(in);
+	fftwf_free(out);
+
+	fftwf_export_wisdom_to_filename(plan_cache_wisdom_file());
+	PLAN_CACHE_UNLOCK();
+
+	return entry.plan;
+}
+
+//
+// @brief Destroy every cached plan and release FFTW internal memory.
+//        The wisdom stays in the wisdom file. No plan of the cache may
+//        be in use.
+//
+// @return none.
+//
+void plan_cache_clear()
+{
+	PLAN_CACHE_LOCK();
+	for (unsigned k = 0; k < plan_cache.size(); k++)
+		fftwf_destroy_plan(plan_cache[k].plan);
+	plan_cache.clear();
+	fftwf_cleanup();
+	plan_cache_wisdom_loaded = false;
+	PLAN_CACHE_UNLOCK();
+}
+
+#endif      // #ifdef _BM3D_USE_FFTW
+
 //
 // @brief tabulated values of log2(N), where N = 2 ^ n.
 //
@@ -614,3 +536,762 @@ unsigned ind_pow2(const unsigned N)
 		(N == 4 ? 16 :
 		(N == 5 ? 32 : 64))))));
 }
+
+//
+// @brief Convert a single precision value into half precision
+//        (IEEE 754 binary16), rounding to the nearest even value.
+//
+// @param f : value to convert.
+//
+// @return the bits of the half precision value.
+//
+unsigned short float_to_half(const float f)
+{
+	union { float f; unsigned u; } v;
+	v.f = f;
+	const unsigned sign = (v.u >> 16) & 0x8000;
+	const unsigned u = v.u & 0x7fffffff;
+
+	// Infinity and NaN
+	if (u >= 0x7f800000)
+		return (unsigned short)(sign | 0x7c00 | (u > 0x7f800000 ? 0x200 : 0));
+
+	// Too large, rounded to infinity
+	if (u >= 0x477ff000)
+		return (unsigned short)(sign | 0x7c00);
+
+	// Subnormal values and zero
+	if (u < 0x38800000)
+	{
+		if (u <= 0x33000000)
+			return (unsigned short)sign;
+		const unsigned m = (u & 0x7fffff) | 0x800000;
+		const unsigned shift = 126 - (u >> 23);
+		const unsigned rem = m & ((1u << shift) - 1);
+		const unsigned half = 1u << (shift - 1);
+		unsigned h = m >> shift;
+		if (rem > half || (rem == half && (h & 1)))
+			h++;
+		return (unsigned short)(sign | h);
+	}
+
+	// Normal values: re-bias the exponent and round the mantissa
+	unsigned h = (u - 0x38000000) >> 13;
+	const unsigned rem = u & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+		h++;
+	return (unsigned short)(sign | h);
+}
+
+//
+// @brief Convert a half precision value (IEEE 754 binary16) into
+//        single precision. The conversion is exact.
+//
+// @param h : bits of the half precision value.
+//
+// @return the single precision value.
+//
+float half_to_float(const unsigned short h)
+{
+	union { float f; unsigned u; } v;
+	const unsigned sign = (unsigned)(h & 0x8000) << 16;
+	unsigned e = (h >> 10) & 0x1f;
+	unsigned m = h & 0x3ff;
+
+	if (e == 0)
+	{
+		if (m == 0)
+			v.u = sign;
+		else
+		{
+			// Subnormal value: normalize it
+			e = 113;
+			while (!(m & 0x400))
+			{
+				m <<= 1;
+				e--;
+			}
+			v.u = sign | (e << 23) | ((m & 0x3ff) << 13);
+		}
+	}
+	else if (e == 31)
+		v.u = sign | 0x7f800000 | (m << 13);
+	else
+		v.u = sign | ((e + 112) << 23) | (m << 13);
+
+	return v.f;
+}
+
+//
+// @brief Memory budget given by BM3D_MEMORY_BUDGET_ENV, as a number of
+//        bytes followed by an optional K, M or G suffix.
+//
+// @return the budget in bytes, 0 if the variable is unset or invalid.
+//
+size_t memory_budget_env()
+{
+	const char * env = getenv(BM3D_MEMORY_BUDGET_ENV);
+	if (!env || !*env)
+		return 0;
+
+	char * end = NULL;
+	const double value = strtod(env, &end);
+	double unit = 1.0;
+	if (*end == 'K' || *end == 'k')
+		unit = 1024.0;
+	else if (*end == 'M' || *end == 'm')
+		unit = 1048576.0;
+	else if (*end == 'G' || *end == 'g')
+		unit = 1073741824.0;
+	return (value > 0.0 ? (size_t)(value * unit) : 0);
+}
+
+//
+// @brief Cache of the 2D transforms of every patch in half precision,
+//        enabled by BM3D_SPECTRUM_CACHE_ENV.
+//
+// @return true if the variable is set to a non-zero number.
+//
+bool spectrum_cache_env()
+{
+	const char * env = getenv(BM3D_SPECTRUM_CACHE_ENV);
+	return (env && atoi(env) != 0);
+}
+
+//
+// @brief Peak of the memory used by the process: its peak working set
+//        on Windows, its maximum resident set size otherwise.
+//
+// @return the size in bytes, 0 if it is not available.
+//
+size_t peak_memory_bytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0;
+#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss;
+#else
+	return (size_t)usage.ru_maxrss * 1024;
+#endif      // #ifdef __APPLE__
+#endif      // #ifdef _WIN32
+}
+
+//
+// @brief Move the position of a file, beyond 2 GB too.
+//
+static bool raster_seek(FILE * file, const unsigned long long position)
+{
+#ifdef _WIN32
+	return !_fseeki64(file, (__int64)position, SEEK_SET);
+#else
+	return !fseeko(file, (off_t)position, SEEK_SET);
+#endif      // #ifdef _WIN32
+}
+
+//
+// @brief Open a raw planar raster file. A file to read must hold all
+//        its samples; a file to write is created, its header is left
+//        null. When map is true the file is mapped in memory if the
+//        system allows it, otherwise it is read and written with stdio.
+//
+// @param raster: will describe the raster;
+// @param name: name of the file;
+// @param write: true to create the file, false to read it;
+// @param map: true to map the file in memory;
+// @param width, height, chnls, depth: size of the raster, depth of its
+//        samples (SR_DEPTH_8U, SR_DEPTH_16U or SR_DEPTH_32F);
+// @param offset: size of the header, before the samples.
+//
+// @return false if the file can't be opened or is too short.
+//
+bool raster_open(RasterFile & raster, const char * name, const bool write, const bool map, const unsigned width,
+	const unsigned height, const unsigned chnls, const int depth, const unsigned long long offset)
+{
+	raster = RasterFile();
+	if (depth != SR_DEPTH_8U && depth != SR_DEPTH_16U && depth != SR_DEPTH_32F)
+	{
+		cout << "Wrong depth of raster. Must be 8U, 16U or 32F!!" << endl;
+		return false;
+	}
+	raster.width = width;
+	raster.height = height;
+	raster.chnls = chnls;
+	raster.depth = depth;
+	raster.offset = offset;
+	const unsigned long long bytes = raster.position(chnls, 0, 0);
+
+#ifndef _WIN32
+	if (map && bytes == (size_t)bytes)
+	{
+		const int fd = open(name, write ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+		if (fd < 0)
+		{
+			cout << "Unable to open " << name << endl;
+			return false;
+		}
+		struct stat st;
+		bool ok = (write ? !ftruncate(fd, (off_t)bytes) : (!fstat(fd, &st) && (unsigned long long)st.st_size >= bytes));
+		if (ok)
+		{
+			void * data = mmap(NULL, (size_t)bytes, write ? PROT_READ | PROT_WRITE : PROT_READ,
+				write ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+			ok = (data != MAP_FAILED);
+			if (ok)
+			{
+				raster.data = (char *)data;
+				raster.mapped_bytes = (size_t)bytes;
+			}
+		}
+		close(fd);
+		if (!ok)
+			cout << "Unable to map " << name << " (" << bytes << " bytes)" << endl;
+		return ok;
+	}
+#endif      // #ifndef _WIN32
+
+	raster.file = fopen(name, write ? "wb" : "rb");
+	if (!raster.file)
+	{
+		cout << "Unable to open " << name << endl;
+		return false;
+	}
+
+	// The last sample must exist (to read) or can be written
+	unsigned char last[4] = { 0, 0, 0, 0 };
+	bool ok = (bytes > 0 && raster_seek(raster.file, bytes - raster.sample_bytes()));
+	if (ok)
+		ok = (write ? fwrite(last, raster.sample_bytes(), 1, raster.file) == 1 :
+			fread(last, raster.sample_bytes(), 1, raster.file) == 1);
+	if (!ok)
+	{
+		cout << "Size of " << name << " below the " << bytes << " bytes of the raster" << endl;
+		raster_close(raster);
+	}
+	return ok;
+}
+
+//
+// @brief Use samples in memory as a raw planar raster, for instance a
+//        file mapped by the caller. The memory is not owned by the
+//        raster.
+//
+// @param raster: will describe the raster;
+// @param data: the samples, without header;
+// @param width, height, chnls, depth: size of the raster, depth of its
+//        samples.
+//
+void raster_attach(RasterFile & raster, void * data, const unsigned width, const unsigned height,
+	const unsigned chnls, const int depth)
+{
+	raster = RasterFile();
+	raster.data = (char *)data;
+	raster.width = width;
+	raster.height = height;
+	raster.chnls = chnls;
+	raster.depth = depth;
+}
+
+//
+// @brief Read n samples of the row i of the channel c of a raster, from
+//        its column j.
+//
+// @param buf: will contain the samples, of the depth of the raster.
+//
+// @return false if the reading failed.
+//
+bool raster_read(const RasterFile & raster, const unsigned c, const unsigned i, const unsigned j, const unsigned n,
+	void * buf)
+{
+	const size_t bytes = (size_t)n * raster.sample_bytes();
+	if (raster.data)
+	{
+		memcpy(buf, raster.data + raster.position(c, i, j), bytes);
+		return true;
+	}
+	return (raster.file && raster_seek(raster.file, raster.position(c, i, j))
+		&& fread(buf, 1, bytes, raster.file) == bytes);
+}
+
+//
+// @brief Write n samples of the row i of the channel c of a raster, from
+//        its column j.
+//
+// @param buf: the samples, of the depth of the raster.
+//
+// @return false if the writing failed.
+//
+bool raster_write(const RasterFile & raster, const unsigned c, const unsigned i, const unsigned j, const unsigned n,
+	const void * buf)
+{
+	const size_t bytes = (size_t)n * raster.sample_bytes();
+	if (raster.data)
+	{
+		memcpy(raster.data + raster.position(c, i, j), buf, bytes);
+		return true;
+	}
+	return (raster.file && raster_seek(raster.file, raster.position(c, i, j))
+		&& fwrite(buf, 1, bytes, raster.file) == bytes);
+}
+
+//
+// @brief Close a raster: the file is closed or unmapped. Attached memory
+//        is left to its owner.
+//
+// @return false if the written samples could not be flushed.
+//
+bool raster_close(RasterFile & raster)
+{
+	bool ok = true;
+	if (raster.file)
+		ok = !fclose(raster.file);
+#ifndef _WIN32
+	if (raster.mapped_bytes)
+		ok = !munmap(raster.data, raster.mapped_bytes);
+#endif      // #ifndef _WIN32
+	raster = RasterFile();
+	return ok;
+}
+
+//
+// @brief Accounting enabled at startup by BM3D_MEMORY_REPORT_ENV.
+//
+static bool mem_stats_env()
+{
+	const char * env = getenv(BM3D_MEMORY_REPORT_ENV);
+	return (env && *env && strcmp(env, "0"));
+}
+
+bool mem_stats_on = mem_stats_env();
+static MemStats mem_stats;
+
+// The accounting is shared by all the threads, OpenMP or not: it is
+// protected by a lock. Each thread has its own slot, given on its first
+// allocation
+#ifdef _WIN32
+static SRWLOCK mem_stats_lock = SRWLOCK_INIT;
+#define MEM_STATS_LOCK()   AcquireSRWLockExclusive(&mem_stats_lock)
+#define MEM_STATS_UNLOCK() ReleaseSRWLockExclusive(&mem_stats_lock)
+#define MEM_STATS_THREAD   __declspec(thread)
+#else
+static pthread_mutex_t mem_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#define MEM_STATS_LOCK()   pthread_mutex_lock(&mem_stats_lock)
+#define MEM_STATS_UNLOCK() pthread_mutex_unlock(&mem_stats_lock)
+#define MEM_STATS_THREAD   __thread
+#endif      // #ifdef _WIN32
+
+// Slot of the calling thread in MemStats::thread plus 1, 0 before its
+// first allocation
+static MEM_STATS_THREAD unsigned mem_stats_slot = 0;
+
+//
+// @brief Add bytes to the current value of a stage, and update its peak.
+//
+static void mem_stage_add(MemStageStats & stats, const long long bytes)
+{
+	stats.current = (bytes < 0 && (size_t)(-bytes) > stats.current ? 0 : stats.current + (size_t)bytes);
+	if (stats.current > stats.peak)
+		stats.peak = stats.current;
+}
+
+//
+// @brief Record an allocation or a release of a stage, by the calling
+//        thread. Use mem_stats_add(), which does nothing when the
+//        accounting is disabled.
+//
+// @param stage: one of the MEM_STAGE_* values;
+// @param bytes: size allocated, negative for a release.
+//
+void mem_stats_update(const unsigned stage, const long long bytes)
+{
+	MEM_STATS_LOCK();
+	if (!mem_stats_slot)
+		mem_stats_slot = min(mem_stats.nb_threads + 1, (unsigned)MEM_THREADS_MAX);
+	const unsigned thread = mem_stats_slot - 1;
+	mem_stage_add(mem_stats.thread[thread][stage], bytes);
+	mem_stage_add(mem_stats.stage[stage], bytes);
+	const size_t peak = mem_stats.total.peak;
+	mem_stage_add(mem_stats.total, bytes);
+	if (mem_stats.total.peak > peak)
+		for (unsigned k = 0; k < MEM_STAGE_NB; k++)
+			mem_stats.at_peak[k] = mem_stats.stage[k].current;
+	if (thread >= mem_stats.nb_threads)
+		mem_stats.nb_threads = thread + 1;
+	MEM_STATS_UNLOCK();
+}
+
+//
+// @brief Enable or disable the accounting. The current values never go
+//        below 0 when buffers allocated while it was disabled are freed.
+//
+void mem_stats_enable(const bool enable)
+{
+	mem_stats_on = enable;
+}
+
+//
+// @brief Copy of the accounting so far.
+//
+void mem_stats_get(MemStats & stats)
+{
+	MEM_STATS_LOCK();
+	stats = mem_stats;
+	MEM_STATS_UNLOCK();
+}
+
+//
+// @brief Reset the peaks to the current values, to account the next run
+//        only.
+//
+void mem_stats_reset_peaks()
+{
+	MEM_STATS_LOCK();
+	for (unsigned t = 0; t < MEM_THREADS_MAX; t++)
+		for (unsigned k = 0; k < MEM_STAGE_NB; k++)
+			mem_stats.thread[t][k].peak = mem_stats.thread[t][k].current;
+	for (unsigned k = 0; k < MEM_STAGE_NB; k++)
+	{
+		mem_stats.stage[k].peak = mem_stats.stage[k].current;
+		mem_stats.at_peak[k] = mem_stats.stage[k].current;
+	}
+	mem_stats.total.peak = mem_stats.total.current;
+	MEM_STATS_UNLOCK();
+}
+
+//
+// @brief Name of a stage.
+//
+// @param stage: one of the MEM_STAGE_* values.
+//
+const char * mem_stage_name(const unsigned stage)
+{
+	return (stage == MEM_STAGE_IMAGES ? "images" :
+		(stage == MEM_STAGE_BLOCK_MATCHING ? "block matching" :
+		(stage == MEM_STAGE_TABLES_2D ? "2D tables" :
+		(stage == MEM_STAGE_GROUPS ? "groups" :
+		(stage == MEM_STAGE_AGGREGATION ? "aggregation" : "unknown")))));
+}
+
+//
+// @brief Print the accounting: for each stage its peak, its part of the
+//        peak of the process and its current value, then the peak of
+//        each stage per thread when several threads allocated.
+//
+void mem_stats_report()
+{
+	MemStats stats;
+	mem_stats_get(stats);
+	cout << "memory by stage: peak " << stats.total.peak / 1048576.0 << " MB" << endl;
+	for (unsigned k = 0; k < MEM_STAGE_NB; k++)
+		cout << "  " << mem_stage_name(k) << ": peak " << stats.stage[k].peak / 1048576.0 << " MB, "
+			<< stats.at_peak[k] / 1048576.0 << " MB at the peak, " << stats.stage[k].current / 1048576.0
+			<< " MB now" << endl;
+	if (stats.nb_threads > 1)
+		for (unsigned t = 0; t < stats.nb_threads; t++)
+		{
+			cout << "  thread " << t << ":";
+			for (unsigned k = 0; k < MEM_STAGE_NB; k++)
+				cout << " " << mem_stage_name(k) << " " << stats.thread[t][k].peak / 1048576.0 << " MB";
+			cout << endl;
+		}
+}
+
+//
+// @brief Pages of the large planes, read from BM3D_HUGE_PAGES_ENV. Huge
+//        pages are not used on Windows, where they need a privilege of
+//        the user.
+//
+static unsigned huge_pages_env()
+{
+	unsigned mode = HUGE_PAGES_OFF;
+#ifndef _WIN32
+	const char * env = getenv(BM3D_HUGE_PAGES_ENV);
+	if (env && !strcmp(env, "thp"))
+		mode = HUGE_PAGES_THP;
+	else if (env && !strcmp(env, "hugetlb"))
+		mode = HUGE_PAGES_HUGETLB;
+#endif      // #ifndef _WIN32
+	return mode;
+}
+
+// Selected once at static initialization, before any thread may allocate
+static const unsigned huge_pages_selected = huge_pages_env();
+
+//
+// @brief Pages of the large planes, read from BM3D_HUGE_PAGES_ENV at
+//        startup.
+//
+// @return HUGE_PAGES_OFF, HUGE_PAGES_THP or HUGE_PAGES_HUGETLB.
+//
+unsigned huge_pages_mode()
+{
+	return huge_pages_selected;
+}
+
+// Header stored before each plane, on ARENA_ALIGN_BYTES bytes
+struct PlaneHeader
+{
+	char * memory;       // memory allocated or mapped
+	size_t mapped;       // size of the mapping, 0 if allocated with malloc
+	size_t bytes;        // size of the plane
+	unsigned stage;      // stage of the plane, see mem_stats_add()
+	bool hugetlb;        // mapped with huge pages reserved by the system
+};
+
+static unsigned long long plane_bytes_freed = 0;
+static unsigned long long huge_bytes_freed = 0;
+
+// The planes are freed by any thread: the sizes freed are protected by
+// a lock
+#ifdef _WIN32
+static SRWLOCK plane_stats_lock = SRWLOCK_INIT;
+#define PLANE_STATS_LOCK()   AcquireSRWLockExclusive(&plane_stats_lock)
+#define PLANE_STATS_UNLOCK() ReleaseSRWLockExclusive(&plane_stats_lock)
+#else
+static pthread_mutex_t plane_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PLANE_STATS_LOCK()   pthread_mutex_lock(&plane_stats_lock)
+#define PLANE_STATS_UNLOCK() pthread_mutex_unlock(&plane_stats_lock)
+#endif      // #ifdef _WIN32
+
+#ifndef _WIN32
+//
+// @brief Part of a range of memory backed by transparent huge pages,
+//        from the mappings of /proc/self/smaps which overlap it.
+//
+static size_t thp_bytes(const char * begin, const size_t bytes)
+{
+	FILE * file = fopen("/proc/self/smaps", "r");
+	if (!file)
+		return 0;
+
+	const unsigned long first = (unsigned long)begin;
+	const unsigned long last = first + bytes;
+	unsigned long start = 0, end = 0;
+	size_t huge = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), file))
+	{
+		unsigned long a, b, kb;
+		if (sscanf(line, "%lx-%lx ", &a, &b) == 2)
+		{
+			start = a;
+			end = b;
+		}
+		else if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 && kb && start < last && end > first)
+		{
+			// Part of the huge pages of the mapping in the range
+			const size_t overlap = min(end, last) - max(start, first);
+			huge += min((size_t)kb * 1024, overlap);
+		}
+	}
+	fclose(file);
+	return huge;
+}
+#endif      // #ifndef _WIN32
+
+//
+// @brief Allocate a large plane. With huge pages enabled (see
+//        huge_pages_mode()), a plane of at least HUGE_PAGE_BYTES bytes
+//        is mapped on a boundary of huge page, with MAP_HUGETLB or
+//        madvise(MADV_HUGEPAGE); the other ones are allocated with
+//        malloc. The plane is aligned on ARENA_ALIGN_BYTES bytes.
+//
+// @param bytes: size of the plane;
+// @param zero: true to fill the plane with 0;
+// @param stage: stage of the plane, for mem_stats_add().
+//
+// @return the plane, to free with plane_free(). NULL if the allocation
+//         failed.
+//
+void * plane_alloc(const size_t bytes, const bool zero, const unsigned stage)
+{
+	PlaneHeader header;
+	header.memory = NULL;
+	header.mapped = 0;
+	header.bytes = bytes;
+	header.stage = stage;
+	header.hugetlb = false;
+	char * plane = NULL;
+
+#ifndef _WIN32
+	const unsigned mode = huge_pages_mode();
+	const size_t size = (bytes + ARENA_ALIGN_BYTES + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+	if (mode != HUGE_PAGES_OFF && bytes >= HUGE_PAGE_BYTES)
+	{
+#ifdef MAP_HUGETLB
+		if (mode == HUGE_PAGES_HUGETLB)
+		{
+			void * memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (memory != MAP_FAILED)
+			{
+				header.memory = (char *)memory;
+				header.mapped = size;
+				header.hugetlb = true;
+				plane = header.memory;
+			}
+		}
+#endif      // #ifdef MAP_HUGETLB
+
+		// Transparent huge pages, from a boundary of huge page
+		if (!plane)
+		{
+			void * memory = mmap(NULL, size + HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (memory != MAP_FAILED)
+			{
+				header.memory = (char *)memory;
+				header.mapped = size + HUGE_PAGE_BYTES;
+				plane = header.memory + (HUGE_PAGE_BYTES - (size_t)memory % HUGE_PAGE_BYTES) % HUGE_PAGE_BYTES;
+#ifdef MADV_HUGEPAGE
+				madvise(plane, size, MADV_HUGEPAGE);
+#endif      // #ifdef MADV_HUGEPAGE
+			}
+		}
+	}
+#endif      // #ifndef _WIN32
+
+	// Mapped planes are already null
+	if (!plane)
+	{
+		header.memory = (char *)malloc(bytes + 2 * ARENA_ALIGN_BYTES);
+		if (!header.memory)
+			return NULL;
+		plane = header.memory + (ARENA_ALIGN_BYTES - (size_t)header.memory % ARENA_ALIGN_BYTES) % ARENA_ALIGN_BYTES;
+		if (zero)
+			memset(plane + ARENA_ALIGN_BYTES, 0, bytes);
+	}
+
+	memcpy(plane, &header, sizeof(header));
+	mem_stats_add(stage, (long long)bytes);
+	return plane + ARENA_ALIGN_BYTES;
+}
+
+//
+// @brief Free a plane given by plane_alloc(). The part of the plane
+//        which was backed by huge pages is added to huge_pages_stats().
+//
+void plane_free(void * plane)
+{
+	if (!plane)
+		return;
+
+	PlaneHeader header;
+	memcpy(&header, (char *)plane - ARENA_ALIGN_BYTES, sizeof(header));
+	mem_stats_add(header.stage, -(long long)header.bytes);
+	size_t huge = 0;
+#ifndef _WIN32
+	if (header.mapped)
+		huge = (header.hugetlb ? header.bytes : min(header.bytes, thp_bytes((char *)plane, header.bytes)));
+#endif      // #ifndef _WIN32
+
+	PLANE_STATS_LOCK();
+	plane_bytes_freed += header.bytes;
+	huge_bytes_freed += huge;
+	PLANE_STATS_UNLOCK();
+
+	if (!header.mapped)
+	{
+		free(header.memory);
+		return;
+	}
+
+#ifndef _WIN32
+	munmap(header.memory, header.mapped);
+#endif      // #ifndef _WIN32
+}
+
+//
+// @brief Account a plane given by plane_alloc() to another stage, when
+//        it is reused by this stage (see mem_stats_add()).
+//
+void plane_stage(void * plane, const unsigned stage)
+{
+	if (!plane)
+		return;
+
+	PlaneHeader header;
+	memcpy(&header, (char *)plane - ARENA_ALIGN_BYTES, sizeof(header));
+	if (header.stage == stage)
+		return;
+	mem_stats_add(header.stage, -(long long)header.bytes);
+	mem_stats_add(stage, (long long)header.bytes);
+	header.stage = stage;
+	memcpy((char *)plane - ARENA_ALIGN_BYTES, &header, sizeof(header));
+}
+
+//
+// @brief Sizes of the planes freed so far by plane_free(), and of their
+//        parts which were backed by huge pages.
+//
+void huge_pages_stats(unsigned long long & plane_bytes, unsigned long long & huge_bytes)
+{
+	PLANE_STATS_LOCK();
+	plane_bytes = plane_bytes_freed;
+	huge_bytes = huge_bytes_freed;
+	PLANE_STATS_UNLOCK();
+}
+
+ScratchArena::ScratchArena() : memory(NULL), base(NULL), size(0), used(0), peak(0)
+{
+}
+
+ScratchArena::~ScratchArena()
+{
+	if (memory)
+		mem_stats_add(MEM_STAGE_GROUPS, -(long long)size);
+	free(memory);
+}
+
+//
+// @brief Reserve the memory of the arena. Buffers taken beforehand are
+//        lost.
+//
+// @param bytes : size of the arena, see ScratchArena::aligned() to sum
+//        the sizes of the buffers.
+//
+// @return false if the allocation fails.
+//
+bool ScratchArena::reserve(const size_t bytes)
+{
+	if (memory)
+		mem_stats_add(MEM_STAGE_GROUPS, -(long long)size);
+	free(memory);
+	memory = (char *)malloc(bytes + ARENA_ALIGN_BYTES);
+	if (!memory)
+	{
+		base = NULL;
+		size = used = 0;
+		return false;
+	}
+	mem_stats_add(MEM_STAGE_GROUPS, (long long)bytes);
+	const size_t shift = (size_t)memory % ARENA_ALIGN_BYTES;
+	base = memory + (shift ? ARENA_ALIGN_BYTES - shift : 0);
+	size = bytes;
+	used = 0;
+	return true;
+}
+
+//
+// @brief Take a buffer in the arena.
+//
+// @param bytes : size of the buffer.
+//
+// @return the buffer, aligned on ARENA_ALIGN_BYTES, or NULL if the
+//         arena is exhausted.
+//
+void * ScratchArena::alloc(const size_t bytes)
+{
+	const size_t n = aligned(bytes);
+	if (!base || used + n > size)
+		return NULL;
+	void * ptr = base + used;
+	used += n;
+	if (used > peak)
+		peak = used;
+	return ptr;
+}
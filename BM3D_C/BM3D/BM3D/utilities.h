@@ -2,6 +2,7 @@
 #ifndef UTILITIES_H_INCLUDED
 #define UTILITIES_H_INCLUDED
 
+#include <stdio.h>
 #include <vector>
 #include "fftw3.h"
 #include "ImgProcUtility.h"
@@ -16,13 +17,8 @@ int save_image(char* name, IplImage * &iplImage);
 // Check if a number is a power of 2
 bool power_of_2(const unsigned n);
 
-// Add boundaries by symetry
-void symetrize(float * &img, float * &img_sym, const unsigned width, const unsigned height, const unsigned chnls, const unsigned N);
-IplImage * symetrize(IplImage * iplImage, const unsigned N);
-
-// Transform the color space of the image
-int color_space_transform(float * &img, const unsigned color_space, const unsigned width, const unsigned height, const unsigned chnls, const bool rgb2yuv);
-IplImage * color_space_transform(IplImage * iplImage, const bool rgb2yuv);
+// Matrix of a color space transform, applied on (red, green, blue)
+int color_space_matrix(const unsigned color_space, const bool rgb2yuv, float * mat);
 
 // Look for the closest power of 2 number
 int closest_power_of_2(const unsigned n);
@@ -30,23 +26,249 @@ int closest_power_of_2(const unsigned n);
 // Estimate sigma on each channel according to the choice of the color_space
 int estimate_sigma(const float sigma, float * sigma_table, const unsigned chnls, const unsigned color_space);
 
+// Number of indices of a set built by ind_initialize() or ind_fill()
+unsigned ind_count(const unsigned max_size, const unsigned N, const unsigned step);
+
+// Fill a set of indices in a buffer of ind_count() values
+void ind_fill(unsigned * ind_set, const unsigned max_size, const unsigned N, const unsigned step, unsigned &size);
+
 // Initialize a set of indices
 void ind_initialize(unsigned * &ind_set, const unsigned max_size, const unsigned N, const unsigned step, unsigned &size);
 
 // For convenience
 unsigned ind_size(const unsigned max_size, const unsigned N, const unsigned step);
 
+#ifdef _BM3D_USE_FFTW
 // Initialize a 2D fftwf_plan with some parameters
 void allocate_plan_2d(fftwf_plan* plan, const unsigned N, const fftwf_r2r_kind kind, const unsigned nb);
 
 // Initialize a 1D fftwf_plan with some parameters
 void allocate_plan_1d(fftwf_plan* plan, const unsigned N, const fftwf_r2r_kind kind, const unsigned nb);
 
+// Number of patches transformed by one execution of a cached 2D plan
+#define FFTW_PLAN_BATCH   256
+
+// Wisdom file of the plan cache, and environment variable to override it
+#define FFTW_WISDOM_FILE  "bm3d_fftw.wisdom"
+#define FFTW_WISDOM_ENV   "BM3D_FFTW_WISDOM"
+
+// Environment variable selecting the planner (estimate, measure or patient)
+#define FFTW_PLANNER_ENV  "BM3D_FFTW_PLANNER"
+
+// Get a 2D fftwf_plan from the plan cache, built on first use
+fftwf_plan plan_cache_get_2d(const unsigned N, const fftwf_r2r_kind kind, const unsigned nb, const int alignment);
+
+// Destroy the cached plans
+void plan_cache_clear();
+#endif      // #ifdef _BM3D_USE_FFTW
+
 // Tabulated values of log2(2^n)
 unsigned ind_log2(const unsigned N);
 
 // Tabulated values of 2^N
 unsigned ind_pow2(const unsigned N);
 
+// Conversion from single to half precision
+unsigned short float_to_half(const float f);
+
+// Conversion from half to single precision
+float half_to_float(const unsigned short h);
+
+// Memory budget given by BM3D_MEMORY_BUDGET_ENV, 0 if none
+size_t memory_budget_env();
+
+// Cache of the 2D transforms enabled by BM3D_SPECTRUM_CACHE_ENV
+bool spectrum_cache_env();
+
+// Peak of the memory used by the process
+size_t peak_memory_bytes();
+
+// Raw planar raster: chnls planes of width x height samples of depth
+// SR_DEPTH_8U, SR_DEPTH_16U or SR_DEPTH_32F, in the byte order of the
+// machine, stored row by row after a header of offset bytes. For color
+// images the planes are red, green and blue. The samples are read and
+// written row by row, from a file (with stdio or memory-mapped) or from
+// memory, so the raster never has to be loaded whole
+struct RasterFile
+{
+	FILE * file;                   // file used with stdio, NULL otherwise
+	char * data;                   // samples in memory or mapping of the file, NULL otherwise
+	size_t mapped_bytes;           // size of the mapping, 0 if data is not mapped
+	unsigned width;
+	unsigned height;
+	unsigned chnls;
+	int depth;
+	unsigned long long offset;     // size of the header
+	RasterFile() : file(NULL), data(NULL), mapped_bytes(0), width(0), height(0), chnls(0), depth(0), offset(0) {}
+
+	// Size of a sample
+	unsigned sample_bytes() const { return (depth & 0xFF) / 8; }
+
+	// Position of the sample (i, j) of the channel c
+	unsigned long long position(const unsigned c, const unsigned i, const unsigned j) const
+	{
+		return offset + (((unsigned long long)c * height + i) * width + j) * sample_bytes();
+	}
+};
+
+// Open a raw planar raster file, to read it or to create it
+bool raster_open(RasterFile & raster, const char * name, const bool write, const bool map, const unsigned width,
+	const unsigned height, const unsigned chnls, const int depth, const unsigned long long offset);
+
+// Use samples in memory as a raw planar raster
+void raster_attach(RasterFile & raster, void * data, const unsigned width, const unsigned height,
+	const unsigned chnls, const int depth);
+
+// Read n samples of the row i of the channel c, from the column j
+bool raster_read(const RasterFile & raster, const unsigned c, const unsigned i, const unsigned j, const unsigned n,
+	void * buf);
+
+// Write n samples of the row i of the channel c, from the column j
+bool raster_write(const RasterFile & raster, const unsigned c, const unsigned i, const unsigned j, const unsigned n,
+	const void * buf);
+
+// Close a raster, flushing the written samples
+bool raster_close(RasterFile & raster);
+
+// Stages of BM3D whose memory is accounted
+#define MEM_STAGE_IMAGES          0    // noisy, basic and denoised images, tiles
+#define MEM_STAGE_BLOCK_MATCHING  1    // tables of distances and of similar patches
+#define MEM_STAGE_TABLES_2D       2    // tables of 2D transforms, spectrum caches
+#define MEM_STAGE_GROUPS          3    // scratch arenas: 3D groups and their buffers
+#define MEM_STAGE_AGGREGATION     4    // accumulators of the estimates
+#define MEM_STAGE_NB              5
+
+// Threads whose memory is accounted separately, numbered in the order of
+// their first allocation, the others are added to the last one
+#define MEM_THREADS_MAX           64
+
+// Environment variable enabling the accounting and its report at the end
+// of run_bm3d (any value but 0)
+#define BM3D_MEMORY_REPORT_ENV    "BM3D_MEMORY_REPORT"
+
+// Current and peak bytes of a stage
+struct MemStageStats
+{
+	size_t current;
+	size_t peak;
+	MemStageStats() : current(0), peak(0) {}
+};
+
+// Memory of all the stages: per stage and per thread, and for the whole
+// process, with the part of each stage at the peak of the process
+struct MemStats
+{
+	MemStageStats thread[MEM_THREADS_MAX][MEM_STAGE_NB];
+	MemStageStats stage[MEM_STAGE_NB];
+	MemStageStats total;
+	size_t at_peak[MEM_STAGE_NB];
+	unsigned nb_threads;               // threads which allocated, up to MEM_THREADS_MAX
+	MemStats() : nb_threads(0) { for (unsigned k = 0; k < MEM_STAGE_NB; k++) at_peak[k] = 0; }
+};
+
+// True when the accounting is enabled. Read it through mem_stats_add()
+extern bool mem_stats_on;
+
+// Record an allocation (bytes > 0) or a release (bytes < 0) of a stage
+void mem_stats_update(const unsigned stage, const long long bytes);
+
+// Record an allocation or a release of a stage, nothing when disabled
+inline void mem_stats_add(const unsigned stage, const long long bytes)
+{
+	if (mem_stats_on)
+		mem_stats_update(stage, bytes);
+}
+
+// Enable or disable the accounting
+void mem_stats_enable(const bool enable);
+
+// Copy of the accounting so far
+void mem_stats_get(MemStats & stats);
+
+// Reset the peaks to the current values
+void mem_stats_reset_peaks();
+
+// Name of a stage
+const char * mem_stage_name(const unsigned stage);
+
+// Print the peaks of the stages and of the threads
+void mem_stats_report();
+
+// Environment variable selecting the pages of the large planes (images,
+// block matching tables, tables of 2D transforms, accumulators): "off"
+// (default), "thp" (transparent huge pages, through madvise) or "hugetlb"
+// (huge pages reserved by the system, thp when none is left)
+#define BM3D_HUGE_PAGES_ENV  "BM3D_HUGE_PAGES"
+#define HUGE_PAGES_OFF       0
+#define HUGE_PAGES_THP       1
+#define HUGE_PAGES_HUGETLB   2
+
+// Size of a huge page. Smaller planes are never backed by huge pages
+#define HUGE_PAGE_BYTES      (2 * 1024 * 1024)
+
+// Pages of the large planes, given by BM3D_HUGE_PAGES_ENV
+unsigned huge_pages_mode();
+
+// Allocate a large plane of a stage, backed by huge pages if enabled. NULL
+// if the allocation fails
+void * plane_alloc(const size_t bytes, const bool zero, const unsigned stage);
+
+template <class T>
+T * plane_alloc(const size_t n, const bool zero, const unsigned stage)
+{
+	return (T *)plane_alloc(n * sizeof(T), zero, stage);
+}
+
+// Free a plane given by plane_alloc()
+void plane_free(void * plane);
+
+// Account a plane given by plane_alloc() to another stage
+void plane_stage(void * plane, const unsigned stage);
+
+// Sizes of the planes freed so far, and of their parts backed by huge pages
+void huge_pages_stats(unsigned long long & plane_bytes, unsigned long long & huge_bytes);
+
+// Alignment of the buffers given by a ScratchArena
+#define ARENA_ALIGN_BYTES  64
+
+// Bump allocator for the scratch buffers of a denoising step. The memory
+// is reserved once, then buffers are taken from it and given back by
+// rewinding to a mark, so the steady state makes no heap call. Each
+// thread must use its own arena.
+struct ScratchArena
+{
+	ScratchArena();
+	~ScratchArena();
+
+	// Reserve the memory of the arena (the only heap call)
+	bool reserve(const size_t bytes);
+
+	// Take a buffer of bytes bytes, aligned on ARENA_ALIGN_BYTES. NULL if
+	// the arena is exhausted
+	void * alloc(const size_t bytes);
+
+	template <class T>
+	T * alloc(const size_t n) { return (T *)alloc(n * sizeof(T)); }
+
+	// Current position, and release of every buffer taken after it
+	size_t mark() const { return used; }
+	void rewind(const size_t m) { used = m; }
+
+	// Size taken in the arena by a buffer of bytes bytes
+	static size_t aligned(const size_t bytes)
+	{
+		return (bytes + ARENA_ALIGN_BYTES - 1) / ARENA_ALIGN_BYTES * ARENA_ALIGN_BYTES;
+	}
+
+	char * memory;
+	char * base;
+	size_t size;
+	size_t used;
+	size_t peak;
+
+private:
+	ScratchArena(const ScratchArena &);
+	ScratchArena & operator=(const ScratchArena &);
+};
 
 #endif // UTILITIES_H_INCLUDED